@@ -0,0 +1,66 @@
+// Measures the state store with as many keys as a large project accumulates, using the
+// same key and value shapes as the build steps.
+//
+// Usage: bench-db [keys]
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include <stdlib.h>
+
+#include "bench.h"
+#include "kikai-utils.h"
+
+static gchar *make_key(guint i) {
+  g_autofree gchar *id = kikai_hash_bytes((gchar *)&i, sizeof(i), NULL);
+  return g_strjoin("::", "build-autotools", id, "configure", NULL);
+}
+
+int main(int argc, char **argv) {
+  guint count = argc > 1 ? atoi(argv[1]) : 20000;
+
+  GFile *tmp = bench_tmpdir();
+  if (!kikai_db_load(tmp)) {
+    return 1;
+  }
+
+  // The second half of the keys is never written, for measuring misses.
+  g_autoptr(GPtrArray) keys = g_ptr_array_new_with_free_func(g_free);
+  for (guint i = 0; i < count * 2; i++) {
+    g_ptr_array_add(keys, make_key(i));
+  }
+  g_autofree gchar *value = kikai_hash_bytes("value", -1, NULL);
+
+  gint64 start = g_get_monotonic_time();
+  for (guint i = 0; i < count; i++) {
+    if (!kikai_db_set(keys->pdata[i], value)) {
+      return 1;
+    }
+  }
+  bench_report("db", "set", count, 0, g_get_monotonic_time() - start);
+
+  // Look the keys up in a different order than they were written.
+  GRand *rand = g_rand_new_with_seed(0);
+  start = g_get_monotonic_time();
+  for (guint i = 0; i < count; i++) {
+    gchar *result = kikai_db_get(keys->pdata[g_rand_int_range(rand, 0, count)]);
+    if (result == NULL || result == &kikai_db_missing) {
+      return 1;
+    }
+    g_free(result);
+  }
+  bench_report("db", "get", count, 0, g_get_monotonic_time() - start);
+  g_rand_free(rand);
+
+  start = g_get_monotonic_time();
+  for (guint i = 0; i < count; i++) {
+    if (kikai_db_get(keys->pdata[count + i]) != &kikai_db_missing) {
+      return 1;
+    }
+  }
+  bench_report("db", "get-missing", count, 0, g_get_monotonic_time() - start);
+
+  kikai_db_close();
+  bench_cleanup(tmp);
+  return 0;
+}
@@ -0,0 +1,107 @@
+// Measures extraction of archives with many small files and with a few huge ones.
+//
+// Usage: bench-extract [small-files] [huge-files] [huge-file-mb]
+
+#include <archive.h>
+#include <archive_entry.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include <stdlib.h>
+
+#include "bench.h"
+#include "kikai-source.h"
+#include "kikai-utils.h"
+
+static gboolean write_archive(GFile *path, guint files, gsize file_size) {
+  struct archive *writer = archive_write_new();
+  archive_write_set_format_pax_restricted(writer);
+  if (archive_write_open_filename(writer, g_file_get_path(path)) != ARCHIVE_OK) {
+    g_printerr("Creating archive: %s", archive_error_string(writer));
+    archive_write_free(writer);
+    return FALSE;
+  }
+
+  // Compressible but not trivially so, like source code.
+  g_autofree gchar *data = g_malloc(file_size);
+  for (gsize i = 0; i < file_size; i++) {
+    data[i] = "abcdefghijklmnopqrstuvwxyz \n"[(i * 7 + i / 13) % 28];
+  }
+
+  struct archive_entry *entry = archive_entry_new();
+  gboolean success = TRUE;
+
+  for (guint i = 0; success && i < files; i++) {
+    g_autofree gchar *name = g_strdup_printf("package-1.0/dir%03u/file%06u.c", i / 100,
+                                             i);
+    archive_entry_clear(entry);
+    archive_entry_set_pathname(entry, name);
+    archive_entry_set_filetype(entry, AE_IFREG);
+    archive_entry_set_perm(entry, 0644);
+    archive_entry_set_size(entry, file_size);
+
+    if (archive_write_header(writer, entry) != ARCHIVE_OK ||
+        archive_write_data(writer, data, file_size) != file_size) {
+      g_printerr("Writing archive: %s", archive_error_string(writer));
+      success = FALSE;
+    }
+  }
+
+  archive_entry_free(entry);
+  archive_write_close(writer);
+  archive_write_free(writer);
+  return success;
+}
+
+static gboolean bench_extract(GFile *tmp, const gchar *name, guint files,
+                              gsize file_size) {
+  g_autofree gchar *archive_name = g_strconcat(name, ".tar", NULL);
+  g_autoptr(GFile) archive = g_file_get_child(tmp, archive_name);
+  g_autoptr(GFile) extracted = g_file_get_child(tmp, name);
+
+  if (!write_archive(archive, files, file_size) || !kikai_mkdir_parents(extracted)) {
+    return FALSE;
+  }
+
+  g_autoptr(GFileInfo) info = g_file_query_info(archive, G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                                                G_FILE_QUERY_INFO_NONE, NULL, NULL);
+  guint64 size = g_file_info_get_size(info);
+
+  int saved = bench_quiet_begin();
+  gint64 start = g_get_monotonic_time();
+  gboolean success = kikai_source_extract(archive, extracted, size, 1, NULL);
+  gint64 elapsed = g_get_monotonic_time() - start;
+  bench_quiet_end(saved);
+
+  if (success) {
+    bench_report("extract", name, files, (guint64)files * file_size, elapsed);
+  }
+
+  // Extracting the same archive again compares every entry and writes none of them.
+  KikaiSourceChanges changes = {0};
+  saved = bench_quiet_begin();
+  start = g_get_monotonic_time();
+  success = success && kikai_source_extract(archive, extracted, size, 1, &changes);
+  elapsed = g_get_monotonic_time() - start;
+  bench_quiet_end(saved);
+
+  if (success) {
+    bench_report("reextract", name, files, (guint64)files * file_size, elapsed);
+  }
+
+  return success && kikai_rmtree(extracted);
+}
+
+int main(int argc, char **argv) {
+  guint small_files = argc > 1 ? atoi(argv[1]) : 20000;
+  guint huge_files = argc > 2 ? atoi(argv[2]) : 4;
+  gsize huge_size = (argc > 3 ? atoi(argv[3]) : 128) * (gsize)1024 * 1024;
+
+  GFile *tmp = bench_tmpdir();
+  gboolean success = bench_extract(tmp, "many-small", small_files, 1024) &&
+                     bench_extract(tmp, "few-huge", huge_files, huge_size);
+  bench_cleanup(tmp);
+
+  return success ? 0 : 1;
+}
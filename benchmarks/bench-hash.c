@@ -0,0 +1,77 @@
+// Measures kikai_hash_bytes on small keys and large buffers, and the hashing done while
+// downloading, using a local file:// URL so the network stays out of the picture.
+//
+// Usage: bench-hash [small-count] [large-mb]
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include <stdlib.h>
+
+#include "bench.h"
+#include "kikai-source.h"
+#include "kikai-utils.h"
+
+static void bench_small(guint count) {
+  gint64 start = g_get_monotonic_time();
+  for (guint i = 0; i < count; i++) {
+    gchar name[32];
+    g_snprintf(name, sizeof(name), "module-%u", i);
+    g_free(kikai_hash_bytes(name, -1, NULL));
+  }
+
+  bench_report("hash", "small-keys", count, 0, g_get_monotonic_time() - start);
+}
+
+static void bench_large(const gchar *data, gsize size) {
+  gint64 start = g_get_monotonic_time();
+  g_free(kikai_hash_bytes(data, (gint)size, NULL));
+  bench_report("hash", "large-buffer", 0, size, g_get_monotonic_time() - start);
+}
+
+static gboolean bench_download(GFile *tmp, const gchar *data, gsize size) {
+  g_autoptr(GFile) source = g_file_get_child(tmp, "source.tar");
+  g_autoptr(GFile) target = g_file_get_child(tmp, "download");
+
+  g_autoptr(GError) error = NULL;
+  if (!g_file_replace_contents(source, data, size, NULL, FALSE, G_FILE_CREATE_NONE, NULL,
+                               NULL, &error)) {
+    g_printerr("Failed to write download source: %s", error->message);
+    return FALSE;
+  }
+
+  g_autofree gchar *url = g_file_get_uri(source);
+  g_autofree gchar *hash = NULL;
+  guint64 downloaded = 0;
+
+  int saved = bench_quiet_begin();
+  gint64 start = g_get_monotonic_time();
+  gboolean success = kikai_source_download(url, target, &hash, &downloaded);
+  gint64 elapsed = g_get_monotonic_time() - start;
+  bench_quiet_end(saved);
+
+  if (success) {
+    bench_report("hash", "download", 0, downloaded, elapsed);
+  }
+
+  return success;
+}
+
+int main(int argc, char **argv) {
+  guint small_count = argc > 1 ? atoi(argv[1]) : 1000000;
+  gsize large_size = (argc > 2 ? atoi(argv[2]) : 256) * (gsize)1024 * 1024;
+
+  g_autofree gchar *data = g_malloc(large_size);
+  for (gsize i = 0; i < large_size; i++) {
+    data[i] = (gchar)(i * 2654435761u >> 24);
+  }
+
+  bench_small(small_count);
+  bench_large(data, large_size);
+
+  GFile *tmp = bench_tmpdir();
+  gboolean success = bench_download(tmp, data, large_size);
+  bench_cleanup(tmp);
+
+  return success ? 0 : 1;
+}
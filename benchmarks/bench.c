@@ -0,0 +1,64 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "kikai-utils.h"
+
+GFile *bench_tmpdir() {
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *path = g_dir_make_tmp("kikai-bench-XXXXXX", &error);
+  if (path == NULL) {
+    g_printerr("Failed to create scratch directory: %s", error->message);
+    exit(1);
+  }
+
+  return g_file_new_for_path(path);
+}
+
+void bench_cleanup(GFile *dir) {
+  kikai_rmtree(dir);
+  g_object_unref(dir);
+}
+
+int bench_quiet_begin() {
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  dup2(null, STDOUT_FILENO);
+  close(null);
+  return saved;
+}
+
+void bench_quiet_end(int saved) {
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+}
+
+void bench_report(const gchar *benchmark, const gchar *name, guint64 items,
+                  guint64 bytes, gint64 elapsed_us) {
+  double seconds = elapsed_us / 1e6;
+  g_autoptr(GString) line = g_string_new(NULL);
+
+  g_string_append_printf(line, "{\"benchmark\": \"%s\", \"case\": \"%s\", "
+                         "\"seconds\": %.6f", benchmark, name, seconds);
+  if (items != 0) {
+    g_string_append_printf(line, ", \"items\": %" G_GUINT64_FORMAT
+                           ", \"items_per_second\": %.1f", items, items / seconds);
+  }
+  if (bytes != 0) {
+    g_string_append_printf(line, ", \"bytes\": %" G_GUINT64_FORMAT
+                           ", \"mb_per_second\": %.1f", bytes,
+                           bytes / seconds / (1024 * 1024));
+  }
+  g_string_append(line, "}");
+
+  puts(line->str);
+  fflush(stdout);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <glib.h>
+#include <gio/gio.h>
+
+// Creates a scratch directory, removed again by bench_cleanup.
+GFile *bench_tmpdir();
+void bench_cleanup(GFile *dir);
+
+// Sends stdout to /dev/null while the code being measured prints progress, returning
+// what's needed to restore it.
+int bench_quiet_begin();
+void bench_quiet_end(int saved);
+
+// Prints one result as a line of JSON. Either of items and bytes may be 0 when it
+// doesn't apply.
+void bench_report(const gchar *benchmark, const gchar *name, guint64 items,
+                  guint64 bytes, gint64 elapsed_us);
@@ -0,0 +1,296 @@
+#!/usr/bin/env python3
+# End-to-end benchmark of kikai's own overhead. It generates a spec with many small
+# modules, serves their tarballs over a local HTTP server, builds them against a fake NDK
+# whose compiler and make only touch files, and times cold, no-op and single-module runs.
+
+import argparse
+import functools
+import http.server
+import io
+import json
+import math
+import os
+import random
+import shutil
+import statistics
+import subprocess
+import sys
+import tarfile
+import tempfile
+import threading
+import time
+
+TRIPLE = 'armv7a-linux-androideabi'
+
+CONFIGURE = '''#!/bin/sh
+srcdir=$(dirname "$0")
+for arg; do
+  case "$arg" in
+    --prefix=*) prefix=${arg#--prefix=} ;;
+  esac
+done
+cat > Makefile <<EOF
+name=%(name)s
+prefix=$prefix
+srcdir=$srcdir
+EOF
+'''
+
+# Compiles every source the way a real makefile would, but with the stub compiler.
+MAKE = '''#!/bin/sh
+set -e
+for arg; do
+  case "$arg" in
+    DESTDIR=*) DESTDIR=${arg#DESTDIR=} ;;
+  esac
+done
+. ./Makefile
+objs=
+for src in "$srcdir"/src/*.c; do
+  obj=$(basename "$src" .c).o
+  "$CC" $CFLAGS -c "$src" -o "$obj"
+  objs="$objs $obj"
+done
+"$CC" -shared -o "lib$name.so" $objs
+mkdir -p "$DESTDIR$prefix/lib/pkgconfig" "$DESTDIR$prefix/include"
+cp "lib$name.so" "$DESTDIR$prefix/lib/"
+cp "$srcdir"/include/*.h "$DESTDIR$prefix/include/"
+printf 'Name: %s\\nVersion: 1.0\\nDescription: %s\\n' "$name" "$name" \\
+  > "$DESTDIR$prefix/lib/pkgconfig/$name.pc"
+'''
+
+# Writes its inputs to its output, so outputs change whenever the inputs do.
+CLANG = '''#!/bin/sh
+out=
+inputs=
+while [ $# -gt 0 ]; do
+  case "$1" in
+    -o) out=$2; shift ;;
+    -*) ;;
+    *) inputs="$inputs $1" ;;
+  esac
+  shift
+done
+[ -n "$out" ] && cat $inputs > "$out"
+exit 0
+'''
+
+MAKE_STANDALONE_TOOLCHAIN = '''#!/usr/bin/env python3
+import argparse, os, shutil
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--arch')
+parser.add_argument('--api')
+parser.add_argument('--stl')
+parser.add_argument('--force', action='store_true')
+parser.add_argument('--install-dir')
+args = parser.parse_args()
+
+ndk = os.path.dirname(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+shutil.rmtree(args.install_dir, ignore_errors=True)
+shutil.copytree(os.path.join(ndk, 'toolchains', 'llvm', 'prebuilt', 'linux-x86_64'),
+                args.install_dir, symlinks=True)
+'''
+
+
+def write_script(path, contents):
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    with open(path, 'w') as fp:
+        fp.write(contents)
+    os.chmod(path, 0o755)
+
+
+def make_fake_ndk(root):
+    write_script(os.path.join(root, 'build', 'tools', 'make_standalone_toolchain.py'),
+                 MAKE_STANDALONE_TOOLCHAIN)
+
+    prebuilt = os.path.join(root, 'toolchains', 'llvm', 'prebuilt', 'linux-x86_64')
+    for tool in ('clang', 'clang++'):
+        write_script(os.path.join(prebuilt, 'bin', '%s-%s' % (TRIPLE, tool)), CLANG)
+    write_script(os.path.join(prebuilt, 'bin', 'make'), MAKE)
+
+    # Something for the toolchain dedup pass to link against.
+    sysroot = os.path.join(prebuilt, 'sysroot', 'usr', 'include')
+    os.makedirs(sysroot, exist_ok=True)
+    for i in range(64):
+        with open(os.path.join(sysroot, 'header%d.h' % i), 'w') as fp:
+            fp.write('#define HEADER_%d %s\n' % (i, 'x' * 4096))
+
+    with open(os.path.join(root, 'source.properties'), 'w') as fp:
+        fp.write('Pkg.Desc = Fake NDK\nPkg.Revision = 0.0.0\n')
+
+
+def make_tarball(path, name, revision, files_per_module):
+    def add(tar, member, contents, mode=0o644):
+        data = contents.encode()
+        info = tarfile.TarInfo('%s-1.0/%s' % (name, member))
+        info.size = len(data)
+        info.mode = mode
+        tar.addfile(info, io.BytesIO(data))
+
+    with tarfile.open(path, 'w:gz') as tar:
+        add(tar, 'configure', CONFIGURE % {'name': name}, 0o755)
+        add(tar, 'include/%s.h' % name, 'int %s_version(void);\n' % name)
+        for i in range(files_per_module):
+            add(tar, 'src/%s_%d.c' % (name, i),
+                'int %s_%d(void) { return %d; }\n' % (name, i, revision))
+
+
+def make_graph(shape, count, seed):
+    rng = random.Random(seed)
+    deps = []
+    width = max(1, int(math.sqrt(count)))
+
+    for i in range(count):
+        if shape == 'flat' or i == 0:
+            deps.append([])
+        elif shape == 'chain':
+            deps.append([i - 1])
+        elif shape == 'tree':
+            deps.append([(i - 1) // 2])
+        elif shape == 'layered':
+            layer = i // width
+            if layer == 0:
+                deps.append([])
+            else:
+                previous = range((layer - 1) * width, layer * width)
+                deps.append(sorted(rng.sample(previous, min(3, len(previous)))))
+        else:
+            raise ValueError('unknown shape: %s' % shape)
+
+    return deps
+
+
+def module_name(i):
+    return 'm%04d' % i
+
+
+def write_spec(path, base_url, deps, extra_options):
+    lines = [
+        'install-root: install',
+        'toolchain:',
+        '  api: 21',
+        '  platforms: [arm]',
+        '  stl: libc++',
+        '  standalone: true',
+        'modules:',
+    ]
+
+    for i, module_deps in enumerate(deps):
+        name = module_name(i)
+        lines += [
+            '  %s:' % name,
+            '    dependencies: [%s]' % ', '.join(module_name(dep) for dep in module_deps),
+            '    sources:',
+            '      - url: %s/%s.tar.gz' % (base_url, name),
+            '        strip-parents: 1',
+            '    build:',
+            '      type: autotools',
+        ]
+        if name in extra_options:
+            lines.append('      configure-options: %s' % extra_options[name])
+
+    with open(path, 'w') as fp:
+        fp.write('\n'.join(lines) + '\n')
+
+
+def serve(root):
+    handler = functools.partial(QuietHandler, directory=root)
+    server = http.server.ThreadingHTTPServer(('127.0.0.1', 0), handler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    return server
+
+
+class QuietHandler(http.server.SimpleHTTPRequestHandler):
+    def log_message(self, format, *args):
+        pass
+
+
+def run_kikai(kikai, project, env):
+    start = time.perf_counter()
+    result = subprocess.run([kikai], cwd=project, env=env, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.PIPE)
+    elapsed = time.perf_counter() - start
+
+    if result.returncode != 0:
+        sys.stderr.write(result.stderr.decode(errors='replace'))
+        raise SystemExit('kikai failed with status %d' % result.returncode)
+
+    return elapsed
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Benchmark kikai end to end.')
+    parser.add_argument('kikai', help='the kikai executable to benchmark')
+    parser.add_argument('--modules', type=int, default=100)
+    parser.add_argument('--shape', default='layered',
+                        choices=['flat', 'chain', 'tree', 'layered'])
+    parser.add_argument('--files-per-module', type=int, default=8)
+    parser.add_argument('--repeat', type=int, default=5,
+                        help='how many times to repeat the warm runs')
+    parser.add_argument('--seed', type=int, default=0)
+    parser.add_argument('--keep', action='store_true',
+                        help='keep the generated project for inspection')
+    args = parser.parse_args()
+
+    kikai = os.path.abspath(args.kikai)
+    root = tempfile.mkdtemp(prefix='kikai-bench-')
+
+    try:
+        ndk = os.path.join(root, 'ndk')
+        tarballs = os.path.join(root, 'tarballs')
+        project = os.path.join(root, 'project')
+        stubs = os.path.join(root, 'bin')
+        for path in (tarballs, project, stubs):
+            os.makedirs(path)
+
+        make_fake_ndk(ndk)
+        write_script(os.path.join(stubs, 'pkgconf'), '#!/bin/sh\nexit 0\n')
+
+        deps = make_graph(args.shape, args.modules, args.seed)
+        for i in range(args.modules):
+            make_tarball(os.path.join(tarballs, module_name(i) + '.tar.gz'),
+                         module_name(i), 0, args.files_per_module)
+
+        server = serve(tarballs)
+        base_url = 'http://127.0.0.1:%d' % server.server_address[1]
+        spec = os.path.join(project, 'kikai.yml')
+        write_spec(spec, base_url, deps, {})
+
+        env = dict(os.environ)
+        env.pop('ANDROID_NDK_ROOT', None)
+        env.pop('KIKAI_ARTIFACT_CACHE', None)
+        env['ANDROID_NDK'] = ndk
+        env['PATH'] = stubs + os.pathsep + env['PATH']
+
+        results = {
+            'shape': args.shape,
+            'modules': args.modules,
+            'files_per_module': args.files_per_module,
+        }
+
+        results['cold'] = run_kikai(kikai, project, env)
+        results['noop'] = [run_kikai(kikai, project, env) for _ in range(args.repeat)]
+
+        # Touching a module in the middle of the graph rebuilds it and its dependents.
+        touched = module_name(args.modules // 2)
+        results['touched_module'] = touched
+        results['touched'] = []
+        for i in range(args.repeat):
+            write_spec(spec, base_url, deps, {touched: '--enable-touch=%d' % i})
+            results['touched'].append(run_kikai(kikai, project, env))
+
+        for key in ('noop', 'touched'):
+            results[key + '_median'] = statistics.median(results[key])
+
+        server.shutdown()
+        print(json.dumps(results, indent=2))
+    finally:
+        if args.keep:
+            print('Generated project kept in %s' % root, file=sys.stderr)
+        else:
+            shutil.rmtree(root, ignore_errors=True)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,270 @@
+#include <archive.h>
+#include <archive_entry.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kikai-archive.h"
+#include "kikai-utils.h"
+
+gboolean kikai_archive_copy_data(struct archive *reader, struct archive *writer) {
+  for (;;) {
+    gconstpointer buffer;
+    gsize bufsz;
+    la_int64_t offs;
+
+    int rc = archive_read_data_block(reader, &buffer, &bufsz, &offs);
+    if (rc == ARCHIVE_EOF) {
+      break;
+    } else if (rc < ARCHIVE_OK) {
+      g_printerr("Reading data block from archive: %s", archive_error_string(reader));
+      return FALSE;
+    }
+
+    rc = archive_write_data_block(writer, buffer, bufsz, offs);
+    if (rc < ARCHIVE_OK) {
+      g_printerr("Writing data block from archive: %s", archive_error_string(writer));
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+// The change time is used rather than the modification time, since install scripts
+// are free to preserve the latter.
+static gchar *stat_signature(struct stat *st) {
+  return g_strdup_printf("%" G_GUINT64_FORMAT ":%" G_GINT64_FORMAT ".%ld:%"
+                         G_GINT64_FORMAT, (guint64)st->st_ino,
+                         (gint64)st->st_ctim.tv_sec, st->st_ctim.tv_nsec,
+                         (gint64)st->st_size);
+}
+
+static gboolean snapshot_file(const gchar *relative, const gchar *path, struct stat *st,
+                              gpointer user_data) {
+  GHashTable *snapshot = user_data;
+  g_hash_table_insert(snapshot, g_strdup(relative), stat_signature(st));
+  return TRUE;
+}
+
+GHashTable *kikai_tree_snapshot(GFile *root) {
+  GHashTable *snapshot = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  if (!kikai_tree_walk(g_file_get_path(root), snapshot_file, snapshot)) {
+    g_hash_table_unref(snapshot);
+    return NULL;
+  }
+
+  return snapshot;
+}
+
+typedef struct {
+  GHashTable *snapshot;
+  GPtrArray *changes;
+} ChangesData;
+
+static gboolean collect_change(const gchar *relative, const gchar *path, struct stat *st,
+                               gpointer user_data) {
+  ChangesData *data = user_data;
+
+  const gchar *old_signature = g_hash_table_lookup(data->snapshot, relative);
+  g_autofree gchar *signature = stat_signature(st);
+  if (old_signature == NULL || strcmp(old_signature, signature) != 0) {
+    g_ptr_array_add(data->changes, g_strdup(relative));
+  }
+
+  return TRUE;
+}
+
+GPtrArray *kikai_tree_changes(GFile *root, GHashTable *snapshot) {
+  ChangesData data = {.snapshot = snapshot,
+                      .changes = g_ptr_array_new_with_free_func(g_free)};
+  if (!kikai_tree_walk(g_file_get_path(root), collect_change, &data)) {
+    g_ptr_array_unref(data.changes);
+    return NULL;
+  }
+
+  return data.changes;
+}
+
+static gboolean pack_file(struct archive *writer, const gchar *relative,
+                          const gchar *path) {
+  struct stat st;
+  if (lstat(path, &st) == -1) {
+    g_printerr("Failed to stat %s: %s", path, strerror(errno));
+    return FALSE;
+  }
+
+  struct archive_entry *entry = archive_entry_new();
+  archive_entry_copy_stat(entry, &st);
+  archive_entry_set_pathname(entry, relative);
+
+  gboolean success = FALSE;
+  int fd = -1;
+
+  if (S_ISLNK(st.st_mode)) {
+    g_autoptr(GError) error = NULL;
+    g_autofree gchar *target = g_file_read_link(path, &error);
+    if (target == NULL) {
+      g_printerr("Failed to read link %s: %s", path, error->message);
+      goto done;
+    }
+
+    archive_entry_set_symlink(entry, target);
+  } else if (S_ISREG(st.st_mode)) {
+    fd = g_open(path, O_RDONLY, 0);
+    if (fd == -1) {
+      g_printerr("Failed to open %s: %s", path, strerror(errno));
+      goto done;
+    }
+  }
+
+  if (archive_write_header(writer, entry) < ARCHIVE_OK) {
+    g_printerr("Writing archive entry header: %s", archive_error_string(writer));
+    goto done;
+  }
+
+  if (fd != -1) {
+    gchar buffer[65536];
+    gssize bytes;
+    while ((bytes = read(fd, buffer, sizeof(buffer))) > 0) {
+      if (archive_write_data(writer, buffer, bytes) < 0) {
+        g_printerr("Writing archive data: %s", archive_error_string(writer));
+        goto done;
+      }
+    }
+
+    if (bytes == -1) {
+      g_printerr("Failed to read %s: %s", path, strerror(errno));
+      goto done;
+    }
+  }
+
+  success = TRUE;
+
+  done:
+  if (fd != -1) {
+    close(fd);
+  }
+  archive_entry_free(entry);
+  return success;
+}
+
+gboolean kikai_archive_pack(GFile *root, GPtrArray *paths, GFile *target) {
+  g_autofree gchar *target_path = g_file_get_path(target);
+  // The archive is written next to its final location and renamed into place, so a
+  // shared cache never exposes partial archives.
+  g_autofree gchar *tmp_path = g_strdup_printf("%s.tmp.%d", target_path, getpid());
+
+  struct archive *writer = archive_write_new();
+  gboolean success = FALSE;
+
+  if (archive_write_add_filter_zstd(writer) != ARCHIVE_OK ||
+      archive_write_set_format_pax_restricted(writer) != ARCHIVE_OK) {
+    g_printerr("Setting archive format: %s", archive_error_string(writer));
+    goto done;
+  }
+
+  if (archive_write_open_filename(writer, tmp_path) != ARCHIVE_OK) {
+    g_printerr("Creating archive: %s", archive_error_string(writer));
+    goto done;
+  }
+
+  for (int i = 0; i < paths->len; i++) {
+    const gchar *relative = g_ptr_array_index(paths, i);
+    g_autoptr(GFile) file = g_file_resolve_relative_path(root, relative);
+    if (!pack_file(writer, relative, g_file_get_path(file))) {
+      goto done;
+    }
+  }
+
+  if (archive_write_close(writer) != ARCHIVE_OK) {
+    g_printerr("Finishing archive: %s", archive_error_string(writer));
+    goto done;
+  }
+
+  if (g_rename(tmp_path, target_path) == -1) {
+    g_printerr("Failed to move archive into place: %s", strerror(errno));
+    goto done;
+  }
+
+  success = TRUE;
+
+  done:
+  archive_write_free(writer);
+  if (!success) {
+    g_unlink(tmp_path);
+  }
+  return success;
+}
+
+gboolean kikai_archive_unpack(GFile *archive, GFile *root) {
+  struct archive *reader = archive_read_new(), *writer = archive_write_disk_new();
+  gboolean success = FALSE;
+
+  if (archive_read_support_filter_all(reader) == ARCHIVE_FATAL ||
+      archive_read_support_format_all(reader) == ARCHIVE_FATAL) {
+    g_printerr("Loading archive formats: %s", archive_error_string(reader));
+    goto done;
+  }
+
+  if (archive_write_disk_set_options(writer, ARCHIVE_EXTRACT_TIME |
+                                             ARCHIVE_EXTRACT_PERM |
+                                             ARCHIVE_EXTRACT_SECURE_NODOTDOT |
+                                             ARCHIVE_EXTRACT_SECURE_SYMLINKS)
+      == ARCHIVE_FATAL) {
+    g_printerr("Setting writer options: %s", archive_error_string(writer));
+    goto done;
+  }
+
+  if (archive_read_open_filename(reader, g_file_get_path(archive), 65536) != ARCHIVE_OK) {
+    g_printerr("Reading archive: %s", archive_error_string(reader));
+    goto done;
+  }
+
+  for (;;) {
+    struct archive_entry *entry;
+    int rc = archive_read_next_header(reader, &entry);
+    if (rc == ARCHIVE_EOF) {
+      break;
+    } else if (rc < ARCHIVE_OK) {
+      g_printerr("Reading archive entry header: %s", archive_error_string(reader));
+      goto done;
+    }
+
+    g_autofree gchar *path = g_build_filename(g_file_get_path(root),
+                                              archive_entry_pathname(entry), NULL);
+    archive_entry_copy_pathname(entry, path);
+
+    rc = archive_write_header(writer, entry);
+    if (rc < ARCHIVE_OK) {
+      g_printerr("Writing archive entry header: %s", archive_error_string(writer));
+      goto done;
+    }
+
+    if (archive_entry_size(entry) > 0 && !kikai_archive_copy_data(reader, writer)) {
+      goto done;
+    }
+
+    rc = archive_write_finish_entry(writer);
+    if (rc < ARCHIVE_WARN) {
+      g_printerr("Finishing archive entry: %s", archive_error_string(writer));
+      goto done;
+    }
+  }
+
+  success = TRUE;
+
+  done:
+  archive_read_close(reader);
+  archive_read_free(reader);
+  archive_write_close(writer);
+  archive_write_free(writer);
+
+  return success;
+}
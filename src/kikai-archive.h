@@ -0,0 +1,13 @@
+#pragma once
+
+#include <archive.h>
+#include <glib.h>
+#include <gio/gio.h>
+
+gboolean kikai_archive_copy_data(struct archive *reader, struct archive *writer);
+
+GHashTable *kikai_tree_snapshot(GFile *root);
+GPtrArray *kikai_tree_changes(GFile *root, GHashTable *snapshot);
+
+gboolean kikai_archive_pack(GFile *root, GPtrArray *paths, GFile *target);
+gboolean kikai_archive_unpack(GFile *archive, GFile *root);
@@ -0,0 +1,111 @@
+#include <glib.h>
+#include <gio/gio.h>
+
+#include <string.h>
+
+#include "kikai-archive.h"
+#include "kikai-artifact.h"
+#include "kikai-build.h"
+#include "kikai-install.h"
+#include "kikai-utils.h"
+
+static GFile *kikai_artifacts = NULL;
+
+gboolean kikai_artifact_init(GFile *storage, const gchar *cache) {
+  // The environment takes priority, so a shared cache can be plugged in without
+  // touching kikai.yml.
+  const gchar *override = g_getenv("KIKAI_ARTIFACT_CACHE");
+  if (override != NULL && *override != '\0') {
+    cache = override;
+  }
+
+  kikai_artifacts = cache != NULL ? g_file_new_for_path(cache)
+                    : g_file_get_child(storage, "artifacts");
+  return kikai_mkdir_parents(kikai_artifacts);
+}
+
+gchar *kikai_artifact_key(KikaiModuleSpec *module, GChecksum *sources,
+                          KikaiToolchain *toolchain, GFile *prefix, GHashTable *keys) {
+  g_autoptr(GChecksum) sha = g_checksum_new(G_CHECKSUM_SHA256);
+  g_autofree gchar *build_hash = kikai_build_hash(module->build);
+
+  kikai_checksum_update_string(sha, module->name);
+  kikai_checksum_update_string(sha, g_checksum_get_string(sources));
+  kikai_checksum_update_string(sha, build_hash);
+  if (module->strip) {
+    kikai_checksum_update_string(sha, "strip");
+  }
+  kikai_checksum_update_string(sha, toolchain->id);
+  // Installed files tend to embed their prefix (pkg-config files, libtool archives), so
+  // it's only left out for trees that are known not to.
+  g_autofree gchar *prefix_path = prefix != NULL ? g_file_get_path(prefix) : NULL;
+  kikai_checksum_update_string(sha, prefix_path);
+
+  for (gchar **dep = (gchar **)module->dependencies->data; *dep; dep++) {
+    g_autofree gchar *dep_key = g_strjoin("::", *dep, toolchain->platform, NULL);
+    kikai_checksum_update_string(sha, g_hash_table_lookup(keys, dep_key));
+  }
+
+  return g_strdup(g_checksum_get_string(sha));
+}
+
+static GFile *get_archive(const gchar *key) {
+  g_autofree gchar *prefix = g_strndup(key, 2);
+  g_autofree gchar *name = g_strconcat(key, ".tar.zst", NULL);
+  return kikai_join(kikai_artifacts, prefix, name, NULL);
+}
+
+gboolean kikai_artifact_restore(GFile *storage, const gchar *module_id,
+                                const gchar *platform, const gchar *key, GFile *staged,
+                                GFile *prefix, gboolean *cached, gboolean *installed) {
+  g_autoptr(GFile) archive = get_archive(key);
+  *cached = *installed = FALSE;
+  if (!g_file_query_exists(archive, NULL)) {
+    return TRUE;
+  }
+
+  *cached = TRUE;
+
+  g_autofree gchar *db_key = g_strjoin("::", "artifact", module_id, platform, NULL);
+  g_autofree gchar *current = kikai_db_get(db_key);
+  if (current == NULL) {
+    return FALSE;
+  } else if (current == &kikai_db_missing) {
+    g_steal_pointer(&current);
+  } else if (strcmp(current, key) == 0 &&
+             kikai_install_is_merged(storage, module_id, platform, prefix)) {
+    // Unless the prefix lost some of it, e.g. to rm -rf, this key is installed already.
+    return TRUE;
+  }
+
+  kikai_printstatus("build", "  - restore from cache");
+
+  if (!kikai_rmtree(staged) || !kikai_mkdir_parents(staged) ||
+      !kikai_archive_unpack(archive, staged)) {
+    return FALSE;
+  }
+
+  *installed = TRUE;
+  return kikai_db_set(db_key, key);
+}
+
+gboolean kikai_artifact_store(const gchar *module_id, const gchar *platform,
+                              const gchar *key, GFile *staged) {
+  g_autoptr(GPtrArray) paths = g_ptr_array_new_with_free_func(g_free);
+  if (!kikai_tree_list(g_file_get_path(staged), paths)) {
+    return FALSE;
+  } else if (paths->len == 0) {
+    // Either nothing was installed or the build wrote straight into the prefix, and an
+    // empty archive would hide the latter on restore.
+    return TRUE;
+  }
+
+  g_autoptr(GFile) archive = get_archive(key);
+  g_autoptr(GFile) parent = g_file_get_parent(archive);
+  if (!kikai_mkdir_parents(parent) || !kikai_archive_pack(staged, paths, archive)) {
+    return FALSE;
+  }
+
+  g_autofree gchar *db_key = g_strjoin("::", "artifact", module_id, platform, NULL);
+  return kikai_db_set(db_key, key);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "kikai-builderspec.h"
+#include "kikai-toolchain.h"
+
+gboolean kikai_artifact_init(GFile *storage, const gchar *cache);
+// Hashes everything a module's installed tree depends on. prefix may be NULL, for the
+// key of a tree that doesn't mention it.
+gchar *kikai_artifact_key(KikaiModuleSpec *module, GChecksum *sources,
+                          KikaiToolchain *toolchain, GFile *prefix, GHashTable *keys);
+gboolean kikai_artifact_restore(GFile *storage, const gchar *module_id,
+                                const gchar *platform, const gchar *key, GFile *staged,
+                                GFile *prefix, gboolean *cached, gboolean *installed);
+gboolean kikai_artifact_store(const gchar *module_id, const gchar *platform,
+                              const gchar *key, GFile *staged);
@@ -1,10 +1,17 @@
 #include <glib.h>
 
+#include "kikai-archive.h"
 #include "kikai-build.h"
+#include "kikai-ccache.h"
+#include "kikai-install.h"
+#include "kikai-spawn.h"
 #include "kikai-toolchain.h"
 #include "kikai-utils.h"
 
 #include <string.h>
+#include <unistd.h>
+
+#define null_or(value, if_null) ((value) != NULL ? (value) : (if_null))
 
 static gboolean needs_update(const gchar *scope, const gchar *module_id,
                              const gchar *step, const gchar *current_hash) {
@@ -28,6 +35,12 @@ static gboolean set_key(const gchar *scope, const gchar *module_id,
   return kikai_db_set(key, hash);
 }
 
+static GFile *get_log(GFile *logs, const gchar *step) {
+  g_autofree gchar *name = g_strconcat(step, ".log.gz", NULL);
+  g_strcanon(name, G_CSET_A_2_Z G_CSET_a_2_z G_CSET_DIGITS "-_.", '_');
+  return g_file_get_child(logs, name);
+}
+
 static gboolean parse_options(const gchar *step, GArray *dest, const gchar *options) {
   g_autoptr(GError) error = NULL;
 
@@ -49,69 +62,363 @@ static gboolean parse_options(const gchar *step, GArray *dest, const gchar *opti
   return TRUE;
 }
 
-static gboolean simple_build(KikaiToolchain *toolchain, const gchar *module_id,
-                             KikaiModuleBuildSpec spec, GFile *sources,
-                             GFile *buildroot, GFile *install, gboolean updated) {
+typedef struct {
+  GPtrArray *patterns, *matches;
+} StepInputs;
+
+static gboolean match_step_input(const gchar *relative, const gchar *path,
+                                 struct stat *st, gpointer user_data) {
+  StepInputs *inputs = user_data;
+
+  for (int i = 0; i < inputs->patterns->len; i++) {
+    if (g_pattern_match_string(inputs->patterns->pdata[i], relative)) {
+      g_ptr_array_add(inputs->matches, g_strdup(relative));
+      break;
+    }
+  }
+
+  return TRUE;
+}
+
+static gint compare_strings(gconstpointer a, gconstpointer b) {
+  return strcmp(*(const gchar **)a, *(const gchar **)b);
+}
+
+// Hashes a step's command along with the paths and contents of every file its input
+// globs match. Note that GPatternSpec globs let '*' match across directories.
+static gchar *hash_step(KikaiBuildContext *ctx, KikaiModuleSimpleBuildStep *step) {
+  if (step->inputs == NULL) {
+    return kikai_hash_bytes(step->run, -1, NULL);
+  }
+
+  g_autoptr(GChecksum) sha = g_checksum_new(G_CHECKSUM_SHA256);
+  kikai_checksum_update_string(sha, step->run);
+
+  StepInputs inputs = {
+    .patterns = g_ptr_array_new_with_free_func((GDestroyNotify)g_pattern_spec_free),
+    .matches = g_ptr_array_new_with_free_func(g_free),
+  };
+  for (int i = 0; i < step->inputs->len; i++) {
+    g_ptr_array_add(inputs.patterns,
+                    g_pattern_spec_new(g_array_index(step->inputs, gchar *, i)));
+  }
+
+  g_autofree gchar *sources = g_file_get_path(ctx->sources);
+  gboolean success = kikai_tree_walk(sources, match_step_input, &inputs);
+  g_ptr_array_sort(inputs.matches, compare_strings);
+
+  for (int i = 0; success && i < inputs.matches->len; i++) {
+    const gchar *relative = inputs.matches->pdata[i];
+    g_autofree gchar *path = g_build_filename(sources, relative, NULL);
+    g_autoptr(GError) error = NULL;
+
+    kikai_checksum_update_string(sha, relative);
+
+    if (g_file_test(path, G_FILE_TEST_IS_SYMLINK)) {
+      g_autofree gchar *target = g_file_read_link(path, &error);
+      if (target == NULL) {
+        g_printerr("Failed to read link %s: %s", path, error->message);
+        success = FALSE;
+        break;
+      }
+
+      kikai_checksum_update_string(sha, target);
+      continue;
+    }
+
+    GMappedFile *mapped = g_mapped_file_new(path, FALSE, &error);
+    if (mapped == NULL) {
+      g_printerr("Failed to read step input %s: %s", path, error->message);
+      success = FALSE;
+      break;
+    }
+
+    g_checksum_update(sha, (guchar *)g_mapped_file_get_contents(mapped),
+                      g_mapped_file_get_length(mapped));
+    g_mapped_file_unref(mapped);
+  }
+
+  g_ptr_array_free(inputs.patterns, TRUE);
+  g_ptr_array_free(inputs.matches, TRUE);
+  return success ? g_strdup(g_checksum_get_string(sha)) : NULL;
+}
+
+static gboolean step_outputs_exist(KikaiBuildContext *ctx,
+                                   KikaiModuleSimpleBuildStep *step) {
+  if (step->outputs == NULL) {
+    return TRUE;
+  }
+
+  for (int i = 0; i < step->outputs->len; i++) {
+    g_autoptr(GFile) output = g_file_get_child(ctx->buildroot,
+                                               g_array_index(step->outputs, gchar *, i));
+    if (!g_file_query_exists(output, NULL)) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+static gboolean simple_build(KikaiBuildContext *ctx, KikaiModuleBuildSpec spec,
+                             gboolean *installed) {
   g_auto(GStrv) env = g_get_environ();
-  env = g_environ_setenv(env, "KIKAI_SOURCES", g_file_get_path(sources), TRUE);
-  env = g_environ_setenv(env, "KIKAI_PREFIX", g_file_get_path(install), TRUE);
-  env = g_environ_setenv(env, "KIKAI_TOOLCHAIN", toolchain->path, TRUE);
-  env = g_environ_setenv(env, "KIKAI_TRIPLE", toolchain->triple, TRUE);
-  env = g_environ_setenv(env, "KIKAI_CC", toolchain->cc, TRUE);
-  env = g_environ_setenv(env, "KIKAI_CXX", toolchain->cxx, TRUE);
-
-  env = g_environ_setenv(env, "SOURCES", g_file_get_path(sources), TRUE);
-  env = g_environ_setenv(env, "PREFIX", g_file_get_path(install), TRUE);
-  env = g_environ_setenv(env, "CC", toolchain->cc, TRUE);
-  env = g_environ_setenv(env, "CXX", toolchain->cxx, TRUE);
+  env = g_environ_setenv(env, "KIKAI_SOURCES", g_file_get_path(ctx->sources), TRUE);
+  env = g_environ_setenv(env, "KIKAI_PREFIX", g_file_get_path(ctx->install), TRUE);
+  env = g_environ_setenv(env, "KIKAI_TOOLCHAIN", ctx->toolchain->path, TRUE);
+  env = g_environ_setenv(env, "KIKAI_TRIPLE", ctx->toolchain->triple, TRUE);
+  env = g_environ_setenv(env, "KIKAI_CC", ctx->toolchain->cc, TRUE);
+  env = g_environ_setenv(env, "KIKAI_CXX", ctx->toolchain->cxx, TRUE);
+
+  g_autofree gchar *jobs = g_strdup_printf("%u", ctx->jobs);
+  env = g_environ_setenv(env, "KIKAI_JOBS", jobs, TRUE);
+
+  g_autofree gchar *cc = kikai_ccache_wrap(ctx->toolchain->cc);
+  g_autofree gchar *cxx = kikai_ccache_wrap(ctx->toolchain->cxx);
+
+  env = g_environ_setenv(env, "KIKAI_DESTDIR", g_file_get_path(ctx->staging), TRUE);
 
+  env = g_environ_setenv(env, "SOURCES", g_file_get_path(ctx->sources), TRUE);
+  env = g_environ_setenv(env, "PREFIX", g_file_get_path(ctx->install), TRUE);
+  env = g_environ_setenv(env, "DESTDIR", g_file_get_path(ctx->staging), TRUE);
+  env = g_environ_setenv(env, "CC", cc, TRUE);
+  env = g_environ_setenv(env, "CXX", cxx, TRUE);
+
+  const gchar *flag_names[] = {"KIKAI_CFLAGS", "KIKAI_CPPFLAGS", "KIKAI_LDFLAGS"};
+  const gchar *flags[] = {spec.simple.cflags, spec.simple.cppflags, spec.simple.ldflags};
+  gboolean has_flags = FALSE;
+  for (int i = 0; i < G_N_ELEMENTS(flags); i++) {
+    if (flags[i] != NULL) {
+      env = g_environ_setenv(env, flag_names[i], flags[i], TRUE);
+      has_flags = TRUE;
+    }
+  }
+
+  // Steps are rerun when the flags they're given change.
+  g_autofree gchar *flags_hash = has_flags
+                                 ? kikai_hash_bytes(null_or(flags[0], ""), -1, "", 1,
+                                                    null_or(flags[1], ""), -1, "", 1,
+                                                    null_or(flags[2], ""), -1, NULL)
+                                 : NULL;
+
+  g_autoptr(GPtrArray) hashes = g_ptr_array_new_with_free_func(g_free);
+  gboolean rerun = ctx->changed || ctx->updated;
   for (int i = 0; i < spec.simple.steps->len; i++) {
     KikaiModuleSimpleBuildStep *step = &g_array_index(spec.simple.steps,
                                                       KikaiModuleSimpleBuildStep, i);
 
-    g_autofree gchar *hash = kikai_hash_bytes(step->run, -1, NULL);
-    if (!needs_update("build-simple", module_id, step->name, hash)) {
-      continue;
+    g_autofree gchar *step_hash = hash_step(ctx, step);
+    if (step_hash == NULL) {
+      return FALSE;
     }
+    gchar *hash = flags_hash != NULL
+                  ? kikai_hash_bytes(step_hash, -1, flags_hash, -1, NULL)
+                  : g_strdup(step_hash);
+    g_ptr_array_add(hashes, hash);
+
+    // An updated module may have a fresh buildroot, without any earlier step's outputs.
+    rerun = rerun || needs_update("build-simple", ctx->module_id, step->name, hash) ||
+            !step_outputs_exist(ctx, step);
+  }
+
+  if (!rerun) {
+    return TRUE;
+  }
+
+  // Staged files may be linked into the prefix, the store or the strip cache, so steps
+  // never write over them. Whatever is installed is staged again, by every step.
+  if (!kikai_rmtree(ctx->staging)) {
+    return FALSE;
+  }
+
+  for (int i = 0; i < spec.simple.steps->len; i++) {
+    KikaiModuleSimpleBuildStep *step = &g_array_index(spec.simple.steps,
+                                                      KikaiModuleSimpleBuildStep, i);
+    const gchar *hash = hashes->pdata[i];
 
     kikai_printstatus("build", "  - %s", step->name);
 
     g_autoptr(GError) error = NULL;
+    g_autoptr(GFile) log = get_log(ctx->logs, step->name);
 
     gchar *args[] = {"/bin/sh", "-ec", (gchar *)step->run, NULL};
-    gint status;
-    if (!g_spawn_sync(g_file_get_path(buildroot), args, env, G_SPAWN_DEFAULT, NULL, NULL,
-                        NULL, NULL, &status, &error)) {
-      g_printerr("Failed to spawn build step: %s", error->message);
+    if (!kikai_spawn(step->name, ctx->buildroot, args, env, G_SPAWN_DEFAULT, log,
+                     &error)) {
+      g_printerr("Build step %s failed: %s", step->name, error->message);
       return FALSE;
     }
 
-    if (!g_spawn_check_exit_status(status, &error)) {
-      g_printerr("Build step failed: %s", error->message);
+    if (!set_key("build-simple", ctx->module_id, step->name, hash)) {
       return FALSE;
     }
 
-    if (!set_key("build-simple", module_id, step->name, hash)) {
-      return FALSE;
+    *installed = TRUE;
+  }
+
+  return TRUE;
+}
+
+// Autoconf records the "precious" variables (CC, CFLAGS and friends) in its cache and
+// refuses to reuse it when they change, so the shared caches are keyed on every variable
+// assignment passed to configure, in addition to the toolchain itself.
+static GFile *get_autoconf_cache(GFile *storage, KikaiToolchain *toolchain,
+                                 GArray *configure_args) {
+  g_autoptr(GChecksum) sha = g_checksum_new(G_CHECKSUM_SHA256);
+  kikai_checksum_update_string(sha, toolchain->hash);
+
+  for (int i = 1; i < configure_args->len; i++) {
+    const gchar *arg = g_array_index(configure_args, gchar *, i);
+    if (arg[0] != '-' && strchr(arg, '=') != NULL) {
+      kikai_checksum_update_string(sha, arg);
     }
   }
 
+  g_autofree gchar *name = g_strdup_printf("%s-android%s-%.16s.cache",
+                                           toolchain->platform, toolchain->api,
+                                           g_checksum_get_string(sha));
+  return kikai_join(storage, "autoconf", name, NULL);
+}
+
+static gboolean spawn_configure(GFile *buildroot, GArray *configure_args, gchar **env,
+                                GFile *log, GError **error) {
+  if (!kikai_spawn("configure", buildroot, (gchar **)configure_args->data, env,
+                   G_SPAWN_DEFAULT, log, error)) {
+    g_prefix_error(error, "configure failed: ");
+    return FALSE;
+  }
+
   return TRUE;
 }
 
-#define null_or(value, if_null) ((value) != NULL ? (value) : (if_null))
+// Whether configure gave up because of its cache, e.g. "`CC' has changed since the
+// previous run" or "rm config.cache and start over".
+static gboolean failed_on_cache(GFile *buildroot) {
+  g_autoptr(GFile) config_log = g_file_get_child(buildroot, "config.log");
+  g_autofree gchar *contents = NULL;
+
+  if (!g_file_load_contents(config_log, NULL, &contents, NULL, NULL, NULL)) {
+    return FALSE;
+  }
+
+  g_auto(GStrv) lines = g_strsplit(contents, "\n", -1);
+  for (gchar **line = lines; *line; line++) {
+    if (strstr(*line, "error:") != NULL && strstr(*line, "cache") != NULL) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+static const gchar *get_autotools_versions() {
+  static gsize initialized = 0;
+  static gchar *versions = NULL;
+
+  if (g_once_init_enter(&initialized)) {
+    const gchar *tools[] = {"autoconf", "automake", "libtoolize", "autopoint", NULL};
+    GString *result = g_string_new(NULL);
+
+    for (const gchar **tool = tools; *tool; tool++) {
+      gchar *args[] = {(gchar *)*tool, "--version", NULL};
+      g_autofree gchar *output = NULL;
+      gint status;
+
+      if (g_spawn_sync(NULL, args, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_STDERR_TO_DEV_NULL,
+                       NULL, NULL, &output, NULL, &status, NULL) &&
+          g_spawn_check_exit_status(status, NULL)) {
+        gchar *newline = strchr(output, '\n');
+        if (newline != NULL) {
+          *newline = '\0';
+        }
+        g_string_append(result, output);
+      }
+      g_string_append_c(result, '\n');
+    }
+
+    versions = g_string_free(result, FALSE);
+    g_once_init_leave(&initialized, 1);
+  }
+
+  return versions;
+}
+
+// Runs autogen.sh or autoreconf, caching the files they generate by the hash of the
+// pristine sources and the versions of the autotools that generated them.
+static gboolean generate_build_system(GFile *storage, GFile *sources,
+                                      const gchar *sources_hash, gchar **env,
+                                      GFile *log) {
+  g_autoptr(GError) error = NULL;
+
+  g_autofree gchar *key = kikai_hash_bytes(sources_hash, -1, get_autotools_versions(), -1,
+                                           NULL);
+  g_autofree gchar *archive_name = g_strconcat(key, ".tar.zst", NULL);
+  g_autoptr(GFile) archive = kikai_join(storage, "autogen", archive_name, NULL);
+
+  if (g_file_query_exists(archive, NULL)) {
+    kikai_printstatus("build", "  - autogen (cached)");
+    return kikai_archive_unpack(archive, sources);
+  }
+
+  g_autoptr(GFile) autogen = g_file_get_child(sources, "autogen.sh");
+  g_autofree gchar *autoreconf = g_find_program_in_path("autoreconf");
+
+  const gchar *autogen_args[] = {g_file_get_path(autogen), NULL};
+  const gchar *autoreconf_args[] = {autoreconf, "-si", NULL};
+  const gchar *descr = NULL;
+  gchar **args = NULL;
+
+  if (g_file_query_exists(autogen, NULL)) {
+    descr = "autogen.sh";
+    args = (gchar**)autogen_args;
+  } else if (autoreconf != NULL) {
+    descr = "autoreconf";
+    args = (gchar**)autoreconf_args;
+  } else {
+    g_printerr("autogen.sh does not exist, and autoreconf is not available.");
+    return FALSE;
+  }
+
+  g_autoptr(GHashTable) snapshot = kikai_tree_snapshot(sources);
+  if (snapshot == NULL) {
+    return FALSE;
+  }
+
+  kikai_printstatus("build", "  - %s", descr);
+
+  if (!kikai_spawn(descr, sources, args, env, G_SPAWN_DEFAULT, log, &error)) {
+    g_printerr("%s failed: %s", descr, error->message);
+    return FALSE;
+  }
+
+  g_autoptr(GPtrArray) generated = kikai_tree_changes(sources, snapshot);
+  g_autoptr(GFile) parent = g_file_get_parent(archive);
+  return generated != NULL && kikai_mkdir_parents(parent) &&
+         kikai_archive_pack(sources, generated, archive);
+}
+
+// Where the dependencies' headers, libraries and pkg-config files are found.
+static GFile *get_deps_root(KikaiBuildContext *ctx) {
+  return ctx->sysroot != NULL ? kikai_install_get_staged(ctx->sysroot, ctx->install)
+                              : g_object_ref(ctx->install);
+}
+
+static gboolean autotools_build(KikaiBuildContext *ctx, KikaiModuleBuildSpec spec,
+                                gboolean *installed) {
+  g_autofree gchar *cc = kikai_ccache_wrap(ctx->toolchain->cc);
+  g_autofree gchar *cxx = kikai_ccache_wrap(ctx->toolchain->cxx);
 
-static gboolean autotools_build(KikaiToolchain *toolchain, const gchar *module_id,
-                                KikaiModuleBuildSpec spec, GFile *sources,
-                                GFile *buildroot, GFile *install, gboolean updated) {
   g_auto(GStrv) env = g_get_environ();
-  env = g_environ_setenv(env, "PREFIX", g_file_get_path(install), TRUE);
-  env = g_environ_setenv(env, "CC", toolchain->cc, TRUE);
-  env = g_environ_setenv(env, "CXX", toolchain->cxx, TRUE);
+  env = g_environ_setenv(env, "PREFIX", g_file_get_path(ctx->install), TRUE);
+  env = g_environ_setenv(env, "CC", cc, TRUE);
+  env = g_environ_setenv(env, "CXX", cxx, TRUE);
   env = g_environ_setenv(env, "NOCONFIGURE", "1", TRUE);
+  if (ctx->sysroot != NULL) {
+    // The dependencies' pkg-config files still name the install prefix.
+    env = g_environ_setenv(env, "PKG_CONFIG_SYSROOT_DIR", g_file_get_path(ctx->sysroot),
+                           TRUE);
+  }
 
   g_autoptr(GError) error = NULL;
-  gint status;
 
   g_autofree gchar
     *configure_hash = kikai_hash_bytes(null_or(spec.autotools.configure_options, ""), -1,
@@ -121,7 +428,7 @@ static gboolean autotools_build(KikaiToolchain *toolchain, const gchar *module_i
                                        NULL),
     *make_hash = kikai_hash_bytes(null_or(spec.autotools.make_options, ""), -1, NULL);
 
-  if (updated || needs_update("build-autotools", module_id, "configure",
+  if (ctx->updated || needs_update("build-autotools", ctx->module_id, "configure",
       configure_hash)) {
     g_autofree gchar *pkgconf = g_find_program_in_path("pkgconf");
     if (pkgconf == NULL) {
@@ -129,45 +436,19 @@ static gboolean autotools_build(KikaiToolchain *toolchain, const gchar *module_i
       return FALSE;
     }
 
-    g_autoptr(GFile) configure = g_file_get_child(sources, "configure");
-    if (!g_file_query_exists(configure, NULL)) {
-      g_autoptr(GFile) autogen = g_file_get_child(sources, "autogen.sh");
-      g_autofree gchar *autoreconf = g_find_program_in_path("autoreconf");
-
-      const gchar *autogen_args[] = {g_file_get_path(autogen), NULL};
-      const gchar *autoreconf_args[] = {autoreconf, "-si", NULL};
-      const gchar *descr = NULL;
-      gchar **args = NULL;
-
-      if (g_file_query_exists(autogen, NULL)) {
-        descr = "autogen.sh";
-        args = (gchar**)autogen_args;
-      } else if (autoreconf != NULL) {
-        descr = "autoreconf";
-        args = (gchar**)autoreconf_args;
-      } else {
-        g_printerr("autogen.sh does not exist, and autoreconf is not available.");
-        return FALSE;
-      }
-
-      kikai_printstatus("build", "  - %s", descr);
-
-      if (!g_spawn_sync(g_file_get_path(sources), args, env, G_SPAWN_DEFAULT, NULL,
-                        NULL, NULL, NULL, &status, &error)) {
-        g_printerr("Failed to spawn %s: %s", descr, error->message);
-        return FALSE;
-      }
-
-      if (!g_spawn_check_exit_status(status, &error)) {
-        g_printerr("%s failed: %s", descr, error->message);
-        return FALSE;
-      }
+    g_autoptr(GFile) configure = g_file_get_child(ctx->sources, "configure");
+    g_autoptr(GFile) autogen_log = get_log(ctx->logs, "autogen");
+    if (!g_file_query_exists(configure, NULL) &&
+        !generate_build_system(ctx->storage, ctx->sources, ctx->sources_hash, env,
+                               autogen_log)) {
+      return FALSE;
     }
 
-    g_autoptr(GFile) include = g_file_get_child(install, "include");
-    g_autoptr(GFile) lib = g_file_get_child(install, "lib");
+    g_autoptr(GFile) deps = get_deps_root(ctx);
+    g_autoptr(GFile) include = g_file_get_child(deps, "include");
+    g_autoptr(GFile) lib = g_file_get_child(deps, "lib");
     g_autoptr(GFile) pkgconfiglib = g_file_get_child(lib, "pkgconfig");
-    g_autoptr(GFile) pkgconfigshare = kikai_join(install, "share", "pkgconfig", NULL);
+    g_autoptr(GFile) pkgconfigshare = kikai_join(deps, "share", "pkgconfig", NULL);
 
     g_autofree gchar *include_arg = g_strconcat("-I", g_file_get_path(include), NULL);
     g_autofree gchar *lib_arg = g_strconcat("-L", g_file_get_path(lib), NULL);
@@ -177,10 +458,10 @@ static gboolean autotools_build(KikaiToolchain *toolchain, const gchar *module_i
     const gchar *configure_path = g_file_get_path(configure);
     g_array_append_val(configure_args, configure_path);
 
-    g_autofree gchar *configure_cc = g_strjoin("=", "CC", toolchain->cc, NULL);
+    g_autofree gchar *configure_cc = g_strjoin("=", "CC", cc, NULL);
     g_array_append_val(configure_args, configure_cc);
 
-    g_autofree gchar *configure_cxx = g_strjoin("=", "CXX", toolchain->cxx, NULL);
+    g_autofree gchar *configure_cxx = g_strjoin("=", "CXX", cxx, NULL);
     g_array_append_val(configure_args, configure_cxx);
 
     g_autofree gchar *cflags = g_strjoin(" ", include_arg, "-fPIC", "-fPIE",
@@ -210,36 +491,96 @@ static gboolean autotools_build(KikaiToolchain *toolchain, const gchar *module_i
     g_array_append_val(configure_args, configure_pkgconfigpath);
 
     g_autofree gchar *configure_prefix = g_strjoin("=", "--prefix",
-                                                   g_file_get_path(install), NULL);
+                                                   g_file_get_path(ctx->install), NULL);
     g_array_append_val(configure_args, configure_prefix);
 
-    g_autofree gchar *configure_host = g_strjoin("=", "--host", toolchain->triple, NULL);
+    g_autofree gchar *configure_host = g_strjoin("=", "--host", ctx->toolchain->triple,
+                                                 NULL);
     g_array_append_val(configure_args, configure_host);
 
     if (!parse_options("configure", configure_args, spec.autotools.configure_options)) {
       return FALSE;
     }
 
+    g_autoptr(GFile) shared_cache = NULL;
+    g_autoptr(GFile) local_cache = g_file_get_child(ctx->buildroot, "config.cache");
+    g_autofree gchar *configure_cache = NULL;
+
+    if (spec.autotools.autoconf_cache) {
+      shared_cache = get_autoconf_cache(ctx->storage, ctx->toolchain, configure_args);
+
+      // configure works on a private copy, which is only published once it succeeds.
+      g_file_delete(local_cache, NULL, NULL);
+      if (g_file_query_exists(shared_cache, NULL) &&
+          !g_file_copy(shared_cache, local_cache, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL,
+                       &error)) {
+        g_printerr("Failed to copy autoconf cache: %s", error->message);
+        return FALSE;
+      }
+
+      configure_cache = g_strjoin("=", "--cache-file", g_file_get_path(local_cache),
+                                  NULL);
+      g_array_append_val(configure_args, configure_cache);
+    }
+
     kikai_printstatus("build", "  - configure");
 
-    if (!g_spawn_sync(g_file_get_path(buildroot), (gchar **)configure_args->data, env,
-                      G_SPAWN_DEFAULT, NULL, NULL, NULL, NULL, &status, &error)) {
-      g_printerr("Failed to spawn configure: %s", error->message);
-      return FALSE;
+    g_autoptr(GFile) configure_log = get_log(ctx->logs, "configure");
+    if (!spawn_configure(ctx->buildroot, configure_args, env, configure_log, &error)) {
+      if (shared_cache == NULL || !g_file_query_exists(shared_cache, NULL) ||
+          !failed_on_cache(ctx->buildroot)) {
+        g_printerr("%s", error->message);
+        return FALSE;
+      }
+
+      // Retry from scratch on a private cache. Other modules may be using the shared one
+      // right now; it's only replaced once this configure succeeds.
+      g_clear_error(&error);
+      g_file_delete(local_cache, NULL, NULL);
+
+      g_autoptr(GFile) cached_log = get_log(ctx->logs, "configure-cached");
+      if (!g_file_move(configure_log, cached_log, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL,
+                       &error)) {
+        g_printerr("Failed to keep configure log: %s", error->message);
+        return FALSE;
+      }
+
+      kikai_printstatus("build", "  - configure (without cached results)");
+
+      if (!spawn_configure(ctx->buildroot, configure_args, env, configure_log, &error)) {
+        g_printerr("%s", error->message);
+        return FALSE;
+      }
     }
 
-    if (!g_spawn_check_exit_status(status, &error)) {
-      g_printerr("configure failed: %s", error->message);
-      return FALSE;
+    if (shared_cache != NULL) {
+      g_autoptr(GFile) parent = g_file_get_parent(shared_cache);
+      g_autofree gchar *tmp_name = g_strdup_printf("%s.tmp.%d",
+                                                   g_file_get_path(shared_cache),
+                                                   getpid());
+      g_autoptr(GFile) tmp = g_file_new_for_path(tmp_name);
+
+      if (!kikai_mkdir_parents(parent)) {
+        return FALSE;
+      }
+
+      if (!g_file_copy(local_cache, tmp, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL,
+                       &error) ||
+          !g_file_move(tmp, shared_cache, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL,
+                       &error)) {
+        g_printerr("Failed to update autoconf cache: %s", error->message);
+        return FALSE;
+      }
     }
 
-    if (!set_key("build-autotools", module_id, "configure", configure_hash)) {
+    if (!set_key("build-autotools", ctx->module_id, "configure", configure_hash)) {
       return FALSE;
     }
   }
 
-  if (updated || needs_update("build-autotools", module_id, "make", make_hash)) {
-    g_autoptr(GFile) makefile = g_file_get_child(buildroot, "Makefile");
+  if (ctx->updated || ctx->changed ||
+      needs_update("build-autotools", ctx->module_id, "make", make_hash)) {
+    g_autoptr(GFile) makefile = g_file_get_child(ctx->buildroot, "Makefile");
     if (!g_file_query_exists(makefile, NULL)) {
       g_printerr("Makefile does not exist.");
       return FALSE;
@@ -247,48 +588,482 @@ static gboolean autotools_build(KikaiToolchain *toolchain, const gchar *module_i
 
     GArray *make_args = g_array_new(TRUE, FALSE, sizeof(gchar *));
 
-    g_autofree gchar *make_path = toolchain->standalone
-                                  ? g_build_filename(toolchain->path, "bin", "make", NULL)
+    g_autofree gchar *make_path = ctx->toolchain->standalone
+                                  ? g_build_filename(ctx->toolchain->path, "bin", "make",
+                                                     NULL)
                                   : g_strdup("make");
     g_array_append_val(make_args, make_path);
 
     const gchar *make_install = "install";
     g_array_append_val(make_args, make_install);
 
+    g_autofree gchar *make_destdir = g_strjoin("=", "DESTDIR",
+                                               g_file_get_path(ctx->staging), NULL);
+    g_array_append_val(make_args, make_destdir);
+
     if (!parse_options("make", make_args, spec.autotools.make_options)) {
       return FALSE;
     }
 
+    // An explicit job count in make-options wins over the detected one.
+    gboolean has_jobs = FALSE;
+    for (int i = 1; i < make_args->len; i++) {
+      const gchar *arg = g_array_index(make_args, gchar *, i);
+      if (g_str_has_prefix(arg, "-j") || g_str_has_prefix(arg, "--jobs")) {
+        has_jobs = TRUE;
+      }
+    }
+
+    g_autofree gchar *make_jobs = g_strdup_printf("-j%u", ctx->jobs);
+    if (!has_jobs) {
+      g_array_append_val(make_args, make_jobs);
+    }
+
     kikai_printstatus("build", "  - make");
 
-    if (!g_spawn_sync(g_file_get_path(buildroot), (gchar **)make_args->data, env,
-                      G_SPAWN_SEARCH_PATH, NULL, NULL, NULL, NULL, &status, &error)) {
-      g_printerr("Failed to spawn make: %s", error->message);
+    // make install rewrites the entire staging tree, so drop whatever the previous
+    // install left behind.
+    if (!kikai_rmtree(ctx->staging)) {
       return FALSE;
     }
 
-    if (!g_spawn_check_exit_status(status, &error)) {
+    g_autoptr(GFile) make_log = get_log(ctx->logs, "make");
+    if (!kikai_spawn("make", ctx->buildroot, (gchar **)make_args->data, env,
+                     G_SPAWN_SEARCH_PATH, make_log, &error)) {
       g_printerr("make failed: %s", error->message);
       return FALSE;
     }
 
-    if (!set_key("build-autotools", module_id, "make", make_hash)) {
+    if (!set_key("build-autotools", ctx->module_id, "make", make_hash)) {
+      return FALSE;
+    }
+
+    *installed = TRUE;
+  }
+
+  return TRUE;
+}
+
+// CMake and Meson get the same view of the install prefix that autotools does, with the
+// preprocessor flags folded into the compiler flags since neither keeps them separate.
+static gboolean get_generator_flags(KikaiBuildContext *ctx, const gchar *cflags,
+                                    const gchar *cppflags, const gchar *ldflags,
+                                    GArray *compile_args, GArray *link_args) {
+  g_autoptr(GFile) deps = get_deps_root(ctx);
+  g_autoptr(GFile) include = g_file_get_child(deps, "include");
+  g_autoptr(GFile) lib = g_file_get_child(deps, "lib");
+
+  gchar *include_arg = g_strconcat("-I", g_file_get_path(include), NULL);
+  g_array_append_val(compile_args, include_arg);
+  gchar *pic_arg = g_strdup("-fPIC");
+  g_array_append_val(compile_args, pic_arg);
+
+  gchar *lib_arg = g_strconcat("-L", g_file_get_path(lib), NULL);
+  g_array_append_val(link_args, lib_arg);
+
+  return parse_options("cppflags", compile_args, cppflags) &&
+         parse_options("cflags", compile_args, cflags) &&
+         parse_options("ldflags", link_args, ldflags);
+}
+
+static gchar **get_generator_env(KikaiBuildContext *ctx) {
+  g_autoptr(GFile) deps = get_deps_root(ctx);
+  g_autoptr(GFile) pkgconfiglib = kikai_join(deps, "lib", "pkgconfig", NULL);
+  g_autoptr(GFile) pkgconfigshare = kikai_join(deps, "share", "pkgconfig", NULL);
+  g_autofree gchar *pkgconfigpath = g_strjoin(":", g_file_get_path(pkgconfiglib),
+                                              g_file_get_path(pkgconfigshare), NULL);
+
+  gchar **env = g_get_environ();
+  env = g_environ_setenv(env, "PKG_CONFIG_PATH", pkgconfigpath, TRUE);
+  env = g_environ_setenv(env, "PKG_CONFIG_LIBDIR", pkgconfigpath, TRUE);
+  env = g_environ_setenv(env, "DESTDIR", g_file_get_path(ctx->staging), TRUE);
+  if (ctx->sysroot != NULL) {
+    env = g_environ_setenv(env, "PKG_CONFIG_SYSROOT_DIR", g_file_get_path(ctx->sysroot),
+                           TRUE);
+  }
+  return env;
+}
+
+static gchar *get_generator_hash(KikaiBuildContext *ctx, const gchar *configure_options,
+                                 const gchar *cflags, const gchar *cppflags,
+                                 const gchar *ldflags) {
+  return kikai_hash_bytes(null_or(configure_options, ""), -1, null_or(cflags, ""), -1,
+                          null_or(cppflags, ""), -1, null_or(ldflags, ""), -1,
+                          ctx->toolchain->hash, -1, null_or(kikai_ccache_launcher(), ""),
+                          -1, NULL);
+}
+
+// Ninja both builds and installs, and reruns the generator on its own when the build
+// files change, so a configured build directory is reused as-is.
+static gboolean ninja_install(KikaiBuildContext *ctx, const gchar *scope,
+                              const gchar *configure_hash, gboolean configured,
+                              gchar **env, gboolean *installed) {
+  if (!configured && !ctx->updated && !ctx->changed &&
+      !needs_update(scope, ctx->module_id, "install", configure_hash)) {
+    return TRUE;
+  }
+
+  g_autofree gchar *ninja = g_find_program_in_path("ninja");
+  if (ninja == NULL) {
+    g_printerr("ninja is required.");
+    return FALSE;
+  }
+
+  g_autofree gchar *jobs = g_strdup_printf("-j%u", ctx->jobs);
+  gchar *args[] = {ninja, jobs, "install", NULL};
+
+  kikai_printstatus("build", "  - ninja");
+
+  if (!kikai_rmtree(ctx->staging)) {
+    return FALSE;
+  }
+
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFile) log = get_log(ctx->logs, "ninja");
+  if (!kikai_spawn("ninja", ctx->buildroot, args, env, G_SPAWN_DEFAULT, log, &error)) {
+    g_printerr("ninja failed: %s", error->message);
+    return FALSE;
+  }
+
+  if (!set_key(scope, ctx->module_id, "install", configure_hash)) {
+    return FALSE;
+  }
+
+  *installed = TRUE;
+  return TRUE;
+}
+
+static gboolean cmake_build(KikaiBuildContext *ctx, KikaiModuleBuildSpec spec,
+                            gboolean *installed) {
+  g_auto(GStrv) env = get_generator_env(ctx);
+  g_autofree gchar *configure_hash = get_generator_hash(ctx, spec.cmake.configure_options,
+                                                        spec.cmake.cflags,
+                                                        spec.cmake.cppflags,
+                                                        spec.cmake.ldflags);
+
+  g_autoptr(GFile) ninja_file = g_file_get_child(ctx->buildroot, "build.ninja");
+  gboolean configured = FALSE;
+
+  if (!g_file_query_exists(ninja_file, NULL) ||
+      needs_update("build-cmake", ctx->module_id, "configure", configure_hash)) {
+    g_autofree gchar *cmake = g_find_program_in_path("cmake");
+    g_autofree gchar *pkgconf = g_find_program_in_path("pkgconf");
+    if (cmake == NULL || pkgconf == NULL) {
+      g_printerr("cmake and pkgconf are required.");
+      return FALSE;
+    }
+
+    g_autoptr(GArray) compile_args = g_array_new(TRUE, FALSE, sizeof(gchar *));
+    g_array_set_clear_func(compile_args, (GDestroyNotify)g_free);
+    g_autoptr(GArray) link_args = g_array_new(TRUE, FALSE, sizeof(gchar *));
+    g_array_set_clear_func(link_args, (GDestroyNotify)g_free);
+    if (!get_generator_flags(ctx, spec.cmake.cflags, spec.cmake.cppflags,
+                             spec.cmake.ldflags, compile_args, link_args)) {
+      return FALSE;
+    }
+
+    g_autofree gchar *compile_flags = g_strjoinv(" ", (gchar **)compile_args->data);
+    g_autofree gchar *link_flags = g_strjoinv(" ", (gchar **)link_args->data);
+    const gchar *prefix = g_file_get_path(ctx->install);
+    g_autoptr(GFile) deps = get_deps_root(ctx);
+
+    g_autoptr(GPtrArray) args = g_ptr_array_new_with_free_func(g_free);
+    g_ptr_array_add(args, g_strdup(cmake));
+    g_ptr_array_add(args, g_strdup("-GNinja"));
+    g_ptr_array_add(args, g_strconcat("-S", g_file_get_path(ctx->sources), NULL));
+    g_ptr_array_add(args, g_strconcat("-B", g_file_get_path(ctx->buildroot), NULL));
+    g_ptr_array_add(args, g_strdup("-DCMAKE_BUILD_TYPE=Release"));
+    g_ptr_array_add(args, g_strconcat("-DCMAKE_INSTALL_PREFIX=", prefix, NULL));
+    g_ptr_array_add(args, g_strconcat("-DCMAKE_PREFIX_PATH=", g_file_get_path(deps),
+                                      NULL));
+    g_ptr_array_add(args, g_strconcat("-DCMAKE_FIND_ROOT_PATH=", g_file_get_path(deps),
+                                      NULL));
+    g_ptr_array_add(args, g_strconcat("-DPKG_CONFIG_EXECUTABLE=", pkgconf, NULL));
+    g_ptr_array_add(args, g_strconcat("-DCMAKE_C_FLAGS=", compile_flags, NULL));
+    g_ptr_array_add(args, g_strconcat("-DCMAKE_CXX_FLAGS=", compile_flags, NULL));
+    g_ptr_array_add(args, g_strconcat("-DCMAKE_EXE_LINKER_FLAGS=", link_flags, NULL));
+    g_ptr_array_add(args, g_strconcat("-DCMAKE_SHARED_LINKER_FLAGS=", link_flags, NULL));
+    g_ptr_array_add(args, g_strconcat("-DCMAKE_MODULE_LINKER_FLAGS=", link_flags, NULL));
+
+    KikaiToolchain *toolchain = ctx->toolchain;
+    if (toolchain->standalone) {
+      g_ptr_array_add(args, g_strdup("-DCMAKE_SYSTEM_NAME=Android"));
+      g_ptr_array_add(args, g_strconcat("-DCMAKE_SYSTEM_VERSION=", toolchain->api, NULL));
+      g_ptr_array_add(args, g_strconcat("-DCMAKE_ANDROID_STANDALONE_TOOLCHAIN=",
+                                        toolchain->path, NULL));
+    } else {
+      // The NDK names its STLs without the "lib" prefix that the toolchain spec uses.
+      const gchar *stl = g_str_has_prefix(toolchain->stl, "lib") ? toolchain->stl + 3
+                         : toolchain->stl;
+      g_autofree gchar *toolchain_file = g_build_filename(
+        toolchain->ndk, "build", "cmake", "android.toolchain.cmake", NULL);
+      g_ptr_array_add(args, g_strconcat("-DCMAKE_TOOLCHAIN_FILE=", toolchain_file, NULL));
+      g_ptr_array_add(args, g_strconcat("-DANDROID_ABI=", toolchain->abi, NULL));
+      g_ptr_array_add(args, g_strconcat("-DANDROID_PLATFORM=android-", toolchain->api,
+                                        NULL));
+      g_ptr_array_add(args, g_strconcat("-DANDROID_STL=", stl, "_shared", NULL));
+    }
+
+    const gchar *launcher = kikai_ccache_launcher();
+    if (launcher != NULL) {
+      g_ptr_array_add(args, g_strconcat("-DCMAKE_C_COMPILER_LAUNCHER=", launcher, ";--cc",
+                                        NULL));
+      g_ptr_array_add(args, g_strconcat("-DCMAKE_CXX_COMPILER_LAUNCHER=", launcher,
+                                        ";--cc", NULL));
+    }
+
+    g_autoptr(GArray) options = g_array_new(TRUE, FALSE, sizeof(gchar *));
+    if (!parse_options("configure", options, spec.cmake.configure_options)) {
+      return FALSE;
+    }
+    for (int i = 0; i < options->len; i++) {
+      g_ptr_array_add(args, g_array_index(options, gchar *, i));
+    }
+    g_ptr_array_add(args, NULL);
+
+    // CMake never forgets a cached toolchain, so changed settings need a fresh cache.
+    g_autoptr(GFile) cache = g_file_get_child(ctx->buildroot, "CMakeCache.txt");
+    g_file_delete(cache, NULL, NULL);
+
+    kikai_printstatus("build", "  - cmake");
+
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GFile) log = get_log(ctx->logs, "configure");
+    if (!kikai_spawn("cmake", ctx->buildroot, (gchar **)args->pdata, env,
+                     G_SPAWN_DEFAULT, log, &error)) {
+      g_printerr("cmake failed: %s", error->message);
+      return FALSE;
+    }
+
+    if (!set_key("build-cmake", ctx->module_id, "configure", configure_hash)) {
       return FALSE;
     }
+
+    configured = TRUE;
+  }
+
+  return ninja_install(ctx, "build-cmake", configure_hash, configured, env, installed);
+}
+
+static void append_meson_string(GString *out, const gchar *value) {
+  g_string_append_c(out, '\'');
+  for (const gchar *p = value; *p; p++) {
+    if (*p == '\'' || *p == '\\') {
+      g_string_append_c(out, '\\');
+    }
+    g_string_append_c(out, *p);
+  }
+  g_string_append_c(out, '\'');
+}
+
+static void append_meson_array(GString *out, const gchar *key, gchar **values) {
+  g_string_append_printf(out, "%s = [", key);
+  for (gchar **value = values; *value; value++) {
+    if (value != values) {
+      g_string_append(out, ", ");
+    }
+    append_meson_string(out, *value);
+  }
+  g_string_append(out, "]\n");
+}
+
+static gboolean write_cross_file(KikaiBuildContext *ctx, KikaiModuleBuildSpec spec,
+                                 GFile *cross_file) {
+  KikaiToolchain *toolchain = ctx->toolchain;
+
+  g_autofree gchar *pkgconf = g_find_program_in_path("pkgconf");
+  if (pkgconf == NULL) {
+    g_printerr("pkgconf is required.");
+    return FALSE;
+  }
+
+  g_autoptr(GArray) compile_args = g_array_new(TRUE, FALSE, sizeof(gchar *));
+  g_array_set_clear_func(compile_args, (GDestroyNotify)g_free);
+  g_autoptr(GArray) link_args = g_array_new(TRUE, FALSE, sizeof(gchar *));
+  g_array_set_clear_func(link_args, (GDestroyNotify)g_free);
+  if (!get_generator_flags(ctx, spec.meson.cflags, spec.meson.cppflags,
+                           spec.meson.ldflags, compile_args, link_args)) {
+    return FALSE;
+  }
+
+  const gchar *launcher = kikai_ccache_launcher();
+  gchar *cc[] = {(gchar *)launcher, "--cc", (gchar *)toolchain->cc, NULL};
+  gchar *cxx[] = {(gchar *)launcher, "--cc", (gchar *)toolchain->cxx, NULL};
+  g_autofree gchar *ar = g_build_filename(toolchain->path, "bin", "llvm-ar", NULL);
+  g_autofree gchar *strip = g_build_filename(toolchain->path, "bin", "llvm-strip", NULL);
+
+  g_autoptr(GString) contents = g_string_new("[binaries]\n");
+  append_meson_array(contents, "c", launcher != NULL ? cc : cc + 2);
+  append_meson_array(contents, "cpp", launcher != NULL ? cxx : cxx + 2);
+  g_string_append(contents, "ar = ");
+  append_meson_string(contents, ar);
+  g_string_append(contents, "\nstrip = ");
+  append_meson_string(contents, strip);
+  g_string_append(contents, "\npkg-config = ");
+  append_meson_string(contents, pkgconf);
+
+  g_string_append(contents, "\n\n[built-in options]\n");
+  append_meson_array(contents, "c_args", (gchar **)compile_args->data);
+  append_meson_array(contents, "cpp_args", (gchar **)compile_args->data);
+  append_meson_array(contents, "c_link_args", (gchar **)link_args->data);
+  append_meson_array(contents, "cpp_link_args", (gchar **)link_args->data);
+
+  g_string_append(contents, "\n[host_machine]\nsystem = 'android'\ncpu_family = ");
+  append_meson_string(contents, toolchain->cpu_family);
+  g_string_append(contents, "\ncpu = ");
+  append_meson_string(contents, toolchain->platform);
+  g_string_append(contents, "\nendian = 'little'\n");
+
+  g_autoptr(GError) error = NULL;
+  if (!g_file_replace_contents(cross_file, contents->str, contents->len, NULL, FALSE,
+                               G_FILE_CREATE_NONE, NULL, NULL, &error)) {
+    g_printerr("Failed to write cross file: %s", error->message);
+    return FALSE;
   }
 
   return TRUE;
 }
 
-gboolean kikai_build(KikaiToolchain *toolchain, const gchar *module_id,
-                     KikaiModuleBuildSpec spec, GFile *sources, GFile *buildroot,
-                     GFile *install, gboolean updated) {
+static gboolean meson_build(KikaiBuildContext *ctx, KikaiModuleBuildSpec spec,
+                            gboolean *installed) {
+  g_auto(GStrv) env = get_generator_env(ctx);
+  g_autofree gchar *configure_hash = get_generator_hash(ctx, spec.meson.configure_options,
+                                                        spec.meson.cflags,
+                                                        spec.meson.cppflags,
+                                                        spec.meson.ldflags);
+
+  g_autoptr(GFile) ninja_file = g_file_get_child(ctx->buildroot, "build.ninja");
+  gboolean configured = FALSE;
+
+  if (!g_file_query_exists(ninja_file, NULL) ||
+      needs_update("build-meson", ctx->module_id, "configure", configure_hash)) {
+    g_autofree gchar *meson = g_find_program_in_path("meson");
+    if (meson == NULL) {
+      g_printerr("meson is required.");
+      return FALSE;
+    }
+
+    g_autoptr(GFile) cross_file = g_file_get_child(ctx->buildroot, "kikai-cross.ini");
+    if (!write_cross_file(ctx, spec, cross_file)) {
+      return FALSE;
+    }
+
+    GArray *args = g_array_new(TRUE, FALSE, sizeof(gchar *));
+    const gchar *setup = "setup";
+    g_array_append_val(args, meson);
+    g_array_append_val(args, setup);
+
+    // A cross file can't be swapped out of an existing build directory, so one whose
+    // settings changed is wiped and configured again.
+    const gchar *wipe = "--wipe";
+    if (g_file_query_exists(ninja_file, NULL)) {
+      g_array_append_val(args, wipe);
+    }
+
+    g_autofree gchar *cross_arg = g_strconcat("--cross-file=",
+                                              g_file_get_path(cross_file), NULL);
+    g_array_append_val(args, cross_arg);
+    g_autofree gchar *prefix_arg = g_strconcat("--prefix=",
+                                               g_file_get_path(ctx->install), NULL);
+    g_array_append_val(args, prefix_arg);
+    const gchar *buildtype_arg = "--buildtype=release";
+    g_array_append_val(args, buildtype_arg);
+
+    if (!parse_options("configure", args, spec.meson.configure_options)) {
+      return FALSE;
+    }
+
+    const gchar *buildroot = g_file_get_path(ctx->buildroot);
+    const gchar *sources = g_file_get_path(ctx->sources);
+    g_array_append_val(args, buildroot);
+    g_array_append_val(args, sources);
+
+    kikai_printstatus("build", "  - meson");
+
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GFile) log = get_log(ctx->logs, "configure");
+    if (!kikai_spawn("meson", ctx->buildroot, (gchar **)args->data, env, G_SPAWN_DEFAULT,
+                     log, &error)) {
+      g_printerr("meson failed: %s", error->message);
+      return FALSE;
+    }
+
+    if (!set_key("build-meson", ctx->module_id, "configure", configure_hash)) {
+      return FALSE;
+    }
+
+    configured = TRUE;
+  }
+
+  return ninja_install(ctx, "build-meson", configure_hash, configured, env, installed);
+}
+
+gchar *kikai_build_hash(KikaiModuleBuildSpec spec) {
+  g_autoptr(GChecksum) sha = g_checksum_new(G_CHECKSUM_SHA256);
+  g_checksum_update(sha, (guchar *)&spec.type, sizeof(spec.type));
+
+  switch (spec.type) {
+  case KIKAI_BUILD_SIMPLE:
+    for (int i = 0; i < spec.simple.steps->len; i++) {
+      KikaiModuleSimpleBuildStep *step = &g_array_index(spec.simple.steps,
+                                                        KikaiModuleSimpleBuildStep, i);
+      kikai_checksum_update_string(sha, step->name);
+      kikai_checksum_update_string(sha, step->run);
+
+      for (int j = 0; step->inputs != NULL && j < step->inputs->len; j++) {
+        kikai_checksum_update_string(sha, g_array_index(step->inputs, gchar *, j));
+      }
+      g_checksum_update(sha, (guchar *)"", 1);
+      for (int j = 0; step->outputs != NULL && j < step->outputs->len; j++) {
+        kikai_checksum_update_string(sha, g_array_index(step->outputs, gchar *, j));
+      }
+    }
+    // Only variants set flags, so modules built without one keep their hashes.
+    if (spec.simple.cflags != NULL || spec.simple.cppflags != NULL ||
+        spec.simple.ldflags != NULL) {
+      kikai_checksum_update_string(sha, spec.simple.cflags);
+      kikai_checksum_update_string(sha, spec.simple.cppflags);
+      kikai_checksum_update_string(sha, spec.simple.ldflags);
+    }
+    break;
+  case KIKAI_BUILD_AUTOTOOLS:
+    kikai_checksum_update_string(sha, spec.autotools.configure_options);
+    kikai_checksum_update_string(sha, spec.autotools.make_options);
+    kikai_checksum_update_string(sha, spec.autotools.cflags);
+    kikai_checksum_update_string(sha, spec.autotools.cppflags);
+    kikai_checksum_update_string(sha, spec.autotools.ldflags);
+    g_checksum_update(sha, (guchar *)&spec.autotools.autoconf_cache,
+                      sizeof(spec.autotools.autoconf_cache));
+    break;
+  case KIKAI_BUILD_CMAKE:
+    kikai_checksum_update_string(sha, spec.cmake.configure_options);
+    kikai_checksum_update_string(sha, spec.cmake.cflags);
+    kikai_checksum_update_string(sha, spec.cmake.cppflags);
+    kikai_checksum_update_string(sha, spec.cmake.ldflags);
+    break;
+  case KIKAI_BUILD_MESON:
+    kikai_checksum_update_string(sha, spec.meson.configure_options);
+    kikai_checksum_update_string(sha, spec.meson.cflags);
+    kikai_checksum_update_string(sha, spec.meson.cppflags);
+    kikai_checksum_update_string(sha, spec.meson.ldflags);
+    break;
+  }
+
+  return g_strdup(g_checksum_get_string(sha));
+}
+
+gboolean kikai_build(KikaiBuildContext *ctx, KikaiModuleBuildSpec spec,
+                     gboolean *installed) {
+  *installed = FALSE;
+
   switch (spec.type) {
   case KIKAI_BUILD_SIMPLE:
-    return simple_build(toolchain, module_id, spec, sources, buildroot, install,
-                        updated);
+    return simple_build(ctx, spec, installed);
   case KIKAI_BUILD_AUTOTOOLS:
-    return autotools_build(toolchain, module_id, spec, sources, buildroot, install,
-                           updated);
+    return autotools_build(ctx, spec, installed);
+  case KIKAI_BUILD_CMAKE:
+    return cmake_build(ctx, spec, installed);
+  case KIKAI_BUILD_MESON:
+    return meson_build(ctx, spec, installed);
   }
 }
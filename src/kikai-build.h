@@ -6,6 +6,26 @@
 #include "kikai-builderspec.h"
 #include "kikai-toolchain.h"
 
-gboolean kikai_build(KikaiToolchain *toolchain, const gchar *module_id,
-                     KikaiModuleBuildSpec spec, GFile *sources, GFile *buildroot,
-                     GFile *install, gboolean updated);
+typedef struct KikaiBuildContext KikaiBuildContext;
+
+struct KikaiBuildContext {
+  GFile *storage;
+  KikaiToolchain *toolchain;
+  const gchar *module_id, *sources_hash;
+  // Modules install into staging, a private DESTDIR, rather than straight into the
+  // install prefix.
+  GFile *sources, *buildroot, *install, *staging;
+  // Where the dependencies were unpacked when building on a worker, laid out like the
+  // root of the filesystem, or NULL when they're in the install prefix itself.
+  GFile *sysroot;
+  // Where the compressed output of each step is written.
+  GFile *logs;
+  guint jobs;
+  // Updated sources need configuring again, having their build system changed or being
+  // extracted from scratch, while changed sources only need the build steps rerun.
+  gboolean updated, changed;
+};
+
+gchar *kikai_build_hash(KikaiModuleBuildSpec spec);
+gboolean kikai_build(KikaiBuildContext *ctx, KikaiModuleBuildSpec spec,
+                     gboolean *installed);
@@ -1,4 +1,7 @@
 #include "kikai-builderspec.h"
+#include "kikai-jobs.h"
+#include "kikai-speccache.h"
+#include "kikai-utils.h"
 
 #include <glib.h>
 #include <glib-object.h>
@@ -89,10 +92,10 @@ static void read_yaml_node(GValue *value, yaml_document_t *doc, yaml_node_t *nod
   }
 }
 
-static gboolean read_yaml(GValue *result, const gchar *file) {
+static gboolean read_yaml(GValue *result, const gchar *file, const gchar *contents,
+                          gsize length) {
   yaml_parser_t parser;
   yaml_document_t doc;
-  FILE* fp;
   gboolean success = FALSE;
 
   if (!yaml_parser_initialize(&parser)) {
@@ -100,13 +103,7 @@ static gboolean read_yaml(GValue *result, const gchar *file) {
     return FALSE;
   }
 
-  fp = fopen("kikai.yml", "rb");
-  if (fp == NULL) {
-    g_printerr("Failed to read %s: %s", file, strerror(errno));
-    goto done;
-  }
-
-  yaml_parser_set_input_file(&parser, fp);
+  yaml_parser_set_input_string(&parser, (const guchar *)contents, length);
 
   if (!yaml_parser_load(&parser, &doc))  {
     g_printerr("Failed to parse %s:%zu:%zu: %s", file,parser.problem_mark.line + 1,
@@ -116,7 +113,7 @@ static gboolean read_yaml(GValue *result, const gchar *file) {
 
   yaml_node_t *root = yaml_document_get_root_node(&doc);
   if (root == NULL) {
-    g_printerr("Failed to read root node from kikai.yml.");
+    g_printerr("Failed to read root node from %s.", file);
     yaml_document_delete(&doc);
     goto done;
   }
@@ -128,9 +125,6 @@ static gboolean read_yaml(GValue *result, const gchar *file) {
 
   done:
   yaml_parser_delete(&parser);
-  if (fp != NULL) {
-    fclose(fp);
-  }
   return success;
 }
 
@@ -188,6 +182,34 @@ static gboolean check_key_type(GHashTable *table, GType type, const gchar *key,
   return TRUE;
 }
 
+static gboolean yaml_to_tmpfs(KikaiTmpfsSpec *tmpfs, GHashTable *data) {
+  GValue *budget_g;
+  if (!check_key_type(data, G_TYPE_STRING, "budget", &budget_g, "tmpfs.budget")) {
+    return FALSE;
+  }
+
+  if (!kikai_parse_size(g_value_get_string(budget_g), &tmpfs->budget)) {
+    g_printerr("Invalid size for tmpfs.budget: %s", g_value_get_string(budget_g));
+    return FALSE;
+  }
+
+  GValue *path_g = NULL;
+  if (g_hash_table_lookup(data, "path") &&
+      !check_key_type(data, G_TYPE_STRING, "path", &path_g, "tmpfs.path")) {
+    return FALSE;
+  }
+  tmpfs->path = path_g ? g_value_get_string(path_g) : "/dev/shm";
+
+  GValue *sources_g = NULL;
+  if (g_hash_table_lookup(data, "sources") &&
+      !check_key_type(data, G_TYPE_BOOLEAN, "sources", &sources_g, "tmpfs.sources")) {
+    return FALSE;
+  }
+  tmpfs->sources = sources_g ? g_value_get_boolean(sources_g) : FALSE;
+
+  return TRUE;
+}
+
 static gboolean yaml_to_toolchain(KikaiToolchainSpec *toolchain, GHashTable *data) {
   GValue *api_g;
   if (!check_key_type(data, G_TYPE_STRING, "api", &api_g, "toolchain.api")) {
@@ -307,6 +329,34 @@ static gboolean yaml_to_dependencies(GArray **dependencies, KikaiModuleSpec *mod
   return TRUE;
 }
 
+static gboolean yaml_to_step_paths(GArray **paths, KikaiModuleSpec *module, int step,
+                                   const gchar *key, GHashTable *data) {
+  GValue *paths_g = NULL;
+  if (g_hash_table_lookup(data, key) == NULL) {
+    *paths = NULL;
+    return TRUE;
+  } else if (!check_key_type(data, G_TYPE_ARRAY, key, &paths_g,
+                             "modules.%s.steps[%d].%s", module->name, step, key)) {
+    return FALSE;
+  }
+
+  GArray *items = g_value_get_boxed(paths_g);
+  *paths = g_array_new(TRUE, FALSE, sizeof(gchar*));
+
+  for (int i = 0; i < items->len; i++) {
+    GValue *item_g = &g_array_index(items, GValue, i);
+    if (!check_type(item_g, G_TYPE_STRING, "modules.%s.steps[%d].%s[%d]", module->name,
+                    step, key, i)) {
+      return FALSE;
+    }
+
+    const gchar *item = g_value_get_string(item_g);
+    g_array_append_val(*paths, item);
+  }
+
+  return TRUE;
+}
+
 static gboolean yaml_to_steps(GArray **steps, KikaiModuleSpec *module, GArray *data) {
   *steps = g_array_new(FALSE, FALSE, sizeof(KikaiModuleSimpleBuildStep));
 
@@ -333,12 +383,30 @@ static gboolean yaml_to_steps(GArray **steps, KikaiModuleSpec *module, GArray *d
     KikaiModuleSimpleBuildStep step;
     step.name = g_value_get_string(name_g);
     step.run = g_value_get_string(run_g);
+
+    if (!yaml_to_step_paths(&step.inputs, module, i, "inputs", step_data) ||
+        !yaml_to_step_paths(&step.outputs, module, i, "outputs", step_data)) {
+      return FALSE;
+    }
     g_array_append_val(*steps, step);
   }
 
   return TRUE;
 }
 
+static gboolean get_build_option(GHashTable *data, KikaiModuleSpec *module,
+                                 const gchar *key, const gchar **out) {
+  GValue *value_g = NULL;
+  if (g_hash_table_lookup(data, key) &&
+      !check_key_type(data, G_TYPE_STRING, key, &value_g, "modules.%s.build.%s",
+                      module->name, key)) {
+    return FALSE;
+  }
+
+  *out = value_g ? g_value_get_string(value_g) : NULL;
+  return TRUE;
+}
+
 static gboolean yaml_to_build(KikaiModuleBuildSpec *build, KikaiModuleSpec *module,
                               GHashTable *data) {
   GValue *type_g;
@@ -398,6 +466,13 @@ static gboolean yaml_to_build(KikaiModuleBuildSpec *build, KikaiModuleSpec *modu
       return FALSE;
     }
 
+    GValue *autoconf_cache_g = NULL;
+    if (g_hash_table_lookup(data, "autoconf-cache") &&
+        !check_key_type(data, G_TYPE_BOOLEAN, "autoconf-cache", &autoconf_cache_g,
+                        "modules.%s.build.autoconf-cache", module->name)) {
+      return FALSE;
+    }
+
     build->type = KIKAI_BUILD_AUTOTOOLS;
     build->autotools.configure_options = configure_options_g ?
                                          g_value_get_string(configure_options_g) : NULL;
@@ -406,8 +481,28 @@ static gboolean yaml_to_build(KikaiModuleBuildSpec *build, KikaiModuleSpec *modu
     build->autotools.cflags = cflags_g ? g_value_get_string(cflags_g) : NULL;
     build->autotools.cppflags = cppflags_g ? g_value_get_string(cppflags_g) : NULL;
     build->autotools.ldflags = ldflags_g ? g_value_get_string(ldflags_g) : NULL;
+    build->autotools.autoconf_cache = autoconf_cache_g ?
+                                      g_value_get_boolean(autoconf_cache_g) : TRUE;
+  } else if (strcmp(type, "cmake") == 0) {
+    build->type = KIKAI_BUILD_CMAKE;
+    if (!get_build_option(data, module, "configure-options",
+                          &build->cmake.configure_options) ||
+        !get_build_option(data, module, "cflags", &build->cmake.cflags) ||
+        !get_build_option(data, module, "cppflags", &build->cmake.cppflags) ||
+        !get_build_option(data, module, "ldflags", &build->cmake.ldflags)) {
+      return FALSE;
+    }
+  } else if (strcmp(type, "meson") == 0) {
+    build->type = KIKAI_BUILD_MESON;
+    if (!get_build_option(data, module, "configure-options",
+                          &build->meson.configure_options) ||
+        !get_build_option(data, module, "cflags", &build->meson.cflags) ||
+        !get_build_option(data, module, "cppflags", &build->meson.cppflags) ||
+        !get_build_option(data, module, "ldflags", &build->meson.ldflags)) {
+      return FALSE;
+    }
   } else {
-    g_printerr("module.%s.build.type must be either simple or autotools.",
+    g_printerr("module.%s.build.type must be one of simple, autotools, cmake or meson.",
                module->name);
     return FALSE;
   }
@@ -415,52 +510,148 @@ static gboolean yaml_to_build(KikaiModuleBuildSpec *build, KikaiModuleSpec *modu
   return TRUE;
 }
 
-static gboolean yaml_to_modules(GHashTable **modules, GHashTable *data) {
-  *modules = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free /*TODO*/);
+static KikaiModuleSpec *yaml_to_module(const gchar *key, GValue *value_g) {
+  if (!check_type(value_g, G_TYPE_HASH_TABLE, "modules.%s", key)) {
+    return NULL;
+  }
 
-  GList *keys = g_hash_table_get_keys(data);
-  while (keys) {
-    const gchar *key = keys->data;
-    GValue *value_g = g_hash_table_lookup(data, key);
-    g_return_val_if_fail(value_g != NULL, FALSE);
+  KikaiModuleSpec *module = g_new0(KikaiModuleSpec, 1);
+  module->name = key;
 
-    if (!check_type(value_g, G_TYPE_HASH_TABLE, "modules.%s", key)) {
-      return FALSE;
-    }
+  GHashTable *module_data = g_value_get_boxed(value_g);
 
-    KikaiModuleSpec *module = g_new0(KikaiModuleSpec, 1);
-    module->name = key;
+  GValue *sources_g;
+  if (!check_key_type(module_data, G_TYPE_ARRAY, "sources", &sources_g,
+                      "modules.%s.sources", key)) {
+    return NULL;
+  }
 
-    GHashTable *module_data = g_value_get_boxed(value_g);
+  if (!yaml_to_sources(&module->sources, module, g_value_get_boxed(sources_g))) {
+    return NULL;
+  }
 
-    GValue *sources_g;
-    if (!check_key_type(module_data, G_TYPE_ARRAY, "sources", &sources_g,
-                        "modules.%s.sources", key)) {
-      return FALSE;
-    }
+  GValue *dependencies_g;
+  if (!check_key_type(module_data, G_TYPE_ARRAY, "dependencies", &dependencies_g,
+                      "modules.%s.dependencies", key)) {
+    return NULL;
+  }
 
-    if (!yaml_to_sources(&module->sources, module, g_value_get_boxed(sources_g))) {
-      return FALSE;
-    }
+  if (!yaml_to_dependencies(&module->dependencies, module,
+                            g_value_get_boxed(dependencies_g))) {
+    return NULL;
+  }
 
-    GValue *dependencies_g;
-    if (!check_key_type(module_data, G_TYPE_ARRAY, "dependencies", &dependencies_g,
-                        "modules.%s.dependencies", key)) {
-      return FALSE;
-    }
+  GValue *memory_per_job_g = NULL;
+  if (g_hash_table_lookup(module_data, "memory-per-job") &&
+      !check_key_type(module_data, G_TYPE_STRING, "memory-per-job", &memory_per_job_g,
+                      "modules.%s.memory-per-job", key)) {
+    return NULL;
+  }
+
+  if (memory_per_job_g != NULL &&
+      !kikai_parse_size(g_value_get_string(memory_per_job_g),
+                        &module->memory_per_job)) {
+    g_printerr("Invalid size for modules.%s.memory-per-job: %s", key,
+               g_value_get_string(memory_per_job_g));
+    return NULL;
+  }
+
+  GValue *cpus_g = NULL;
+  if (g_hash_table_lookup(module_data, "cpus") &&
+      !check_key_type(module_data, G_TYPE_STRING, "cpus", &cpus_g, "modules.%s.cpus",
+                      key)) {
+    return NULL;
+  }
+
+  guint64 cpus = 0;
+  if (cpus_g != NULL &&
+      !g_ascii_string_to_unsigned(g_value_get_string(cpus_g), 10, 1, G_MAXUINT, &cpus,
+                                  NULL)) {
+    g_printerr("Invalid CPU count for modules.%s.cpus: %s", key,
+               g_value_get_string(cpus_g));
+    return NULL;
+  }
+  module->cpus = cpus;
+
+  GValue *memory_limit_g = NULL;
+  if (g_hash_table_lookup(module_data, "memory-limit") &&
+      !check_key_type(module_data, G_TYPE_STRING, "memory-limit", &memory_limit_g,
+                      "modules.%s.memory-limit", key)) {
+    return NULL;
+  }
+
+  if (memory_limit_g != NULL &&
+      !kikai_parse_size(g_value_get_string(memory_limit_g), &module->memory_limit)) {
+    g_printerr("Invalid size for modules.%s.memory-limit: %s", key,
+               g_value_get_string(memory_limit_g));
+    return NULL;
+  }
 
-    if (!yaml_to_dependencies(&module->dependencies, module,
-                              g_value_get_boxed(dependencies_g))) {
+  GValue *strip_g = NULL;
+  if (g_hash_table_lookup(module_data, "strip") &&
+      !check_key_type(module_data, G_TYPE_BOOLEAN, "strip", &strip_g, "modules.%s.strip",
+                      key)) {
+    return NULL;
+  }
+  module->strip = strip_g ? g_value_get_boolean(strip_g) : FALSE;
+
+  GValue *build_g;
+  if (!check_key_type(module_data, G_TYPE_HASH_TABLE, "build", &build_g,
+                      "modules.%s.build", key)) {
+    return NULL;
+  }
+
+  if (!yaml_to_build(&module->build, module, g_value_get_boxed(build_g))) {
+    return NULL;
+  }
+
+  return module;
+}
+
+static gboolean yaml_to_variants(GArray **variants, GHashTable *data) {
+  *variants = g_array_new(FALSE, FALSE, sizeof(KikaiVariantSpec));
+
+  GHashTableIter iter;
+  const gchar *key;
+  GValue *value_g;
+  g_hash_table_iter_init(&iter, data);
+  while (g_hash_table_iter_next(&iter, (gpointer *)&key, (gpointer *)&value_g)) {
+    if (!check_type(value_g, G_TYPE_HASH_TABLE, "variants.%s", key)) {
       return FALSE;
     }
 
-    GValue *build_g;
-    if (!check_key_type(module_data, G_TYPE_HASH_TABLE, "build", &build_g,
-                        "modules.%s.build", key)) {
-      return FALSE;
+    GHashTable *variant_data = g_value_get_boxed(value_g);
+    KikaiVariantSpec variant = {.name = key};
+    const gchar *options[] = {"cflags", "cppflags", "ldflags", "install-root"};
+    const gchar **values[] = {&variant.cflags, &variant.cppflags, &variant.ldflags,
+                              &variant.install_root};
+    for (int i = 0; i < G_N_ELEMENTS(options); i++) {
+      GValue *option_g = NULL;
+      if (g_hash_table_lookup(variant_data, options[i]) &&
+          !check_key_type(variant_data, G_TYPE_STRING, options[i], &option_g,
+                          "variants.%s.%s", key, options[i])) {
+        return FALSE;
+      }
+      *values[i] = option_g ? g_value_get_string(option_g) : NULL;
     }
 
-    if (!yaml_to_build(&module->build, module, g_value_get_boxed(build_g))) {
+    g_array_append_val(*variants, variant);
+  }
+
+  return TRUE;
+}
+
+static gboolean yaml_to_modules(GHashTable **modules, GHashTable *data) {
+  *modules = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free /*TODO*/);
+
+  GList *keys = g_hash_table_get_keys(data);
+  while (keys) {
+    const gchar *key = keys->data;
+    GValue *value_g = g_hash_table_lookup(data, key);
+    g_return_val_if_fail(value_g != NULL, FALSE);
+
+    KikaiModuleSpec *module = yaml_to_module(key, value_g);
+    if (module == NULL) {
       return FALSE;
     }
 
@@ -484,6 +675,38 @@ static gboolean yaml_to_builder(KikaiBuilderSpec *builder, GValue *top_g) {
   }
   builder->install_root = g_value_get_string(install_root_g);
 
+  GValue *artifact_cache_g = NULL;
+  if (g_hash_table_lookup(top, "artifact-cache") &&
+      !check_key_type(top, G_TYPE_STRING, "artifact-cache", &artifact_cache_g,
+                      "artifact-cache")) {
+    return FALSE;
+  }
+  builder->artifact_cache = artifact_cache_g ? g_value_get_string(artifact_cache_g)
+                            : NULL;
+
+  GValue *store_g = NULL;
+  if (g_hash_table_lookup(top, "store") &&
+      !check_key_type(top, G_TYPE_STRING, "store", &store_g, "store")) {
+    return FALSE;
+  }
+  builder->store = store_g ? g_value_get_string(store_g) : NULL;
+
+  GValue *compiler_cache_g = NULL;
+  if (g_hash_table_lookup(top, "compiler-cache") &&
+      !check_key_type(top, G_TYPE_BOOLEAN, "compiler-cache", &compiler_cache_g,
+                      "compiler-cache")) {
+    return FALSE;
+  }
+  builder->compiler_cache = compiler_cache_g ? g_value_get_boolean(compiler_cache_g)
+                            : FALSE;
+
+  GValue *cgroups_g = NULL;
+  if (g_hash_table_lookup(top, "cgroups") &&
+      !check_key_type(top, G_TYPE_BOOLEAN, "cgroups", &cgroups_g, "cgroups")) {
+    return FALSE;
+  }
+  builder->cgroups = cgroups_g ? g_value_get_boolean(cgroups_g) : FALSE;
+
   GValue *toolchain_g;
   if (!check_key_type(top, G_TYPE_HASH_TABLE, "toolchain", &toolchain_g, "toolchain")) {
     return FALSE;
@@ -493,19 +716,261 @@ static gboolean yaml_to_builder(KikaiBuilderSpec *builder, GValue *top_g) {
     return FALSE;
   }
 
-  GValue *modules_g;
-  if (!check_key_type(top, G_TYPE_HASH_TABLE, "modules", &modules_g, "modules")) {
+  GValue *tmpfs_g = NULL;
+  if (g_hash_table_lookup(top, "tmpfs") &&
+      !check_key_type(top, G_TYPE_HASH_TABLE, "tmpfs", &tmpfs_g, "tmpfs")) {
+    return FALSE;
+  }
+
+  builder->tmpfs = (KikaiTmpfsSpec){.path = "/dev/shm"};
+  if (tmpfs_g != NULL && !yaml_to_tmpfs(&builder->tmpfs, g_value_get_boxed(tmpfs_g))) {
+    return FALSE;
+  }
+
+  GValue *variants_g = NULL;
+  if (g_hash_table_lookup(top, "variants") &&
+      !check_key_type(top, G_TYPE_HASH_TABLE, "variants", &variants_g, "variants")) {
+    return FALSE;
+  }
+
+  GHashTable *no_variants = g_hash_table_new(g_str_hash, g_str_equal);
+  gboolean variants_valid = yaml_to_variants(&builder->variants, variants_g
+                                             ? g_value_get_boxed(variants_g)
+                                             : no_variants);
+  g_hash_table_unref(no_variants);
+  if (!variants_valid) {
+    return FALSE;
+  }
+
+  GValue *includes_g = NULL;
+  if (g_hash_table_lookup(top, "include") &&
+      !check_key_type(top, G_TYPE_ARRAY, "include", &includes_g, "include")) {
+    return FALSE;
+  }
+
+  builder->includes = g_array_new(TRUE, FALSE, sizeof(gchar *));
+  GArray *includes = includes_g ? g_value_get_boxed(includes_g) : NULL;
+  for (int i = 0; includes != NULL && i < includes->len; i++) {
+    GValue *include_g = &g_array_index(includes, GValue, i);
+    if (!check_type(include_g, G_TYPE_STRING, "include[%d]", i)) {
+      return FALSE;
+    }
+
+    const gchar *include = g_value_get_string(include_g);
+    g_array_append_val(builder->includes, include);
+  }
+
+  // Specs that include all their modules don't need a modules section at all.
+  GValue *modules_g = NULL;
+  if ((includes_g == NULL || g_hash_table_lookup(top, "modules")) &&
+      !check_key_type(top, G_TYPE_HASH_TABLE, "modules", &modules_g, "modules")) {
+    return FALSE;
+  }
+
+  GHashTable *empty = g_hash_table_new(g_str_hash, g_str_equal);
+  gboolean success = yaml_to_modules(&builder->modules,
+                                     modules_g ? g_value_get_boxed(modules_g) : empty);
+  g_hash_table_unref(empty);
+  if (!success) {
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean index_include(KikaiBuilderSpec *builder, const gchar *base,
+                              const gchar *include) {
+  g_autofree gchar *include_path = g_build_filename(base, include, NULL);
+  g_autofree gchar *dir_path = g_path_get_dirname(include_path);
+  g_autofree gchar *pattern = g_path_get_basename(include_path);
+
+  g_autoptr(GError) error = NULL;
+  GDir *dir = g_dir_open(dir_path, 0, &error);
+  if (dir == NULL) {
+    g_printerr("Failed to open included directory %s: %s", dir_path, error->message);
+    return FALSE;
+  }
+
+  GPatternSpec *spec = g_pattern_spec_new(pattern);
+  gboolean success = TRUE;
+  const gchar *entry;
+
+  while (success && (entry = g_dir_read_name(dir)) != NULL) {
+    if (!g_pattern_match_string(spec, entry)) {
+      continue;
+    }
+
+    gchar *name = g_strdup(entry);
+    gchar *dot = strrchr(name, '.');
+    if (dot != NULL && dot != name) {
+      *dot = '\0';
+    }
+
+    if (g_hash_table_contains(builder->modules, name) ||
+        g_hash_table_contains(builder->module_files, name)) {
+      g_printerr("Module %s is defined more than once.", name);
+      g_free(name);
+      success = FALSE;
+      break;
+    }
+
+    g_hash_table_insert(builder->module_files, name,
+                        g_build_filename(dir_path, entry, NULL));
+  }
+
+  g_pattern_spec_free(spec);
+  g_dir_close(dir);
+  g_ptr_array_add(builder->files, g_steal_pointer(&dir_path));
+  return success;
+}
+
+static gboolean index_includes(KikaiBuilderSpec *builder, const gchar *file) {
+  g_autofree gchar *base = g_path_get_dirname(file);
+  builder->module_files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  builder->files = g_ptr_array_new_with_free_func(g_free);
+  g_ptr_array_add(builder->files, g_strdup(file));
+
+  for (int i = 0; i < builder->includes->len; i++) {
+    if (!index_include(builder, base, g_array_index(builder->includes, gchar *, i))) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+gboolean kikai_builderspec_get_module(KikaiBuilderSpec *builder, const gchar *name,
+                                      KikaiModuleSpec **module) {
+  *module = g_hash_table_lookup(builder->modules, name);
+  if (*module != NULL) {
+    return TRUE;
+  }
+
+  gchar *key, *path;
+  if (!g_hash_table_steal_extended(builder->module_files, name, (gpointer *)&key,
+                                   (gpointer *)&path)) {
+    return TRUE;
+  }
+
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *contents = NULL;
+  gsize length;
+  if (!g_file_get_contents(path, &contents, &length, &error)) {
+    g_printerr("Failed to read %s: %s", path, error->message);
+    return FALSE;
+  }
+
+  GValue *value = g_new0(GValue, 1);
+  if (!read_yaml(value, path, contents, length)) {
     return FALSE;
   }
 
-  if (!yaml_to_modules(&builder->modules, g_value_get_boxed(modules_g))) {
+  *module = yaml_to_module(key, value);
+  if (*module == NULL) {
     return FALSE;
   }
 
+  g_hash_table_insert(builder->modules, key, *module);
+  g_ptr_array_add(builder->files, path);
   return TRUE;
 }
 
-gboolean kikai_builderspec_parse(KikaiBuilderSpec* builder, const gchar *file) {
+gchar **kikai_builderspec_get_module_names(KikaiBuilderSpec *builder) {
+  GPtrArray *names = g_ptr_array_new();
+
+  GHashTableIter iter;
+  gpointer name;
+  g_hash_table_iter_init(&iter, builder->modules);
+  while (g_hash_table_iter_next(&iter, &name, NULL)) {
+    g_ptr_array_add(names, name);
+  }
+
+  g_hash_table_iter_init(&iter, builder->module_files);
+  while (g_hash_table_iter_next(&iter, &name, NULL)) {
+    g_ptr_array_add(names, name);
+  }
+
+  g_ptr_array_add(names, NULL);
+  return (gchar **)g_ptr_array_free(names, FALSE);
+}
+
+void kikai_builderspec_get_variant(KikaiBuilderSpec *builder, const gchar *name,
+                                   KikaiVariantSpec **variant) {
+  *variant = NULL;
+  for (int i = 0; i < builder->variants->len; i++) {
+    KikaiVariantSpec *candidate = &g_array_index(builder->variants, KikaiVariantSpec, i);
+    if (strcmp(candidate->name, name) == 0) {
+      *variant = candidate;
+      return;
+    }
+  }
+}
+
+// The variant's flags come last, so they win over the module's own where they conflict,
+// like -O0 after -O2.
+static void append_flags(const gchar **flags, const gchar *extra) {
+  if (extra == NULL) {
+    return;
+  } else if (*flags == NULL) {
+    *flags = extra;
+  } else {
+    *flags = g_strjoin(" ", *flags, extra, NULL);
+  }
+}
+
+void kikai_builderspec_apply_variant(KikaiModuleSpec *module, KikaiVariantSpec *variant) {
+  KikaiModuleBuildSpec *build = &module->build;
+  switch (build->type) {
+  case KIKAI_BUILD_SIMPLE:
+    append_flags(&build->simple.cflags, variant->cflags);
+    append_flags(&build->simple.cppflags, variant->cppflags);
+    append_flags(&build->simple.ldflags, variant->ldflags);
+    break;
+  case KIKAI_BUILD_AUTOTOOLS:
+    append_flags(&build->autotools.cflags, variant->cflags);
+    append_flags(&build->autotools.cppflags, variant->cppflags);
+    append_flags(&build->autotools.ldflags, variant->ldflags);
+    break;
+  case KIKAI_BUILD_CMAKE:
+    append_flags(&build->cmake.cflags, variant->cflags);
+    append_flags(&build->cmake.cppflags, variant->cppflags);
+    append_flags(&build->cmake.ldflags, variant->ldflags);
+    break;
+  case KIKAI_BUILD_MESON:
+    append_flags(&build->meson.cflags, variant->cflags);
+    append_flags(&build->meson.cppflags, variant->cppflags);
+    append_flags(&build->meson.ldflags, variant->ldflags);
+    break;
+  }
+}
+
+gboolean kikai_builderspec_parse(KikaiBuilderSpec* builder, const gchar *file,
+                                 GFile *cache) {
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *contents = NULL;
+  gsize length;
+
+  if (!g_file_get_contents(file, &contents, &length, &error)) {
+    g_printerr("Failed to read %s: %s", file, error->message);
+    return FALSE;
+  }
+
+  // The key covers the serialized layout as well, so a kikai with a different layout
+  // never tries to read an incompatible cache.
+  g_autofree gchar *key = kikai_hash_bytes(KIKAI_SPECCACHE_LAYOUT, -1, contents, length,
+                                           NULL);
+  if (cache != NULL && kikai_speccache_load(builder, cache, key)) {
+    return index_includes(builder, file);
+  }
+
   GValue top = G_VALUE_INIT;
-  return read_yaml(&top, file) && yaml_to_builder(builder, &top);
+  if (!read_yaml(&top, file, contents, length) || !yaml_to_builder(builder, &top)) {
+    return FALSE;
+  }
+
+  if (cache != NULL) {
+    kikai_speccache_store(builder, cache, key);
+  }
+
+  return index_includes(builder, file);
 }
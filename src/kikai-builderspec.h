@@ -1,13 +1,16 @@
 #pragma once
 
 #include <glib.h>
+#include <gio/gio.h>
 
 typedef enum KikaiToolchainPlatform KikaiToolchainPlatform;
 typedef struct KikaiToolchainSpec KikaiToolchainSpec;
+typedef struct KikaiTmpfsSpec KikaiTmpfsSpec;
 typedef struct KikaiModuleSourceSpec KikaiModuleSourceSpec;
 typedef struct KikaiModuleSimpleBuildStep KikaiModuleSimpleBuildStep;
 typedef struct KikaiModuleBuildSpec KikaiModuleBuildSpec;
 typedef struct KikaiModuleSpec KikaiModuleSpec;
+typedef struct KikaiVariantSpec KikaiVariantSpec;
 typedef struct KikaiBuilderSpec KikaiBuilderSpec;
 
 enum KikaiToolchainPlatform { KIKAI_PLATFORM_ARM, KIKAI_PLATFORM_X86 };
@@ -18,6 +21,15 @@ struct KikaiToolchainSpec {
   GArray *platforms;
 };
 
+struct KikaiTmpfsSpec {
+  // Where RAM-backed build directories are created, and how much a single module may use
+  // there. A budget of 0 keeps everything on disk.
+  const gchar *path;
+  guint64 budget;
+  // Whether extracted sources are kept in RAM too.
+  gboolean sources;
+};
+
 struct KikaiModuleSourceSpec {
   const gchar *url, *after;
   gint strip_parents;
@@ -25,30 +37,83 @@ struct KikaiModuleSourceSpec {
 
 struct KikaiModuleSimpleBuildStep {
   const gchar *name, *run;
+  // Globs relative to the sources and paths relative to the build directory, or NULL
+  // when the step doesn't declare them.
+  GArray *inputs, *outputs;
 };
 
 struct KikaiModuleBuildSpec {
-  enum { KIKAI_BUILD_SIMPLE, KIKAI_BUILD_AUTOTOOLS } type;
+  enum {
+    KIKAI_BUILD_SIMPLE, KIKAI_BUILD_AUTOTOOLS, KIKAI_BUILD_CMAKE, KIKAI_BUILD_MESON
+  } type;
   union {
     struct {
       GArray *steps;
+      // A variant's flags, which the steps get as KIKAI_CFLAGS, KIKAI_CPPFLAGS and
+      // KIKAI_LDFLAGS.
+      const gchar *cflags, *cppflags, *ldflags;
     } simple;
     struct {
       const gchar *configure_options, *make_options, *cflags, *cppflags, *ldflags;
+      gboolean autoconf_cache;
     } autotools;
+    struct {
+      const gchar *configure_options, *cflags, *cppflags, *ldflags;
+    } cmake, meson;
   };
 };
 
 struct KikaiModuleSpec {
   const gchar *name;
   GArray *sources, *dependencies;
+  // A hint for how much memory each parallel job takes, or 0 to use the default.
+  guint64 memory_per_job;
+  // How many CPUs the build may use at once, or 0 for all of them. Together with
+  // memory_per_job, this is the module's weight when packing builds onto the machine.
+  guint cpus;
+  // How much memory the build is scheduled with, and limited to when builds run in
+  // cgroups, or 0 to go by cpus and memory_per_job.
+  guint64 memory_limit;
+  // Whether installed executables and libraries are stripped, with their debug info
+  // kept aside under lib/debug.
+  gboolean strip;
   KikaiModuleBuildSpec build;
 };
 
+// A named set of flags added after every module's own, such as a debug or sanitizer
+// build.
+struct KikaiVariantSpec {
+  const gchar *name, *cflags, *cppflags, *ldflags;
+  // Where the variant installs, or NULL for the install root suffixed with its name.
+  const gchar *install_root;
+};
+
 struct KikaiBuilderSpec {
-  const char *install_root;
+  const char *install_root, *artifact_cache;
+  // Where installed trees are shared machine-wide, or NULL to keep them per project.
+  const char *store;
+  gboolean compiler_cache;
+  // Whether each module is built in its own cgroup, limited to the memory it was
+  // scheduled with.
+  gboolean cgroups;
   KikaiToolchainSpec toolchain;
+  KikaiTmpfsSpec tmpfs;
+  GArray *variants;
   GHashTable *modules;
+  // Globs of per-module spec files, relative to the spec's directory. Each file defines
+  // the module named after it, and is only parsed once that module is needed.
+  GArray *includes;
+  GHashTable *module_files;
+  // Every file and directory the spec has been read from so far.
+  GPtrArray *files;
 };
 
-gboolean kikai_builderspec_parse(KikaiBuilderSpec* builder, const gchar *file);
+gboolean kikai_builderspec_parse(KikaiBuilderSpec* builder, const gchar *file,
+                                 GFile *cache);
+gboolean kikai_builderspec_get_module(KikaiBuilderSpec *builder, const gchar *name,
+                                      KikaiModuleSpec **module);
+gchar **kikai_builderspec_get_module_names(KikaiBuilderSpec *builder);
+// Sets variant to the one with the given name, or NULL when there's none.
+void kikai_builderspec_get_variant(KikaiBuilderSpec *builder, const gchar *name,
+                                   KikaiVariantSpec **variant);
+void kikai_builderspec_apply_variant(KikaiModuleSpec *module, KikaiVariantSpec *variant);
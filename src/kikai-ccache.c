@@ -0,0 +1,369 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "kikai-ccache.h"
+#include "kikai-utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// The cache is shared with the wrapper processes via the environment, since they are
+// spawned by make and friends rather than by kikai itself.
+#define CCACHE_DIR_ENV "KIKAI_CCACHE_DIR"
+#define CCACHE_STATS_ENV "KIKAI_CCACHE_STATS"
+
+#define STAT_HIT 'h'
+#define STAT_MISS 'm'
+#define STAT_UNCACHEABLE 'u'
+
+static gchar *kikai_self = NULL;
+static gchar *kikai_stats = NULL;
+
+gboolean kikai_ccache_enable(GFile *storage) {
+  g_autoptr(GError) error = NULL;
+
+  kikai_self = g_file_read_link("/proc/self/exe", &error);
+  if (kikai_self == NULL) {
+    g_printerr("Failed to locate the kikai executable: %s", error->message);
+    return FALSE;
+  }
+
+  g_autoptr(GFile) cache = g_file_get_child(storage, "ccache");
+  if (!kikai_mkdir_parents(cache)) {
+    return FALSE;
+  }
+
+  g_autofree gchar *stats_name = g_strdup_printf("stats.%d", getpid());
+  g_autoptr(GFile) stats = g_file_get_child(cache, stats_name);
+  kikai_stats = g_file_get_path(stats);
+  g_unlink(kikai_stats);
+
+  g_setenv(CCACHE_DIR_ENV, g_file_get_path(cache), TRUE);
+  g_setenv(CCACHE_STATS_ENV, kikai_stats, TRUE);
+
+  atexit(kikai_ccache_report);
+  return TRUE;
+}
+
+gchar *kikai_ccache_wrap(const gchar *compiler) {
+  if (kikai_self == NULL) {
+    return g_strdup(compiler);
+  }
+
+  return g_strjoin(" ", kikai_self, "--cc", compiler, NULL);
+}
+
+// Build systems that take the compiler launcher separately (CMake and Meson) get the
+// wrapper as a command prefix instead.
+const gchar *kikai_ccache_launcher() {
+  return kikai_self;
+}
+
+void kikai_ccache_report() {
+  if (kikai_stats == NULL) {
+    return;
+  }
+
+  g_autofree gchar *contents = NULL;
+  gsize length = 0;
+  if (!g_file_get_contents(kikai_stats, &contents, &length, NULL)) {
+    g_clear_pointer(&kikai_stats, g_free);
+    return;
+  }
+
+  guint hits = 0, misses = 0, uncacheable = 0;
+  for (gsize i = 0; i < length; i++) {
+    switch (contents[i]) {
+    case STAT_HIT: hits++; break;
+    case STAT_MISS: misses++; break;
+    case STAT_UNCACHEABLE: uncacheable++; break;
+    }
+  }
+
+  if (hits + misses + uncacheable != 0) {
+    kikai_printstatus("ccache", "%u hits, %u misses, %u uncacheable", hits, misses,
+                      uncacheable);
+  }
+
+  g_unlink(kikai_stats);
+  g_clear_pointer(&kikai_stats, g_free);
+}
+
+typedef struct {
+  const gchar *source, *output, *depfile;
+  gboolean compile, deps;
+  // The arguments used to preprocess the source, which have every option that only
+  // affects the outputs stripped out.
+  GPtrArray *preprocess;
+} Invocation;
+
+static const gchar *uncacheable_args[] = {
+  "-E", "-S", "-M", "-MM", "-save-temps", "--coverage", "-fprofile-arcs",
+  "-ftest-coverage", "-", NULL,
+};
+
+static const gchar *separate_value_args[] = {
+  "-I", "-D", "-U", "-include", "-imacros", "-isystem", "-iquote", "-idirafter",
+  "-isysroot", "-x", "-target", "--target", "-Xclang", "-Xpreprocessor", "-Xassembler",
+  "-Xlinker", "--sysroot", "-arch", "-L", "-l", NULL,
+};
+
+static const gchar *source_extensions[] = {
+  ".c", ".cc", ".cpp", ".cxx", ".c++", ".C", ".m", ".mm", ".S", NULL,
+};
+
+static gboolean is_source(const gchar *arg) {
+  for (const gchar **ext = source_extensions; *ext; ext++) {
+    if (g_str_has_suffix(arg, *ext)) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+static gchar *replace_extension(const gchar *path, const gchar *ext) {
+  g_autofree gchar *basename = g_path_get_basename(path);
+  gchar *dot = strrchr(basename, '.');
+  gsize prefix = dot != NULL ? strlen(path) - strlen(dot) : strlen(path);
+
+  g_autofree gchar *stem = g_strndup(path, prefix);
+  return g_strconcat(stem, ext, NULL);
+}
+
+static gboolean analyze(int argc, char **argv, Invocation *inv) {
+  g_ptr_array_add(inv->preprocess, argv[0]);
+
+  for (int i = 1; i < argc; i++) {
+    const gchar *arg = argv[i];
+
+    if (g_strv_contains(uncacheable_args, arg) ||
+        (g_str_has_prefix(arg, "-Wp,") && strstr(arg, "-M") != NULL)) {
+      return FALSE;
+    }
+
+    if (strcmp(arg, "-c") == 0) {
+      inv->compile = TRUE;
+    } else if (strcmp(arg, "-o") == 0) {
+      if (++i == argc) {
+        return FALSE;
+      }
+      inv->output = argv[i];
+    } else if (g_str_has_prefix(arg, "-o")) {
+      inv->output = arg + 2;
+    } else if (strcmp(arg, "-MD") == 0 || strcmp(arg, "-MMD") == 0) {
+      inv->deps = TRUE;
+    } else if (strcmp(arg, "-MP") == 0) {
+      continue;
+    } else if (strcmp(arg, "-MF") == 0 || strcmp(arg, "-MT") == 0 ||
+               strcmp(arg, "-MQ") == 0) {
+      if (++i == argc) {
+        return FALSE;
+      }
+      if (arg[2] == 'F') {
+        inv->depfile = argv[i];
+      }
+    } else if (g_str_has_prefix(arg, "-MF")) {
+      inv->depfile = arg + 3;
+    } else if (g_str_has_prefix(arg, "-MT") || g_str_has_prefix(arg, "-MQ")) {
+      continue;
+    } else if (g_strv_contains(separate_value_args, arg)) {
+      if (i + 1 == argc) {
+        return FALSE;
+      }
+      g_ptr_array_add(inv->preprocess, (gpointer)arg);
+      g_ptr_array_add(inv->preprocess, argv[++i]);
+    } else if (arg[0] == '-') {
+      g_ptr_array_add(inv->preprocess, (gpointer)arg);
+    } else if (is_source(arg) && inv->source == NULL) {
+      inv->source = arg;
+      g_ptr_array_add(inv->preprocess, (gpointer)arg);
+    } else {
+      // Either multiple sources or something being linked.
+      return FALSE;
+    }
+  }
+
+  if (!inv->compile || inv->source == NULL) {
+    return FALSE;
+  }
+
+  g_ptr_array_add(inv->preprocess, "-E");
+  g_ptr_array_add(inv->preprocess, NULL);
+  return TRUE;
+}
+
+static void record_stat(gchar stat) {
+  const gchar *stats = g_getenv(CCACHE_STATS_ENV);
+  if (stats == NULL) {
+    return;
+  }
+
+  // O_APPEND keeps the single-byte writes from concurrent compiles from clobbering
+  // each other.
+  int fd = open(stats, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd != -1) {
+    if (write(fd, &stat, 1) == -1) {
+      // Statistics are best-effort.
+    }
+    close(fd);
+  }
+}
+
+static int exit_code(gint status) {
+  if (WIFEXITED(status)) {
+    return WEXITSTATUS(status);
+  }
+
+  return 1;
+}
+
+static int exec_compiler(char **argv) {
+  execv(argv[0], argv);
+  g_printerr("Failed to execute %s: %s", argv[0], strerror(errno));
+  return 127;
+}
+
+static gchar *compute_key(int argc, char **argv, const gchar *preprocessed) {
+  struct stat st;
+  if (stat(argv[0], &st) == -1) {
+    return NULL;
+  }
+
+  g_autoptr(GChecksum) sha = g_checksum_new(G_CHECKSUM_SHA256);
+  g_autofree gchar *identity = g_strdup_printf("%s:%" G_GINT64_FORMAT ":%"
+                                               G_GINT64_FORMAT, argv[0],
+                                               (gint64)st.st_size, (gint64)st.st_mtime);
+  // Debug info embeds the working directory.
+  g_autofree gchar *cwd = g_get_current_dir();
+
+  g_checksum_update(sha, (guchar *)identity, strlen(identity) + 1);
+  g_checksum_update(sha, (guchar *)cwd, strlen(cwd) + 1);
+  for (int i = 1; i < argc; i++) {
+    g_checksum_update(sha, (guchar *)argv[i], strlen(argv[i]) + 1);
+  }
+  g_checksum_update(sha, (guchar *)preprocessed, -1);
+
+  return g_strdup(g_checksum_get_string(sha));
+}
+
+static gboolean copy_file(const gchar *from, const gchar *to) {
+  g_autoptr(GFile) source = g_file_new_for_path(from);
+  g_autoptr(GFile) target = g_file_new_for_path(to);
+  return g_file_copy(source, target, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL, NULL);
+}
+
+// Stores the file into the cache via a temporary file, so concurrent readers never see
+// a partial entry.
+static void store_file(const gchar *from, const gchar *entry) {
+  g_autofree gchar *tmp = g_strdup_printf("%s.tmp.%d", entry, getpid());
+  if (copy_file(from, tmp) && g_rename(tmp, entry) == 0) {
+    return;
+  }
+
+  g_unlink(tmp);
+}
+
+static void store_contents(const gchar *contents, const gchar *entry) {
+  g_autofree gchar *tmp = g_strdup_printf("%s.tmp.%d", entry, getpid());
+  if (g_file_set_contents(tmp, contents, -1, NULL) && g_rename(tmp, entry) == 0) {
+    return;
+  }
+
+  g_unlink(tmp);
+}
+
+int kikai_ccache_main(int argc, char **argv) {
+  const gchar *cache = g_getenv(CCACHE_DIR_ENV);
+  if (argc == 0) {
+    g_printerr("--cc requires a compiler.");
+    return 1;
+  } else if (cache == NULL) {
+    return exec_compiler(argv);
+  }
+
+  g_autoptr(GPtrArray) preprocess = g_ptr_array_new();
+  Invocation inv = {.preprocess = preprocess};
+  if (!analyze(argc, argv, &inv)) {
+    record_stat(STAT_UNCACHEABLE);
+    return exec_compiler(argv);
+  }
+
+  g_autofree gchar *default_output = NULL;
+  if (inv.output == NULL) {
+    g_autofree gchar *basename = g_path_get_basename(inv.source);
+    default_output = replace_extension(basename, ".o");
+    inv.output = default_output;
+  }
+
+  g_autofree gchar *default_depfile = NULL;
+  if (inv.deps && inv.depfile == NULL) {
+    default_depfile = replace_extension(inv.output, ".d");
+    inv.depfile = default_depfile;
+  }
+
+  g_autofree gchar *preprocessed = NULL;
+  gint status;
+  if (!g_spawn_sync(NULL, (gchar **)preprocess->pdata, NULL, G_SPAWN_DEFAULT, NULL, NULL,
+                    &preprocessed, NULL, &status, NULL) ||
+      !g_spawn_check_exit_status(status, NULL)) {
+    // Let the real compiler report whatever went wrong.
+    record_stat(STAT_UNCACHEABLE);
+    return exec_compiler(argv);
+  }
+
+  g_autofree gchar *key = compute_key(argc, argv, preprocessed);
+  if (key == NULL) {
+    record_stat(STAT_UNCACHEABLE);
+    return exec_compiler(argv);
+  }
+
+  g_autofree gchar *prefix = g_strndup(key, 2);
+  g_autofree gchar *dir = g_build_filename(cache, prefix, NULL);
+  g_autofree gchar *object_entry = g_build_filename(dir, key, NULL);
+  g_autofree gchar *dep_entry = g_strconcat(object_entry, ".d", NULL);
+  g_autofree gchar *stderr_entry = g_strconcat(object_entry, ".stderr", NULL);
+
+  if (g_file_test(object_entry, G_FILE_TEST_IS_REGULAR) &&
+      (!inv.deps || g_file_test(dep_entry, G_FILE_TEST_IS_REGULAR)) &&
+      copy_file(object_entry, inv.output) &&
+      (!inv.deps || copy_file(dep_entry, inv.depfile))) {
+    g_autofree gchar *messages = NULL;
+    if (g_file_get_contents(stderr_entry, &messages, NULL, NULL)) {
+      fputs(messages, stderr);
+    }
+
+    record_stat(STAT_HIT);
+    return 0;
+  }
+
+  g_autofree gchar *messages = NULL;
+  if (!g_spawn_sync(NULL, argv, NULL, G_SPAWN_CHILD_INHERITS_STDIN, NULL, NULL, NULL,
+                    &messages, &status, NULL)) {
+    return exec_compiler(argv);
+  }
+
+  fputs(messages, stderr);
+  record_stat(STAT_MISS);
+
+  if (exit_code(status) != 0) {
+    return exit_code(status);
+  }
+
+  if (g_mkdir_with_parents(dir, 0755) == 0) {
+    if (inv.deps) {
+      store_file(inv.depfile, dep_entry);
+    }
+    store_contents(messages, stderr_entry);
+    // The object goes last, since its presence is what marks the entry as complete.
+    store_file(inv.output, object_entry);
+  }
+
+  return 0;
+}
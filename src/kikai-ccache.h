@@ -0,0 +1,11 @@
+#pragma once
+
+#include <glib.h>
+#include <gio/gio.h>
+
+gboolean kikai_ccache_enable(GFile *storage);
+gchar *kikai_ccache_wrap(const gchar *compiler);
+const gchar *kikai_ccache_launcher();
+void kikai_ccache_report();
+
+int kikai_ccache_main(int argc, char **argv);
@@ -0,0 +1,160 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kikai-cgroup.h"
+
+#define CGROUP_MOUNT "/sys/fs/cgroup"
+
+typedef struct {
+  gchar *path, *procs;
+  // memory.events counts are cumulative, and the cgroup may be left from an earlier run.
+  guint64 oom_kills;
+} Cgroup;
+
+static gchar *cgroup_base = NULL;
+static GPrivate current_cgroup;
+
+// cgroupfs files have to be written in place, not replaced like g_file_set_contents does.
+static gboolean write_file(const gchar *path, const gchar *value) {
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd == -1 || write(fd, value, strlen(value)) == -1) {
+    g_printerr("Failed to write %s: %s", path, strerror(errno));
+    if (fd != -1) {
+      close(fd);
+    }
+    return FALSE;
+  }
+
+  close(fd);
+  return TRUE;
+}
+
+gboolean kikai_cgroup_init() {
+  if (cgroup_base != NULL) {
+    return TRUE;
+  }
+
+  g_autofree gchar *contents = NULL;
+  if (!g_file_get_contents("/proc/self/cgroup", &contents, NULL, NULL)) {
+    g_printerr("Failed to read /proc/self/cgroup");
+    return FALSE;
+  }
+
+  // cgroup v2 has a single hierarchy, listed as 0::/path.
+  const gchar *relative = NULL;
+  g_auto(GStrv) lines = g_strsplit(contents, "\n", -1);
+  for (gchar **line = lines; *line; line++) {
+    if (g_str_has_prefix(*line, "0::")) {
+      relative = *line + strlen("0::");
+    }
+  }
+
+  if (relative == NULL) {
+    g_printerr("cgroups need the unified cgroup v2 hierarchy.");
+    return FALSE;
+  }
+
+  g_autofree gchar *base = g_build_filename(CGROUP_MOUNT, relative, NULL);
+  g_autofree gchar *leaf = g_build_filename(base, "kikai", NULL);
+  g_autofree gchar *leaf_procs = g_build_filename(leaf, "cgroup.procs", NULL);
+  g_autofree gchar *subtree_control = g_build_filename(base, "cgroup.subtree_control",
+                                                       NULL);
+  g_autofree gchar *pid = g_strdup_printf("%d", getpid());
+
+  // A cgroup with processes of its own can't enable controllers for its children.
+  if ((g_mkdir(leaf, 0755) == -1 && errno != EEXIST) ||
+      !write_file(leaf_procs, pid) || !write_file(subtree_control, "+memory")) {
+    g_printerr("Failed to set up cgroups under %s, which has to be delegated to kikai "
+               "alone.", base);
+    return FALSE;
+  }
+
+  cgroup_base = g_steal_pointer(&base);
+  return TRUE;
+}
+
+static guint64 read_oom_kills(const gchar *path) {
+  g_autofree gchar *events_path = g_build_filename(path, "memory.events", NULL);
+  g_autofree gchar *events = NULL;
+  if (!g_file_get_contents(events_path, &events, NULL, NULL)) {
+    return 0;
+  }
+
+  const gchar *oom_kill = strstr(events, "oom_kill ");
+  return oom_kill != NULL ? g_ascii_strtoull(oom_kill + strlen("oom_kill "), NULL, 10)
+         : 0;
+}
+
+gboolean kikai_cgroup_enter(const gchar *name, guint64 memory_limit) {
+  g_autofree gchar *dir_name = g_strconcat("kikai-", name, NULL);
+  g_autofree gchar *path = g_build_filename(cgroup_base, dir_name, NULL);
+  if (g_mkdir(path, 0755) == -1 && errno != EEXIST) {
+    g_printerr("Failed to create cgroup %s: %s", path, strerror(errno));
+    return FALSE;
+  }
+
+  g_autofree gchar *max_path = g_build_filename(path, "memory.max", NULL);
+  g_autofree gchar *swap_path = g_build_filename(path, "memory.swap.max", NULL);
+  g_autofree gchar *group_path = g_build_filename(path, "memory.oom.group", NULL);
+  g_autofree gchar *limit = g_strdup_printf("%" G_GUINT64_FORMAT, memory_limit);
+
+  if (!write_file(max_path, limit)) {
+    return FALSE;
+  }
+  if (g_file_test(swap_path, G_FILE_TEST_EXISTS) && !write_file(swap_path, "0")) {
+    return FALSE;
+  }
+  // Kill the whole group, so make doesn't carry on without the job that was killed.
+  if (!write_file(group_path, "1")) {
+    return FALSE;
+  }
+
+  Cgroup *cgroup = g_new0(Cgroup, 1);
+  cgroup->procs = g_build_filename(path, "cgroup.procs", NULL);
+  cgroup->oom_kills = read_oom_kills(path);
+  cgroup->path = g_steal_pointer(&path);
+  g_private_set(&current_cgroup, cgroup);
+  return TRUE;
+}
+
+gboolean kikai_cgroup_leave() {
+  Cgroup *cgroup = g_private_get(&current_cgroup);
+  if (cgroup == NULL) {
+    return FALSE;
+  }
+
+  g_private_set(&current_cgroup, NULL);
+  gboolean killed = read_oom_kills(cgroup->path) > cgroup->oom_kills;
+
+  // Anything still running in it keeps the cgroup around, to be reused next time.
+  g_rmdir(cgroup->path);
+
+  g_free(cgroup->path);
+  g_free(cgroup->procs);
+  g_free(cgroup);
+  return killed;
+}
+
+const gchar *kikai_cgroup_get_procs() {
+  Cgroup *cgroup = g_private_get(&current_cgroup);
+  return cgroup != NULL ? cgroup->procs : NULL;
+}
+
+void kikai_cgroup_child_setup(gpointer procs) {
+  // This runs between fork and exec, so only async-signal-safe calls are allowed. Writing
+  // 0 moves the writing process.
+  int fd = open(procs, O_WRONLY | O_CLOEXEC);
+  if (fd != -1) {
+    if (write(fd, "0", 1) == -1) {
+      _exit(127);
+    }
+    close(fd);
+  } else {
+    _exit(127);
+  }
+}
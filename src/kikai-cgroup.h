@@ -0,0 +1,17 @@
+#pragma once
+
+#include <glib.h>
+
+// Moves kikai into a leaf of its cgroup, which has to be delegated to it, so the memory
+// controller can be enabled for a cgroup per module.
+gboolean kikai_cgroup_init();
+// Makes every process the calling thread spawns start in the named cgroup, which is
+// limited to memory_limit bytes.
+gboolean kikai_cgroup_enter(const gchar *name, guint64 memory_limit);
+// Undoes kikai_cgroup_enter, returning whether anything in the cgroup was killed for
+// running out of memory in the meantime.
+gboolean kikai_cgroup_leave();
+// The cgroup.procs file of the calling thread's cgroup, or NULL when it has none.
+const gchar *kikai_cgroup_get_procs();
+// A GSpawnChildSetupFunc that moves the child into the cgroup.procs file it's given.
+void kikai_cgroup_child_setup(gpointer procs);
@@ -0,0 +1,173 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <unistd.h>
+
+#include "kikai-dedup.h"
+#include "kikai-install.h"
+#include "kikai-utils.h"
+
+typedef struct {
+  gchar *path, *hash;
+  struct stat st;
+  gboolean reference;
+} DedupFile;
+
+typedef struct {
+  // Maps file sizes to arrays of the files with that size.
+  GHashTable *by_size;
+  gboolean reference;
+} DedupScan;
+
+static void dedup_file_free(gpointer data) {
+  DedupFile *file = data;
+  g_free(file->path);
+  g_free(file->hash);
+  g_free(file);
+}
+
+static gboolean scan_file(const gchar *relative, const gchar *path, struct stat *st,
+                          gpointer user_data) {
+  DedupScan *scan = user_data;
+  if (!S_ISREG(st->st_mode) || st->st_size == 0) {
+    return TRUE;
+  }
+
+  GPtrArray *files = g_hash_table_lookup(scan->by_size, &st->st_size);
+  if (files == NULL) {
+    files = g_ptr_array_new_with_free_func(dedup_file_free);
+    gint64 *size = g_new(gint64, 1);
+    *size = st->st_size;
+    g_hash_table_insert(scan->by_size, size, files);
+  }
+
+  DedupFile *file = g_new0(DedupFile, 1);
+  file->path = g_strdup(path);
+  file->st = *st;
+  file->reference = scan->reference;
+  g_ptr_array_add(files, file);
+  return TRUE;
+}
+
+static const gchar *get_hash(DedupFile *file) {
+  if (file->hash == NULL) {
+    g_autoptr(GError) error = NULL;
+    GMappedFile *mapped = g_mapped_file_new(file->path, FALSE, &error);
+    if (mapped == NULL) {
+      return NULL;
+    }
+
+    file->hash = g_compute_checksum_for_data(G_CHECKSUM_SHA256,
+                                             (guchar *)g_mapped_file_get_contents(mapped),
+                                             g_mapped_file_get_length(mapped));
+    g_mapped_file_unref(mapped);
+  }
+
+  return file->hash;
+}
+
+// Hardlinks are preferred since they also share the page cache, but they'd merge the
+// metadata of both files, so files with different modes or owners are reflinked instead.
+// Reference files are only ever reflinked, so writing to a copy never changes them.
+static gboolean replace_with_copy_of(DedupFile *file, DedupFile *original) {
+  g_autofree gchar *tmp = g_strdup_printf("%s.kikai-dedup.%d", file->path, getpid());
+
+  if (!original->reference && file->st.st_mode == original->st.st_mode &&
+      file->st.st_uid == original->st.st_uid && file->st.st_gid == original->st.st_gid &&
+      link(original->path, tmp) == 0) {
+    if (g_rename(tmp, file->path) == 0) {
+      return TRUE;
+    }
+
+    g_unlink(tmp);
+    return FALSE;
+  }
+
+  if (!kikai_install_reflink(original->path, tmp, file->st.st_mode)) {
+    return FALSE;
+  }
+
+  if (g_rename(tmp, file->path) != 0) {
+    g_unlink(tmp);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+gboolean kikai_dedup_trees(gchar **roots, guint reference) {
+  g_autoptr(GHashTable) by_size = g_hash_table_new_full(
+    g_int64_hash, g_int64_equal, g_free, (GDestroyNotify)g_ptr_array_unref);
+
+  for (guint i = 0; roots[i] != NULL; i++) {
+    DedupScan scan = {.by_size = by_size, .reference = i < reference};
+    if (!kikai_tree_walk(roots[i], scan_file, &scan)) {
+      return FALSE;
+    }
+  }
+
+  guint deduplicated = 0;
+  guint64 saved = 0;
+
+  GHashTableIter iter;
+  GPtrArray *files;
+  g_hash_table_iter_init(&iter, by_size);
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&files)) {
+    if (files->len < 2) {
+      continue;
+    }
+
+    // Map content hashes to the first reference file and the first other file seen with
+    // that content. Copies are reflinked to the former where possible, and else linked
+    // to the latter.
+    g_autoptr(GHashTable) references = g_hash_table_new(g_str_hash, g_str_equal);
+    g_autoptr(GHashTable) originals = g_hash_table_new(g_str_hash, g_str_equal);
+
+    for (int i = 0; i < files->len; i++) {
+      DedupFile *file = files->pdata[i];
+      const gchar *hash = get_hash(file);
+      if (hash == NULL) {
+        continue;
+      } else if (file->reference) {
+        if (!g_hash_table_contains(references, hash)) {
+          g_hash_table_insert(references, (gpointer)hash, file);
+        }
+        continue;
+      }
+
+      // Files hard linked to a reference file by older versions are reflinked too.
+      gboolean replaced = FALSE, shared = FALSE;
+      DedupFile *candidates[] = {g_hash_table_lookup(references, hash),
+                                 g_hash_table_lookup(originals, hash)};
+      for (int j = 0; !replaced && !shared && j < G_N_ELEMENTS(candidates); j++) {
+        DedupFile *original = candidates[j];
+        if (original == NULL || file->st.st_dev != original->st.st_dev) {
+          continue;
+        }
+
+        shared = file->st.st_ino == original->st.st_ino && !original->reference;
+        replaced = !shared && replace_with_copy_of(file, original);
+        if (replaced && file->st.st_ino != original->st.st_ino) {
+          deduplicated++;
+          saved += file->st.st_size;
+        }
+      }
+
+      // A file still linked to a reference file mustn't gain more links.
+      DedupFile *reference = candidates[0];
+      gboolean linked = reference != NULL && !replaced &&
+                        reference->st.st_dev == file->st.st_dev &&
+                        reference->st.st_ino == file->st.st_ino;
+      if (!replaced && !shared && !linked && !g_hash_table_contains(originals, hash)) {
+        g_hash_table_insert(originals, (gpointer)hash, file);
+      }
+    }
+  }
+
+  if (deduplicated != 0) {
+    kikai_printstatus("dedup", "Deduplicated %u files, saving %.1f MiB",
+                      deduplicated, saved / (1024.0 * 1024.0));
+  }
+
+  return TRUE;
+}
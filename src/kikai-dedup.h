@@ -0,0 +1,8 @@
+#pragma once
+
+#include <glib.h>
+
+// Replaces identical files under roots with links to a single copy. Files under the
+// first `reference` roots are only ever reflinked to, so they can't be modified through
+// the copies.
+gboolean kikai_dedup_trees(gchar **roots, guint reference);
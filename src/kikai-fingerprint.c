@@ -0,0 +1,206 @@
+#include <glib.h>
+#include <gio/gio.h>
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include "kikai-build.h"
+#include "kikai-fingerprint.h"
+#include "kikai-install.h"
+#include "kikai-toolchain.h"
+#include "kikai-utils.h"
+
+// The environment variables that change what a run would do without any file changing.
+static const gchar *fingerprint_env[] = {
+  "ANDROID_NDK", "ANDROID_NDK_ROOT", "KIKAI_ARTIFACT_CACHE", NULL,
+};
+
+static void update_stat(GChecksum *sha, const gchar *path) {
+  struct stat st;
+  kikai_checksum_update_string(sha, path);
+
+  if (stat(path, &st) == -1) {
+    kikai_checksum_update_string(sha, "missing");
+    return;
+  }
+
+  g_autofree gchar *stamp = g_strdup_printf("%lu:%lu:%ld:%ld.%09ld",
+                                            (gulong)st.st_dev, (gulong)st.st_ino,
+                                            (long)st.st_size, (long)st.st_mtim.tv_sec,
+                                            st.st_mtim.tv_nsec);
+  kikai_checksum_update_string(sha, stamp);
+}
+
+// The run stamp only stats the files the previous run depended on, so checking it costs
+// one state lookup and a handful of stat calls.
+static gchar *get_run_stamp(gchar **files) {
+  g_autoptr(GChecksum) sha = g_checksum_new(G_CHECKSUM_SHA256);
+  update_stat(sha, "/proc/self/exe");
+
+  for (const gchar **var = fingerprint_env; *var; var++) {
+    kikai_checksum_update_string(sha, g_getenv(*var));
+  }
+
+  const gchar *ndk = g_getenv("ANDROID_NDK");
+  if (ndk == NULL) {
+    ndk = g_getenv("ANDROID_NDK_ROOT");
+  }
+  if (ndk != NULL) {
+    g_autofree gchar *properties = g_build_filename(ndk, "source.properties", NULL);
+    update_stat(sha, properties);
+  }
+
+  for (gchar **file = files; *file; file++) {
+    update_stat(sha, *file);
+  }
+
+  return g_strdup(g_checksum_get_string(sha));
+}
+
+gchar *kikai_fingerprint_run_key(const gchar *variant, gchar **requested_modules) {
+  g_autoptr(GChecksum) sha = g_checksum_new(G_CHECKSUM_SHA256);
+  for (gchar **module = requested_modules; module && *module; module++) {
+    kikai_checksum_update_string(sha, *module);
+  }
+
+  // Each variant installs somewhere else, so being up to date in one says nothing about
+  // the others.
+  if (variant != NULL) {
+    return g_strjoin("::", "fingerprint", "run", variant, g_checksum_get_string(sha),
+                     NULL);
+  }
+  return g_strjoin("::", "fingerprint", "run", g_checksum_get_string(sha), NULL);
+}
+
+gboolean kikai_fingerprint_run_current(const gchar *run_key) {
+  g_autofree gchar *value = kikai_db_get(run_key);
+  if (value == NULL || value == &kikai_db_missing) {
+    g_steal_pointer(&value);
+    return FALSE;
+  }
+
+  // The stored value is the stamp, followed by the files it covers, one per line.
+  g_auto(GStrv) lines = g_strsplit(value, "\n", -1);
+  if (lines[0] == NULL) {
+    return FALSE;
+  }
+
+  g_autofree gchar *stamp = get_run_stamp(lines + 1);
+  return strcmp(stamp, lines[0]) == 0;
+}
+
+gboolean kikai_fingerprint_run_save(const gchar *run_key, GPtrArray *files) {
+  g_ptr_array_add(files, NULL);
+  g_autofree gchar *stamp = get_run_stamp((gchar **)files->pdata);
+  g_ptr_array_remove_index(files, files->len - 1);
+
+  g_autoptr(GString) value = g_string_new(stamp);
+  for (int i = 0; i < files->len; i++) {
+    g_string_append_printf(value, "\n%s", (gchar *)files->pdata[i]);
+  }
+
+  return kikai_db_set(run_key, value->str);
+}
+
+// A module's fingerprint covers its own spec, the toolchains and prefixes it's built for,
+// and the fingerprints of its dependencies, so a change anywhere below a module changes
+// the fingerprint of everything that depends on it.
+gchar *kikai_fingerprint_module(KikaiModuleSpec *module, GArray *toolchains,
+                                GFile *install_root, GHashTable *fingerprints) {
+  // Declared step inputs live in the sources and can change without the spec changing,
+  // so they can only be checked by the full run.
+  if (module->build.type == KIKAI_BUILD_SIMPLE) {
+    for (int i = 0; i < module->build.simple.steps->len; i++) {
+      if (g_array_index(module->build.simple.steps, KikaiModuleSimpleBuildStep,
+                        i).inputs != NULL) {
+        return NULL;
+      }
+    }
+  }
+
+  g_autoptr(GChecksum) sha = g_checksum_new(G_CHECKSUM_SHA256);
+  kikai_checksum_update_string(sha, module->name);
+
+  g_autofree gchar *build_hash = kikai_build_hash(module->build);
+  kikai_checksum_update_string(sha, build_hash);
+  // Only mixed in when set, so modules that don't strip keep their fingerprints.
+  if (module->strip) {
+    kikai_checksum_update_string(sha, "strip");
+  }
+
+  for (int i = 0; i < module->sources->len; i++) {
+    KikaiModuleSourceSpec *source = &g_array_index(module->sources,
+                                                   KikaiModuleSourceSpec, i);
+    kikai_checksum_update_string(sha, source->url);
+    kikai_checksum_update_string(sha, source->after);
+    g_checksum_update(sha, (guchar *)&source->strip_parents,
+                      sizeof(source->strip_parents));
+  }
+
+  for (int i = 0; i < toolchains->len; i++) {
+    kikai_checksum_update_string(sha, g_array_index(toolchains, KikaiToolchain, i).hash);
+  }
+
+  g_autofree gchar *install_path = g_file_get_path(install_root);
+  kikai_checksum_update_string(sha, install_path);
+
+  for (gchar **dep = (gchar **)module->dependencies->data; *dep; dep++) {
+    const gchar *dep_fingerprint = g_hash_table_lookup(fingerprints, *dep);
+    if (dep_fingerprint == NULL) {
+      return NULL;
+    }
+    kikai_checksum_update_string(sha, dep_fingerprint);
+  }
+
+  return g_strdup(g_checksum_get_string(sha));
+}
+
+// Checks a module's stored fingerprint, and that its files are still in the prefix,
+// filling in the artifact keys its dependents need when both hold.
+gboolean kikai_fingerprint_module_current(GFile *storage, KikaiModuleSpec *module,
+                                          const gchar *module_id,
+                                          const gchar *fingerprint, GArray *toolchains,
+                                          GFile *install_root, GHashTable *keys) {
+  g_autofree gchar *db_key = g_strjoin("::", "fingerprint", "module", module_id, NULL);
+  g_autofree gchar *value = kikai_db_get(db_key);
+  if (value == NULL || value == &kikai_db_missing) {
+    g_steal_pointer(&value);
+    return FALSE;
+  }
+
+  g_auto(GStrv) lines = g_strsplit(value, "\n", -1);
+  if (lines[0] == NULL || strcmp(lines[0], fingerprint) != 0 ||
+      g_strv_length(lines) != toolchains->len + 1) {
+    return FALSE;
+  }
+
+  for (int i = 0; i < toolchains->len; i++) {
+    const gchar *platform = g_array_index(toolchains, KikaiToolchain, i).platform;
+    g_autoptr(GFile) prefix = g_file_get_child(install_root, platform);
+    if (!kikai_install_is_merged(storage, module_id, platform, prefix)) {
+      return FALSE;
+    }
+  }
+
+  for (int i = 0; i < toolchains->len; i++) {
+    const gchar *platform = g_array_index(toolchains, KikaiToolchain, i).platform;
+    g_hash_table_insert(keys, g_strjoin("::", module->name, platform, NULL),
+                        g_strdup(lines[i + 1]));
+  }
+
+  return TRUE;
+}
+
+gboolean kikai_fingerprint_module_save(KikaiModuleSpec *module, const gchar *module_id,
+                                       const gchar *fingerprint, GArray *toolchains,
+                                       GHashTable *keys) {
+  g_autoptr(GString) value = g_string_new(fingerprint);
+  for (int i = 0; i < toolchains->len; i++) {
+    const gchar *platform = g_array_index(toolchains, KikaiToolchain, i).platform;
+    g_autofree gchar *key_name = g_strjoin("::", module->name, platform, NULL);
+    g_string_append_printf(value, "\n%s", (gchar *)g_hash_table_lookup(keys, key_name));
+  }
+
+  g_autofree gchar *db_key = g_strjoin("::", "fingerprint", "module", module_id, NULL);
+  return kikai_db_set(db_key, value->str);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "kikai-builderspec.h"
+
+gchar *kikai_fingerprint_run_key(const gchar *variant, gchar **requested_modules);
+gboolean kikai_fingerprint_run_current(const gchar *run_key);
+gboolean kikai_fingerprint_run_save(const gchar *run_key, GPtrArray *files);
+
+gchar *kikai_fingerprint_module(KikaiModuleSpec *module, GArray *toolchains,
+                                GFile *install_root, GHashTable *fingerprints);
+gboolean kikai_fingerprint_module_current(GFile *storage, KikaiModuleSpec *module,
+                                          const gchar *module_id,
+                                          const gchar *fingerprint, GArray *toolchains,
+                                          GFile *install_root, GHashTable *keys);
+gboolean kikai_fingerprint_module_save(KikaiModuleSpec *module, const gchar *module_id,
+                                       const gchar *fingerprint, GArray *toolchains,
+                                       GHashTable *keys);
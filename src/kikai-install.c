@@ -0,0 +1,182 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "kikai-install.h"
+#include "kikai-utils.h"
+
+GFile *kikai_install_get_staged(GFile *staging, GFile *prefix) {
+  // make install places files under $DESTDIR$PREFIX.
+  g_autofree gchar *prefix_path = g_file_get_path(prefix);
+  return g_file_resolve_relative_path(staging, prefix_path + 1);
+}
+
+gboolean kikai_install_reflink(const gchar *path, const gchar *target, mode_t mode) {
+  int src = open(path, O_RDONLY | O_CLOEXEC);
+  if (src == -1) {
+    return FALSE;
+  }
+
+  int dest = open(target, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode & 07777);
+  if (dest == -1) {
+    close(src);
+    return FALSE;
+  }
+
+  gboolean success = ioctl(dest, FICLONE, src) == 0;
+  close(src);
+  close(dest);
+  if (!success) {
+    g_unlink(target);
+  }
+
+  return success;
+}
+
+gboolean kikai_install_link(const gchar *path, struct stat *st, const gchar *target) {
+  if (link(path, target) == 0 ||
+      (S_ISREG(st->st_mode) && kikai_install_reflink(path, target, st->st_mode))) {
+    return TRUE;
+  }
+
+  // Neither works across filesystems, so fall back to copying.
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFile) source = g_file_new_for_path(path);
+  g_autoptr(GFile) dest = g_file_new_for_path(target);
+  if (!g_file_copy(source, dest, G_FILE_COPY_NOFOLLOW_SYMLINKS | G_FILE_COPY_ALL_METADATA,
+                   NULL, NULL, NULL, &error)) {
+    g_printerr("Failed to copy %s: %s", path, error->message);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+typedef struct {
+  GFile *prefix;
+  GHashTable *installed;
+  GString *manifest;
+} MergeData;
+
+static gboolean merge_file(const gchar *relative, const gchar *path, struct stat *st,
+                           gpointer user_data) {
+  MergeData *data = user_data;
+
+  g_autoptr(GFile) target = g_file_resolve_relative_path(data->prefix, relative);
+  g_autofree gchar *target_path = g_file_get_path(target);
+
+  g_hash_table_add(data->installed, g_strdup(relative));
+  g_string_append_printf(data->manifest, "%s\n", relative);
+
+  struct stat target_st;
+  if (lstat(target_path, &target_st) == 0 && target_st.st_dev == st->st_dev &&
+      target_st.st_ino == st->st_ino) {
+    // Already linked in by a previous merge.
+    return TRUE;
+  }
+
+  g_autoptr(GFile) parent = g_file_get_parent(target);
+  if (!kikai_mkdir_parents(parent)) {
+    return FALSE;
+  }
+
+  // Every file is linked next to its destination and then renamed over it, so other
+  // builds reading the prefix never see a partially written file.
+  g_autofree gchar *tmp_path = g_strdup_printf("%s.kikai-tmp.%d", target_path, getpid());
+  g_unlink(tmp_path);
+
+  if (!kikai_install_link(path, st, tmp_path)) {
+    return FALSE;
+  }
+
+  if (g_rename(tmp_path, target_path) == -1) {
+    g_printerr("Failed to install %s: %s", target_path, strerror(errno));
+    g_unlink(tmp_path);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void remove_stale(GFile *prefix, const gchar *relative) {
+  g_autoptr(GFile) file = g_file_resolve_relative_path(prefix, relative);
+  if (!g_file_delete(file, NULL, NULL)) {
+    return;
+  }
+
+  // Prune any directories that were left empty, stopping at the first one that is
+  // still in use.
+  g_autoptr(GFile) parent = g_file_get_parent(file);
+  while (parent != NULL && !g_file_equal(parent, prefix) &&
+         g_file_delete(parent, NULL, NULL)) {
+    GFile *next = g_file_get_parent(parent);
+    g_object_unref(parent);
+    parent = next;
+  }
+}
+
+gboolean kikai_install_is_merged(GFile *storage, const gchar *module_id,
+                                 const gchar *platform, GFile *prefix) {
+  g_autoptr(GFile) manifest = kikai_join(storage, "manifests", module_id, platform, NULL);
+  g_autofree gchar *contents = NULL;
+  if (!g_file_load_contents(manifest, NULL, &contents, NULL, NULL, NULL)) {
+    return FALSE;
+  }
+
+  g_autofree gchar *prefix_path = g_file_get_path(prefix);
+  g_auto(GStrv) lines = g_strsplit(contents, "\n", -1);
+  for (gchar **line = lines; *line; line++) {
+    g_autofree gchar *path = g_build_filename(prefix_path, *line, NULL);
+    struct stat st;
+    if (**line != '\0' && lstat(path, &st) == -1) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+gboolean kikai_install_merge(GFile *storage, const gchar *module_id,
+                             const gchar *platform, GFile *staged, GFile *prefix) {
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFile) manifest = kikai_join(storage, "manifests", module_id, platform, NULL);
+  g_autoptr(GFile) manifest_parent = g_file_get_parent(manifest);
+  g_autoptr(GHashTable) installed = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                          g_free, NULL);
+  g_autoptr(GString) contents = g_string_new(NULL);
+
+  if (!kikai_mkdir_parents(prefix) || !kikai_mkdir_parents(manifest_parent)) {
+    return FALSE;
+  }
+
+  MergeData data = {.prefix = prefix, .installed = installed, .manifest = contents};
+  if (!kikai_tree_walk(g_file_get_path(staged), merge_file, &data)) {
+    return FALSE;
+  }
+
+  // Anything the previous install had that this one lacks is uninstalled.
+  g_autofree gchar *old_contents = NULL;
+  if (g_file_load_contents(manifest, NULL, &old_contents, NULL, NULL, NULL)) {
+    g_auto(GStrv) lines = g_strsplit(old_contents, "\n", -1);
+    for (gchar **line = lines; *line; line++) {
+      if (**line != '\0' && !g_hash_table_contains(installed, *line)) {
+        remove_stale(prefix, *line);
+      }
+    }
+  }
+
+  if (!g_file_replace_contents(manifest, contents->str, contents->len, NULL, FALSE,
+                               G_FILE_CREATE_NONE, NULL, NULL, &error)) {
+    g_printerr("Failed to write manifest: %s", error->message);
+    return FALSE;
+  }
+
+  return TRUE;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include <sys/stat.h>
+
+GFile *kikai_install_get_staged(GFile *staging, GFile *prefix);
+// Creates target as a reflink of the regular file at path, with the given mode. Reflinks
+// share the data like hard links do, but the copy gets its own metadata.
+gboolean kikai_install_reflink(const gchar *path, const gchar *target, mode_t mode);
+// Puts a file at target that shares path's data if at all possible, as a hard link or
+// else a reflink, and as a copy otherwise.
+gboolean kikai_install_link(const gchar *path, struct stat *st, const gchar *target);
+// Whether everything the last merge of module_id installed is still in prefix.
+gboolean kikai_install_is_merged(GFile *storage, const gchar *module_id,
+                                 const gchar *platform, GFile *prefix);
+gboolean kikai_install_merge(GFile *storage, const gchar *module_id,
+                             const gchar *platform, GFile *staged, GFile *prefix);
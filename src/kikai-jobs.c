@@ -0,0 +1,158 @@
+#include <glib.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "kikai-jobs.h"
+
+// The job count from KIKAI_JOBS, or 0 when it isn't set.
+static guint jobs_override = 0;
+
+gboolean kikai_jobs_init() {
+  const gchar *override = g_getenv("KIKAI_JOBS");
+  if (override == NULL || *override == '\0') {
+    return TRUE;
+  }
+
+  g_autoptr(GError) error = NULL;
+  guint64 jobs = 0;
+  if (!g_ascii_string_to_unsigned(override, 10, 1, G_MAXUINT, &jobs, &error)) {
+    g_printerr("Invalid KIKAI_JOBS: %s", error->message);
+    return FALSE;
+  }
+
+  jobs_override = jobs;
+  return TRUE;
+}
+
+gboolean kikai_parse_size(const gchar *value, guint64 *size) {
+  gchar *end = NULL;
+  guint64 result = g_ascii_strtoull(value, &end, 10);
+  if (end == value) {
+    return FALSE;
+  }
+
+  switch (g_ascii_toupper(*end)) {
+  case 'G':
+    result *= 1024;
+    // fallthrough
+  case 'M':
+    result *= 1024;
+    // fallthrough
+  case 'K':
+    result *= 1024;
+    end++;
+    break;
+  }
+
+  if (*end == 'B' || *end == 'b') {
+    end++;
+  }
+
+  if (*end != '\0') {
+    return FALSE;
+  }
+
+  *size = result;
+  return TRUE;
+}
+
+static gchar *read_first_line(const gchar *path) {
+  gchar *contents = NULL;
+  if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+    return NULL;
+  }
+
+  gchar *newline = strchr(contents, '\n');
+  if (newline != NULL) {
+    *newline = '\0';
+  }
+  return contents;
+}
+
+// Containers usually see every host CPU but are throttled to a quota, so the quota has
+// to be taken into account too, through either cgroup v2 or v1.
+static guint get_cpu_quota() {
+  g_autofree gchar *max = read_first_line("/sys/fs/cgroup/cpu.max");
+  if (max != NULL) {
+    gint64 quota, period;
+    if (sscanf(max, "%" G_GINT64_FORMAT " %" G_GINT64_FORMAT, &quota, &period) == 2 &&
+        quota > 0 && period > 0) {
+      return (quota + period - 1) / period;
+    }
+    return 0;
+  }
+
+  g_autofree gchar *quota_s = read_first_line("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+  g_autofree gchar *period_s = read_first_line("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+  if (quota_s != NULL && period_s != NULL) {
+    gint64 quota = g_ascii_strtoll(quota_s, NULL, 10),
+           period = g_ascii_strtoll(period_s, NULL, 10);
+    if (quota > 0 && period > 0) {
+      return (quota + period - 1) / period;
+    }
+  }
+
+  return 0;
+}
+
+guint64 kikai_get_memory() {
+  guint64 available = 0;
+
+  g_autofree gchar *meminfo = NULL;
+  if (g_file_get_contents("/proc/meminfo", &meminfo, NULL, NULL)) {
+    gchar *line = strstr(meminfo, "MemAvailable:");
+    if (line != NULL) {
+      available = g_ascii_strtoull(line + strlen("MemAvailable:"), NULL, 10) * 1024;
+    }
+  }
+
+  // A cgroup memory limit can be far lower than what the host has free.
+  g_autofree gchar *max_s = read_first_line("/sys/fs/cgroup/memory.max");
+  g_autofree gchar *current_s = read_first_line("/sys/fs/cgroup/memory.current");
+  if (max_s != NULL && current_s != NULL && strcmp(max_s, "max") != 0) {
+    guint64 max = g_ascii_strtoull(max_s, NULL, 10),
+            current = g_ascii_strtoull(current_s, NULL, 10);
+    guint64 headroom = max > current ? max - current : 0;
+    if (available == 0 || headroom < available) {
+      available = headroom;
+    }
+  }
+
+  return available;
+}
+
+guint kikai_get_cpus() {
+  static guint cpus = 0;
+  if (cpus == 0) {
+    cpus = g_get_num_processors();
+
+    guint quota = get_cpu_quota();
+    if (quota != 0 && quota < cpus) {
+      cpus = quota;
+    }
+  }
+
+  return cpus;
+}
+
+guint kikai_get_jobs(guint64 memory_per_job, guint max_jobs, guint64 available) {
+  if (jobs_override != 0) {
+    return jobs_override;
+  }
+
+  guint jobs = kikai_get_cpus();
+  if (max_jobs != 0 && max_jobs < jobs) {
+    jobs = max_jobs;
+  }
+
+  if (memory_per_job == 0) {
+    memory_per_job = KIKAI_DEFAULT_MEMORY_PER_JOB;
+  }
+
+  if (available != 0 && available / memory_per_job < jobs) {
+    jobs = available / memory_per_job;
+  }
+
+  return MAX(jobs, 1);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <glib.h>
+
+// The memory assumed per job when a module doesn't give a memory-per-job hint.
+#define KIKAI_DEFAULT_MEMORY_PER_JOB (512 * 1024 * 1024ull)
+
+// Reads the job count KIKAI_JOBS may override everything else with.
+gboolean kikai_jobs_init();
+gboolean kikai_parse_size(const gchar *value, guint64 *size);
+// The CPUs and memory this machine has for builds, taking cgroup limits into account.
+// The memory is read anew on every call, so it's best read once per run.
+guint kikai_get_cpus();
+guint64 kikai_get_memory();
+// How many parallel jobs a build gets, at most max_jobs unless that's 0, with available
+// bytes of memory (0 if unknown).
+guint kikai_get_jobs(guint64 memory_per_job, guint max_jobs, guint64 available);
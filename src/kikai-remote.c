@@ -0,0 +1,558 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
+
+#include <string.h>
+
+#include "kikai-archive.h"
+#include "kikai-build.h"
+#include "kikai-install.h"
+#include "kikai-jobs.h"
+#include "kikai-remote.h"
+#include "kikai-speccache.h"
+#include "kikai-utils.h"
+
+// Every message is a little-endian 64-bit length followed by that many bytes. A request
+// is followed by the sources and sysroot archives, and a response by the staged archive
+// when the build installed anything.
+#define PROTOCOL_VERSION 4
+#define REQUEST_TYPE "(ussssv(ysbs))"
+#define RESPONSE_TYPE "(bbs)"
+
+// Requests are small, so anything bigger is a peer speaking something else.
+#define MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+
+struct KikaiWorker {
+  gchar *address;
+  GSocketConnectable *connectable;
+};
+
+static GAsyncQueue *idle_workers = NULL;
+static guint worker_count = 0;
+static const gchar *worker_token = NULL;
+
+// Workers run whatever a request tells them to, so they only take requests carrying the
+// token they were started with.
+static const gchar *get_token() {
+  const gchar *token = g_getenv("KIKAI_WORKER_TOKEN");
+  if (token == NULL || *token == '\0') {
+    g_printerr("KIKAI_WORKER_TOKEN must be set to use build workers.");
+    return NULL;
+  }
+  return token;
+}
+
+static GSocketConnectable *parse_address(const gchar *address) {
+  if (g_str_has_prefix(address, "unix:")) {
+    return G_SOCKET_CONNECTABLE(g_unix_socket_address_new(address + strlen("unix:")));
+  }
+
+  g_autoptr(GError) error = NULL;
+  GSocketConnectable *connectable = g_network_address_parse(address, 0, &error);
+  if (connectable == NULL) {
+    g_printerr("Invalid worker address %s: %s", address, error->message);
+  }
+  return connectable;
+}
+
+gboolean kikai_remote_init() {
+  const gchar *workers = g_getenv("KIKAI_WORKERS");
+  if (idle_workers != NULL || workers == NULL || *workers == '\0') {
+    return TRUE;
+  }
+
+  worker_token = get_token();
+  if (worker_token == NULL) {
+    return FALSE;
+  }
+
+  idle_workers = g_async_queue_new();
+  g_auto(GStrv) addresses = g_strsplit(workers, ",", -1);
+  for (gchar **address = addresses; *address; address++) {
+    g_strstrip(*address);
+    if (**address == '\0') {
+      continue;
+    }
+
+    KikaiWorker *worker = g_new0(KikaiWorker, 1);
+    worker->address = g_strdup(*address);
+    worker->connectable = parse_address(worker->address);
+    if (worker->connectable == NULL) {
+      return FALSE;
+    }
+
+    g_async_queue_push(idle_workers, worker);
+    worker_count++;
+  }
+
+  return TRUE;
+}
+
+guint kikai_remote_count() {
+  return worker_count;
+}
+
+KikaiWorker *kikai_remote_acquire() {
+  return g_async_queue_pop(idle_workers);
+}
+
+void kikai_remote_release(KikaiWorker *worker) {
+  g_async_queue_push(idle_workers, worker);
+}
+
+const gchar *kikai_remote_get_address(KikaiWorker *worker) {
+  return worker->address;
+}
+
+static gboolean read_exact(GInputStream *in, gpointer buffer, gsize size) {
+  g_autoptr(GError) error = NULL;
+  gsize read = 0;
+  if (!g_input_stream_read_all(in, buffer, size, &read, NULL, &error)) {
+    g_printerr("Failed to receive: %s", error->message);
+    return FALSE;
+  } else if (read != size) {
+    g_printerr("Failed to receive: connection closed");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean write_length(GOutputStream *out, guint64 length) {
+  g_autoptr(GError) error = NULL;
+  length = GUINT64_TO_LE(length);
+  if (!g_output_stream_write_all(out, &length, sizeof(length), NULL, NULL, &error)) {
+    g_printerr("Failed to send: %s", error->message);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean read_length(GInputStream *in, guint64 *length) {
+  if (!read_exact(in, length, sizeof(*length))) {
+    return FALSE;
+  }
+
+  *length = GUINT64_FROM_LE(*length);
+  return TRUE;
+}
+
+static gboolean send_variant(GOutputStream *out, GVariant *value) {
+  g_autoptr(GError) error = NULL;
+  gsize size = g_variant_get_size(value);
+  if (!write_length(out, size) ||
+      !g_output_stream_write_all(out, g_variant_get_data(value), size, NULL, NULL,
+                                 &error)) {
+    if (error != NULL) {
+      g_printerr("Failed to send: %s", error->message);
+    }
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static GVariant *receive_variant(GInputStream *in, const gchar *type) {
+  guint64 length;
+  if (!read_length(in, &length)) {
+    return NULL;
+  } else if (length > MAX_MESSAGE_SIZE) {
+    g_printerr("Failed to receive: message too large");
+    return NULL;
+  }
+
+  gpointer data = g_malloc(length);
+  if (!read_exact(in, data, length)) {
+    g_free(data);
+    return NULL;
+  }
+
+  g_autoptr(GBytes) bytes = g_bytes_new_take(data, length);
+  GVariant *value = g_variant_ref_sink(g_variant_new_from_bytes(G_VARIANT_TYPE(type),
+                                                                bytes, FALSE));
+  // Everything received is untrusted, and only normal-form variants are safe to read.
+  if (!g_variant_is_normal_form(value)) {
+    g_printerr("Failed to receive: malformed message");
+    g_variant_unref(value);
+    return NULL;
+  }
+
+  return value;
+}
+
+static gboolean send_file(GOutputStream *out, GFile *file) {
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFileInputStream) in = g_file_read(file, NULL, &error);
+  g_autoptr(GFileInfo) info = NULL;
+  if (in != NULL) {
+    info = g_file_input_stream_query_info(in, G_FILE_ATTRIBUTE_STANDARD_SIZE, NULL,
+                                          &error);
+  }
+  if (info == NULL) {
+    g_printerr("Failed to open %s: %s", g_file_get_path(file), error->message);
+    return FALSE;
+  }
+
+  if (!write_length(out, g_file_info_get_size(info))) {
+    return FALSE;
+  }
+
+  if (g_output_stream_splice(out, G_INPUT_STREAM(in), G_OUTPUT_STREAM_SPLICE_NONE, NULL,
+                             &error) == -1) {
+    g_printerr("Failed to send %s: %s", g_file_get_path(file), error->message);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean receive_file(GInputStream *in, GFile *file) {
+  g_autoptr(GError) error = NULL;
+  guint64 length;
+  if (!read_length(in, &length)) {
+    return FALSE;
+  }
+
+  g_autoptr(GFileOutputStream) out = g_file_replace(file, NULL, FALSE,
+                                                    G_FILE_CREATE_NONE, NULL, &error);
+  if (out == NULL) {
+    g_printerr("Failed to create %s: %s", g_file_get_path(file), error->message);
+    return FALSE;
+  }
+
+  gchar buffer[65536];
+  while (length != 0) {
+    gsize chunk = MIN(length, sizeof(buffer));
+    if (!read_exact(in, buffer, chunk)) {
+      return FALSE;
+    }
+
+    if (!g_output_stream_write_all(G_OUTPUT_STREAM(out), buffer, chunk, NULL, NULL,
+                                   &error)) {
+      g_printerr("Failed to write %s: %s", g_file_get_path(file), error->message);
+      return FALSE;
+    }
+
+    length -= chunk;
+  }
+
+  if (!g_output_stream_close(G_OUTPUT_STREAM(out), NULL, &error)) {
+    g_printerr("Failed to write %s: %s", g_file_get_path(file), error->message);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+gboolean kikai_remote_pack_tree(GFile *root, GFile *archive) {
+  g_autoptr(GPtrArray) paths = g_ptr_array_new_with_free_func(g_free);
+  return kikai_tree_list(g_file_get_path(root), paths) &&
+         kikai_archive_pack(root, paths, archive);
+}
+
+static gboolean pack_sysroot(GFile *storage, KikaiRemoteJob *job, GFile *archive) {
+  g_autoptr(GPtrArray) paths = g_ptr_array_new_with_free_func(g_free);
+
+  GHashTableIter iter;
+  const gchar *dependency_id;
+  g_hash_table_iter_init(&iter, job->dependencies);
+  while (g_hash_table_iter_next(&iter, (gpointer *)&dependency_id, NULL)) {
+    g_autoptr(GFile) manifest = kikai_join(storage, "manifests", dependency_id,
+                                           job->toolchain->platform, NULL);
+    g_autofree gchar *contents = NULL;
+    if (!g_file_load_contents(manifest, NULL, &contents, NULL, NULL, NULL)) {
+      continue;
+    }
+
+    g_auto(GStrv) lines = g_strsplit(contents, "\n", -1);
+    for (gchar **line = lines; *line; line++) {
+      if (**line != '\0') {
+        g_ptr_array_add(paths, g_strdup(*line));
+      }
+    }
+  }
+
+  return kikai_archive_pack(job->prefix, paths, archive);
+}
+
+static GSocketConnection *connect_worker(KikaiWorker *worker) {
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GSocketClient) client = g_socket_client_new();
+  GSocketConnection *connection = g_socket_client_connect(client, worker->connectable,
+                                                          NULL, &error);
+  if (connection == NULL) {
+    g_printerr("Failed to connect to worker %s: %s", worker->address, error->message);
+  }
+  return connection;
+}
+
+gboolean kikai_remote_build(GFile *storage, KikaiWorker *worker, KikaiRemoteJob *job,
+                            GFile *staged, gboolean *installed) {
+  const gchar *platform = job->toolchain->platform;
+  g_autofree gchar *sysroot_name = g_strconcat("sysroot-", platform, ".tar.zst", NULL);
+  g_autofree gchar *staged_name = g_strconcat("staged-", platform, ".tar.zst", NULL);
+  g_autoptr(GFile) sysroot = g_file_get_child(job->scratch, sysroot_name);
+  g_autoptr(GFile) staged_archive = g_file_get_child(job->scratch, staged_name);
+
+  if (!pack_sysroot(storage, job, sysroot)) {
+    return FALSE;
+  }
+
+  g_autoptr(GSocketConnection) connection = connect_worker(worker);
+  if (connection == NULL) {
+    return FALSE;
+  }
+
+  GInputStream *in = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+  GOutputStream *out = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+
+  g_autoptr(GVariant) request = g_variant_ref_sink(g_variant_new(
+    REQUEST_TYPE, PROTOCOL_VERSION, worker_token, job->key, job->sources_hash,
+    g_file_get_path(job->prefix), kikai_speccache_serialize_module(job->module),
+    (guchar)job->platform, job->toolchain->api, job->toolchain->standalone,
+    job->toolchain->stl));
+
+  if (!send_variant(out, request) || !send_file(out, job->sources) ||
+      !send_file(out, sysroot)) {
+    return FALSE;
+  }
+
+  g_autoptr(GVariant) response = receive_variant(in, RESPONSE_TYPE);
+  if (response == NULL) {
+    return FALSE;
+  }
+
+  gboolean success;
+  const gchar *message;
+  g_variant_get(response, "(bb&s)", &success, installed, &message);
+  if (!success) {
+    g_printerr("Worker %s failed to build %s: %s", worker->address, job->module->name,
+               message);
+    return FALSE;
+  }
+
+  if (!*installed) {
+    return TRUE;
+  }
+
+  return receive_file(in, staged_archive) && kikai_rmtree(staged) &&
+         kikai_mkdir_parents(staged) && kikai_archive_unpack(staged_archive, staged);
+}
+
+static gboolean send_response(GOutputStream *out, gboolean success, gboolean installed,
+                              const gchar *message, GFile *staged_archive) {
+  g_autoptr(GVariant) response = g_variant_ref_sink(g_variant_new(
+    RESPONSE_TYPE, success, installed, message));
+  return send_variant(out, response) &&
+         (!installed || send_file(out, staged_archive));
+}
+
+// Keys name the job's directory, so they're checked to be the hashes they claim to be.
+static gboolean is_valid_key(const gchar *key) {
+  return strlen(key) == 64 && strspn(key, "0123456789abcdef") == 64;
+}
+
+// The staged and sysroot trees are laid out under the job by the prefix's path.
+static gboolean is_valid_prefix(const gchar *path) {
+  if (!g_path_is_absolute(path)) {
+    return FALSE;
+  }
+
+  g_auto(GStrv) parts = g_strsplit(path, "/", -1);
+  for (gchar **part = parts; *part; part++) {
+    if (strcmp(*part, "..") == 0) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+// Takes as long whatever the mismatch, so the token can't be guessed a byte at a time.
+static gboolean is_valid_token(const gchar *token, const gchar *expected) {
+  gsize length = strlen(token), expected_length = strlen(expected);
+  guchar difference = length != expected_length;
+  for (gsize i = 0; i < expected_length; i++) {
+    difference |= expected[i] ^ token[MIN(i, length)];
+  }
+  return difference == 0;
+}
+
+static gboolean create_toolchain(GFile *storage, KikaiToolchainPlatform platform,
+                                 const gchar *api, gboolean standalone, const gchar *stl,
+                                 KikaiToolchain *toolchain) {
+  KikaiToolchainSpec spec = {
+    .api = api,
+    .stl = stl,
+    .standalone = standalone,
+    .platforms = g_array_new(FALSE, FALSE, sizeof(KikaiToolchainPlatform)),
+  };
+  g_array_append_val(spec.platforms, platform);
+
+  g_autoptr(GArray) toolchains = g_array_new(FALSE, FALSE, sizeof(KikaiToolchain));
+  gboolean success = kikai_toolchain_create(storage, toolchains, &spec);
+  if (success) {
+    *toolchain = g_array_index(toolchains, KikaiToolchain, 0);
+  }
+
+  g_array_unref(spec.platforms);
+  return success;
+}
+
+static void serve_job(GFile *storage, const gchar *token,
+                      GSocketConnection *connection) {
+  GInputStream *in = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+  GOutputStream *out = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+
+  g_autoptr(GVariant) request = receive_variant(in, REQUEST_TYPE);
+  if (request == NULL) {
+    return;
+  }
+
+  guint32 version;
+  const gchar *request_token, *key, *sources_hash, *prefix_path, *api, *stl;
+  g_autoptr(GVariant) module_v = NULL;
+  guchar platform;
+  gboolean standalone;
+  g_variant_get(request, "(u&s&s&s&sv(y&sb&s))", &version, &request_token, &key,
+                &sources_hash, &prefix_path, &module_v, &platform, &api, &standalone,
+                &stl);
+
+  if (version != PROTOCOL_VERSION) {
+    send_response(out, FALSE, FALSE, "unsupported protocol version", NULL);
+    return;
+  } else if (!is_valid_token(request_token, token)) {
+    g_printerr("Rejected a request with the wrong token");
+    send_response(out, FALSE, FALSE, "wrong token", NULL);
+    return;
+  } else if (!is_valid_key(key) || !is_valid_prefix(prefix_path) ||
+             !g_variant_is_of_type(module_v, G_VARIANT_TYPE(
+               KIKAI_SPECCACHE_MODULE_LAYOUT))) {
+    send_response(out, FALSE, FALSE, "malformed request", NULL);
+    return;
+  }
+
+  KikaiModuleSpec *module = kikai_speccache_load_module(module_v);
+  kikai_printstatus("worker", "Building: %s", module->name);
+
+  g_autoptr(GFile) job = kikai_join(storage, "jobs", key, NULL);
+  g_autoptr(GFile) sources = g_file_get_child(job, "sources");
+  g_autoptr(GFile) sources_archive = g_file_get_child(job, "sources.tar.zst");
+  g_autoptr(GFile) sysroot = g_file_get_child(job, "sysroot");
+  g_autoptr(GFile) sysroot_archive = g_file_get_child(job, "sysroot.tar.zst");
+  g_autoptr(GFile) staging = g_file_get_child(job, "staging");
+  g_autoptr(GFile) staged_archive = g_file_get_child(job, "staged.tar.zst");
+  g_autoptr(GFile) buildroot = g_file_get_child(job, "build");
+  g_autoptr(GFile) logs = g_file_get_child(job, "logs");
+
+  g_autoptr(GFile) prefix = g_file_new_for_path(prefix_path);
+  g_autoptr(GFile) deps = kikai_install_get_staged(sysroot, prefix);
+  g_autoptr(GFile) staged = kikai_install_get_staged(staging, prefix);
+
+  if (!kikai_rmtree(job) || !kikai_mkdir_parents(sources) || !kikai_mkdir_parents(deps) ||
+      !kikai_mkdir_parents(buildroot) || !receive_file(in, sources_archive) ||
+      !receive_file(in, sysroot_archive)) {
+    send_response(out, FALSE, FALSE, "failed to receive the job", NULL);
+    return;
+  }
+
+  KikaiToolchain toolchain;
+  if (!kikai_archive_unpack(sources_archive, sources) ||
+      !kikai_archive_unpack(sysroot_archive, deps) ||
+      !create_toolchain(storage, platform, api, standalone, stl, &toolchain)) {
+    send_response(out, FALSE, FALSE, "failed to set up the job", NULL);
+    return;
+  }
+
+  g_autofree gchar *module_id = kikai_hash_bytes(module->name, -1, NULL);
+  KikaiBuildContext ctx = {
+    .storage = storage,
+    .toolchain = &toolchain,
+    .module_id = module_id,
+    .sources_hash = sources_hash,
+    .sources = sources,
+    .buildroot = buildroot,
+    .install = prefix,
+    .staging = staging,
+    .sysroot = sysroot,
+    .logs = logs,
+    .jobs = kikai_get_jobs(module->memory_per_job, module->cpus, kikai_get_memory()),
+    .updated = TRUE,
+  };
+
+  gboolean installed = FALSE;
+  if (!kikai_build(&ctx, module->build, &installed)) {
+    // The job is left behind for its logs.
+    g_autofree gchar *message = g_strdup_printf("the build failed, see %s on the worker",
+                                                g_file_get_path(logs));
+    send_response(out, FALSE, FALSE, message, NULL);
+    return;
+  }
+
+  if (installed && !kikai_remote_pack_tree(staged, staged_archive)) {
+    send_response(out, FALSE, FALSE, "failed to pack the installed files", NULL);
+    return;
+  }
+
+  send_response(out, TRUE, installed, "", staged_archive);
+  kikai_rmtree(job);
+}
+
+static gboolean listen_on(GSocketListener *listener, const gchar *address) {
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GSocketAddress) socket_address = NULL;
+
+  if (g_str_has_prefix(address, "unix:")) {
+    const gchar *path = address + strlen("unix:");
+    g_unlink(path);
+    socket_address = g_unix_socket_address_new(path);
+  } else {
+    const gchar *colon = strrchr(address, ':');
+    guint64 port;
+    if (colon == NULL ||
+        !g_ascii_string_to_unsigned(colon + 1, 10, 1, G_MAXUINT16, &port, &error)) {
+      g_printerr("Invalid worker address %s", address);
+      return FALSE;
+    }
+
+    g_autofree gchar *host = g_strndup(address, colon - address);
+    socket_address = g_inet_socket_address_new_from_string(*host != '\0' ? host
+                                                           : "127.0.0.1", port);
+    if (socket_address == NULL) {
+      g_printerr("Invalid worker address %s", address);
+      return FALSE;
+    }
+  }
+
+  if (!g_socket_listener_add_address(listener, socket_address, G_SOCKET_TYPE_STREAM,
+                                     G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL, &error)) {
+    g_printerr("Failed to listen on %s: %s", address, error->message);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+int kikai_remote_serve(GFile *storage, const gchar *address) {
+  const gchar *token = get_token();
+  g_autoptr(GSocketListener) listener = g_socket_listener_new();
+  if (token == NULL || !listen_on(listener, address)) {
+    return 1;
+  }
+
+  kikai_printstatus("worker", "Listening on %s", address);
+
+  for (;;) {
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GSocketConnection) connection = g_socket_listener_accept(listener, NULL,
+                                                                       NULL, &error);
+    if (connection == NULL) {
+      g_printerr("Failed to accept a connection: %s", error->message);
+      return 1;
+    }
+
+    serve_job(storage, token, connection);
+  }
+}
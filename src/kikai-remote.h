@@ -0,0 +1,39 @@
+#pragma once
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "kikai-builderspec.h"
+#include "kikai-toolchain.h"
+
+typedef struct KikaiWorker KikaiWorker;
+typedef struct KikaiRemoteJob KikaiRemoteJob;
+
+struct KikaiRemoteJob {
+  KikaiModuleSpec *module;
+  KikaiToolchain *toolchain;
+  KikaiToolchainPlatform platform;
+  const gchar *key, *sources_hash;
+  GFile *prefix;
+  GFile *sources;
+  // The ids of every dependency, whose installed files make up the worker's sysroot.
+  GHashTable *dependencies;
+  GFile *scratch;
+};
+
+// Reads the worker addresses from KIKAI_WORKERS, a comma-separated list of unix:PATH or
+// HOST:PORT entries, and the token they expect from KIKAI_WORKER_TOKEN.
+gboolean kikai_remote_init();
+guint kikai_remote_count();
+// Blocks until a worker is idle, and hands it out until it's released.
+KikaiWorker *kikai_remote_acquire();
+void kikai_remote_release(KikaiWorker *worker);
+const gchar *kikai_remote_get_address(KikaiWorker *worker);
+
+gboolean kikai_remote_pack_tree(GFile *root, GFile *archive);
+gboolean kikai_remote_build(GFile *storage, KikaiWorker *worker, KikaiRemoteJob *job,
+                            GFile *staged, gboolean *installed);
+
+// Serves build requests carrying KIKAI_WORKER_TOKEN on address, one at a time, until
+// killed. Without a host, only connections from this machine are accepted.
+int kikai_remote_serve(GFile *storage, const gchar *address);
@@ -0,0 +1,159 @@
+#include <glib.h>
+
+#include "kikai-scheduler.h"
+
+typedef struct {
+  KikaiScheduler *scheduler;
+  const gchar *name;
+  gpointer item;
+  KikaiResources weight;
+  GThread *thread;
+  // The jobs waiting on this one, and how many jobs this one is still waiting on.
+  GPtrArray *dependents;
+  guint waiting;
+  gboolean passed_over, success;
+} Job;
+
+struct KikaiScheduler {
+  // What the running jobs may use between them, and what they're using.
+  KikaiResources budget, used;
+  KikaiSchedulerFunc func;
+  gpointer user_data;
+  // Jobs in the order they were added, and by name.
+  GPtrArray *jobs;
+  GHashTable *by_name;
+  // Finished jobs are pushed here by their threads.
+  GAsyncQueue *finished;
+};
+
+static void job_free(gpointer data) {
+  Job *job = data;
+  g_ptr_array_unref(job->dependents);
+  g_free(job);
+}
+
+KikaiScheduler *kikai_scheduler_new(const KikaiResources *budget,
+                                    KikaiSchedulerFunc func, gpointer user_data) {
+  KikaiScheduler *scheduler = g_new0(KikaiScheduler, 1);
+  scheduler->budget = *budget;
+  scheduler->func = func;
+  scheduler->user_data = user_data;
+  scheduler->jobs = g_ptr_array_new_with_free_func(job_free);
+  scheduler->by_name = g_hash_table_new(g_str_hash, g_str_equal);
+  scheduler->finished = g_async_queue_new();
+  return scheduler;
+}
+
+void kikai_scheduler_add(KikaiScheduler *scheduler, const gchar *name,
+                         gchar **dependencies, const KikaiResources *weight,
+                         gpointer item) {
+  Job *job = g_new0(Job, 1);
+  job->scheduler = scheduler;
+  job->name = name;
+  job->item = item;
+  job->weight = *weight;
+  job->dependents = g_ptr_array_new();
+
+  for (; *dependencies; dependencies++) {
+    Job *dependency = g_hash_table_lookup(scheduler->by_name, *dependencies);
+    if (dependency != NULL) {
+      g_ptr_array_add(dependency->dependents, job);
+      job->waiting++;
+    }
+  }
+
+  g_ptr_array_add(scheduler->jobs, job);
+  g_hash_table_insert(scheduler->by_name, (gpointer)name, job);
+}
+
+static gpointer run_job(gpointer data) {
+  Job *job = data;
+  KikaiScheduler *scheduler = job->scheduler;
+  job->success = scheduler->func(job->item, scheduler->user_data);
+  g_async_queue_push(scheduler->finished, job);
+  return NULL;
+}
+
+static gboolean fits(KikaiScheduler *scheduler, Job *job, guint running) {
+  KikaiResources *budget = &scheduler->budget, *used = &scheduler->used;
+  return running == 0 ||
+         (used->cpus + job->weight.cpus <= budget->cpus &&
+          used->memory + job->weight.memory <= budget->memory &&
+          used->workers + job->weight.workers <= budget->workers);
+}
+
+static void claim(KikaiScheduler *scheduler, Job *job) {
+  scheduler->used.cpus += job->weight.cpus;
+  scheduler->used.memory += job->weight.memory;
+  scheduler->used.workers += job->weight.workers;
+}
+
+static void release(KikaiScheduler *scheduler, Job *job) {
+  scheduler->used.cpus -= job->weight.cpus;
+  scheduler->used.memory -= job->weight.memory;
+  scheduler->used.workers -= job->weight.workers;
+}
+
+gboolean kikai_scheduler_run(KikaiScheduler *scheduler) {
+  GQueue ready = G_QUEUE_INIT;
+  for (int i = 0; i < scheduler->jobs->len; i++) {
+    Job *job = scheduler->jobs->pdata[i];
+    if (job->waiting == 0) {
+      g_queue_push_tail(&ready, job);
+    }
+  }
+
+  gboolean success = TRUE;
+  guint running = 0;
+
+  while (running != 0 || (success && !g_queue_is_empty(&ready))) {
+    // Jobs behind one that doesn't fit may start once, but after that the budget is left
+    // to drain until it does, so a large job can't be starved.
+    GList *next;
+    for (GList *link = ready.head; success && link != NULL; link = next) {
+      next = link->next;
+      Job *job = link->data;
+      if (!fits(scheduler, job, running)) {
+        if (job->passed_over) {
+          break;
+        }
+
+        job->passed_over = TRUE;
+        continue;
+      }
+
+      g_queue_delete_link(&ready, link);
+      claim(scheduler, job);
+      job->thread = g_thread_new(job->name, run_job, job);
+      running++;
+    }
+
+    Job *job = g_async_queue_pop(scheduler->finished);
+    g_thread_join(job->thread);
+    job->thread = NULL;
+    release(scheduler, job);
+    running--;
+
+    if (!job->success) {
+      success = FALSE;
+      continue;
+    }
+
+    for (int i = 0; i < job->dependents->len; i++) {
+      Job *dependent = job->dependents->pdata[i];
+      if (--dependent->waiting == 0) {
+        g_queue_push_tail(&ready, dependent);
+      }
+    }
+  }
+
+  g_queue_clear(&ready);
+  return success;
+}
+
+void kikai_scheduler_free(KikaiScheduler *scheduler) {
+  g_ptr_array_unref(scheduler->jobs);
+  g_hash_table_unref(scheduler->by_name);
+  g_async_queue_unref(scheduler->finished);
+  g_free(scheduler);
+}
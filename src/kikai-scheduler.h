@@ -0,0 +1,28 @@
+#pragma once
+
+#include <glib.h>
+
+typedef struct KikaiScheduler KikaiScheduler;
+typedef struct KikaiResources KikaiResources;
+
+typedef gboolean (*KikaiSchedulerFunc)(gpointer item, gpointer user_data);
+
+struct KikaiResources {
+  guint cpus;
+  guint64 memory;
+  guint workers;
+};
+
+// Runs func over every added item on its own thread, as many at once as fit in budget,
+// in the order they were added and once their dependencies have succeeded.
+KikaiScheduler *kikai_scheduler_new(const KikaiResources *budget,
+                                    KikaiSchedulerFunc func, gpointer user_data);
+// Items must be added after their dependencies. Dependencies that were never added are
+// taken to be done already. An item weighing more than the whole budget runs alone.
+void kikai_scheduler_add(KikaiScheduler *scheduler, const gchar *name,
+                         gchar **dependencies, const KikaiResources *weight,
+                         gpointer item);
+// Returns once everything has run, or once whatever was running when an item failed
+// has finished.
+gboolean kikai_scheduler_run(KikaiScheduler *scheduler);
+void kikai_scheduler_free(KikaiScheduler *scheduler);
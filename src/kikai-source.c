@@ -12,8 +12,13 @@
 #include <math.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "kikai-archive.h"
 #include "kikai-source.h"
+#include "kikai-spawn.h"
+#include "kikai-trace.h"
 #include "kikai-utils.h"
 
 static gboolean needs_update(const gchar *scope, const gchar *module_id,
@@ -148,8 +153,17 @@ static size_t write_data(void *ptr, size_t size, size_t nitems, WriterData *data
   return nbytes;
 }
 
-static gboolean download_file(const gchar *url, GFile *target, gchar **hash,
-                              guint64 *size) {
+gboolean kikai_source_init() {
+  if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+    g_printerr("Failed to initialize libcurl.");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+gboolean kikai_source_download(const gchar *url, GFile *target, gchar **hash,
+                               guint64 *size) {
   if (g_file_query_exists(target, NULL)) {
     g_file_delete(target, NULL, NULL);
   }
@@ -206,7 +220,37 @@ static gboolean download_file(const gchar *url, GFile *target, gchar **hash,
   return TRUE;
 }
 
-gboolean copy_archive_data(struct archive *reader, struct archive *writer) {
+// Files larger than this are rewritten without comparing them, rather than being held in
+// memory for the comparison.
+#define EXTRACT_COMPARE_MAX (64 * 1024 * 1024)
+
+// Files the build system reads to configure itself, by name or by extension.
+static const gchar *build_system_names[] = {
+  "configure", "GNUmakefile", "Makefile", "makefile", "CMakeLists.txt", "meson.build",
+  "meson_options.txt", "meson.options", NULL,
+};
+static const gchar *build_system_suffixes[] = {
+  ".ac", ".am", ".in", ".m4", ".cmake", NULL,
+};
+
+static gboolean is_build_system_file(const gchar *relative) {
+  g_autofree gchar *basename = g_path_get_basename(relative);
+  if (g_strv_contains(build_system_names, basename)) {
+    return TRUE;
+  }
+
+  for (const gchar **suffix = build_system_suffixes; *suffix; suffix++) {
+    if (g_str_has_suffix(basename, *suffix)) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+// Reads a regular file entry's data whole, so it can be compared and then still written.
+static GBytes *read_entry_data(struct archive *reader, gsize size) {
+  gchar *data = g_malloc0(size);
   for (;;) {
     gconstpointer buffer;
     gsize bufsz;
@@ -215,22 +259,71 @@ gboolean copy_archive_data(struct archive *reader, struct archive *writer) {
     int rc = archive_read_data_block(reader, &buffer, &bufsz, &offs);
     if (rc == ARCHIVE_EOF) {
       break;
-    } else if (rc < ARCHIVE_OK) {
+    } else if (rc < ARCHIVE_OK || offs + bufsz > size) {
       g_printerr("Reading data block from archive: %s", archive_error_string(reader));
-      return FALSE;
+      g_free(data);
+      return NULL;
     }
 
-    rc = archive_write_data_block(writer, buffer, bufsz, offs);
-    if (rc < ARCHIVE_OK) {
-      g_printerr("Writing data block from archive: %s", archive_error_string(writer));
+    memcpy(data + offs, buffer, bufsz);
+  }
+
+  return g_bytes_new_take(data, size);
+}
+
+// Whether the tree already holds exactly what the entry does. Regular files that are
+// compared have their data read into contents, whatever the outcome.
+static gboolean entry_unchanged(struct archive *reader, struct archive_entry *entry,
+                                const gchar *target, GBytes **contents) {
+  struct stat st;
+  if (lstat(target, &st) == -1) {
+    return FALSE;
+  }
+
+  switch (archive_entry_filetype(entry)) {
+  case AE_IFDIR:
+    return S_ISDIR(st.st_mode);
+  case AE_IFLNK: {
+    if (!S_ISLNK(st.st_mode)) {
       return FALSE;
     }
+
+    g_autofree gchar *link = g_file_read_link(target, NULL);
+    return link != NULL && g_strcmp0(link, archive_entry_symlink(entry)) == 0;
   }
+  case AE_IFREG: {
+    gint64 size = archive_entry_size(entry);
+    if (!S_ISREG(st.st_mode) || st.st_size != size ||
+        (st.st_mode & 07777) != archive_entry_perm(entry) ||
+        size > EXTRACT_COMPARE_MAX) {
+      return FALSE;
+    }
 
-  return TRUE;
+    gchar *existing;
+    gsize existing_size;
+    *contents = read_entry_data(reader, size);
+    if (*contents == NULL || !g_file_get_contents(target, &existing, &existing_size,
+                                                  NULL)) {
+      return FALSE;
+    }
+
+    gboolean equal = existing_size == size &&
+                     memcmp(existing, g_bytes_get_data(*contents, NULL), size) == 0;
+    g_free(existing);
+    return equal;
+  }
+  default:
+    return FALSE;
+  }
 }
 
-static gboolean extract_file_to_cwd(GFile *archive, guint64 size, int strip_parents) {
+// Entries are written to absolute paths under root rather than relative to the working
+// directory, so several sources can be extracted at once. When changes is given, root
+// already holds an earlier extraction, and only the entries that differ from it are
+// written. The relative path of every entry is added to paths when it's given.
+static gboolean extract_file_to(GFile *archive, const gchar *root, guint64 size,
+                                int strip_parents, KikaiSourceChanges *changes,
+                                GPtrArray *paths) {
   struct archive *reader = archive_read_new(), *writer = archive_write_disk_new();
 
   g_autoptr(GTimer) timer = g_timer_new();
@@ -259,6 +352,10 @@ static gboolean extract_file_to_cwd(GFile *archive, guint64 size, int strip_pare
 
   g_timer_start(timer);
 
+  // Rewritten files all get the time extraction started, which is newer than anything
+  // built from the old ones but keeps them from looking newer than each other.
+  gint64 now = g_get_real_time();
+
   for (;;) {
     struct archive_entry *entry;
     int rc = archive_read_next_header(reader, &entry);
@@ -300,14 +397,59 @@ static gboolean extract_file_to_cwd(GFile *archive, guint64 size, int strip_pare
       }
     }
 
+    g_autofree gchar *relative = g_strdup(archive_entry_pathname(entry));
+    g_autofree gchar *target = g_build_filename(root, relative, NULL);
+    archive_entry_copy_pathname(entry, target);
+
+    // Hard links name another entry of the archive, which was moved the same way.
+    const gchar *hardlink = archive_entry_hardlink(entry);
+    if (hardlink != NULL) {
+      g_autofree gchar *link_target = NULL;
+      if (strip_parents < 0) {
+        g_autofree gchar *basename = g_path_get_basename(hardlink);
+        link_target = g_build_filename(root, basename, NULL);
+      } else {
+        g_auto(GStrv) parts = g_strsplit(hardlink, G_DIR_SEPARATOR_S, -1);
+        if (g_strv_length(parts) <= strip_parents) {
+          continue;
+        }
+        g_autofree gchar *stripped = g_build_filenamev(parts + strip_parents);
+        link_target = g_build_filename(root, stripped, NULL);
+      }
+      archive_entry_copy_hardlink(entry, link_target);
+    }
+
+    if (paths != NULL) {
+      g_ptr_array_add(paths, g_strdup(relative));
+    }
+
+    g_autoptr(GBytes) contents = NULL;
+    if (changes != NULL) {
+      if (hardlink == NULL && entry_unchanged(reader, entry, target, &contents)) {
+        continue;
+      } else if (archive_entry_filetype(entry) != AE_IFDIR) {
+        changes->sources = TRUE;
+        changes->build_system = changes->build_system || is_build_system_file(relative);
+        archive_entry_set_mtime(entry, now / G_USEC_PER_SEC,
+                                now % G_USEC_PER_SEC * 1000);
+      }
+    }
+
     rc = archive_write_header(writer, entry);
     if (rc < ARCHIVE_OK) {
       g_printerr("Writing archive entry header: %s", archive_error_string(writer));
       goto done;
     }
 
-    if (archive_entry_size(entry) > 0) {
-      if (!copy_archive_data(reader, writer)) {
+    if (contents != NULL) {
+      gsize contents_size;
+      gconstpointer data = g_bytes_get_data(contents, &contents_size);
+      if (contents_size > 0 && archive_write_data(writer, data, contents_size) < 0) {
+        g_printerr("Writing archive data: %s", archive_error_string(writer));
+        goto done;
+      }
+    } else if (archive_entry_size(entry) > 0) {
+      if (!kikai_archive_copy_data(reader, writer)) {
         goto done;
       }
     }
@@ -337,24 +479,48 @@ static gboolean extract_file_to_cwd(GFile *archive, guint64 size, int strip_pare
   return success;
 }
 
-static gboolean extract_file(GFile *archive, GFile *extracted, guint64 size,
-                             int strip_parents) {
-  gchar *orig_cwd = g_get_current_dir();
-  if (g_chdir(g_file_get_path(extracted)) == -1) {
-    g_printerr("Setting working directory: %s", strerror(errno));
+gboolean kikai_source_extract(GFile *archive, GFile *extracted, guint64 size,
+                              int strip_parents, KikaiSourceChanges *changes) {
+  g_autofree gchar *root = g_file_get_path(extracted);
+  return extract_file_to(archive, root, size, strip_parents, changes, NULL);
+}
+
+// Each source's extracted paths are listed under its download id, so the files a new
+// version no longer has can be told apart from other sources' and after scripts' files.
+static GFile *get_extracted_list(GFile *storage, const gchar *module_id,
+                                 const gchar *name) {
+  return kikai_join(storage, "extracted-files", module_id, name, NULL);
+}
+
+static gboolean save_extracted_list(GFile *list, GPtrArray *paths) {
+  g_autoptr(GFile) parent = g_file_get_parent(list);
+  g_autoptr(GString) contents = g_string_new(NULL);
+  for (int i = 0; i < paths->len; i++) {
+    g_string_append_printf(contents, "%s\n", (gchar *)paths->pdata[i]);
+  }
+
+  g_autoptr(GError) error = NULL;
+  if (!kikai_mkdir_parents(parent) ||
+      !g_file_replace_contents(list, contents->str, contents->len, NULL, FALSE,
+                               G_FILE_CREATE_NONE, NULL, NULL, &error)) {
+    if (error != NULL) {
+      g_printerr("Failed to write %s: %s", g_file_get_path(list), error->message);
+    }
     return FALSE;
   }
 
-  gboolean status = extract_file_to_cwd(archive, size, strip_parents);
-  g_chdir(orig_cwd);
-  return status;
+  return TRUE;
+}
+
+static gchar *get_download_id(KikaiModuleSourceSpec *source) {
+  return kikai_hash_bytes(source->url, -1, source->after, -1, &source->strip_parents,
+                          sizeof(source->strip_parents), NULL);
 }
 
-gboolean kikai_processsource(GFile *storage, GFile *extracted, gchar *module_id,
-                             KikaiModuleSourceSpec *source, gboolean *updated) {
-  g_autofree gchar *download_id = kikai_hash_bytes(source->url, -1, source->after, -1,
-                                                   &source->strip_parents,
-                                                   sizeof(source->strip_parents), NULL);
+gboolean kikai_processsource(GFile *storage, GFile *extracted, GFile *logs,
+                             gchar *module_id, KikaiModuleSourceSpec *source,
+                             KikaiSourceChanges *changes, GChecksum *inputs) {
+  g_autofree gchar *download_id = get_download_id(source);
   g_autoptr(GFile) downloads = kikai_join(storage, "downloads", module_id, NULL);
 
   guint64 size = 0;
@@ -371,17 +537,19 @@ gboolean kikai_processsource(GFile *storage, GFile *extracted, gchar *module_id,
       return FALSE;
     }
 
-    if (!download_file(source->url, download, &hash, &size)) {
+    gint64 start = kikai_trace_now();
+    if (!kikai_source_download(source->url, download, &hash, &size)) {
       return FALSE;
     }
+    kikai_trace_span("download", source->url, start);
 
     if (!set_key("download", module_id, download_id, hash, size)) {
       return FALSE;
     }
   }
 
-  gboolean update_extracted = update_download ||
-                              !g_file_query_exists(extracted, NULL) ||
+  gboolean existed = g_file_query_exists(extracted, NULL);
+  gboolean update_extracted = update_download || !existed ||
                               needs_update("extracted", module_id, download_id, NULL,
                                            NULL, NULL);
 
@@ -393,33 +561,213 @@ gboolean kikai_processsource(GFile *storage, GFile *extracted, gchar *module_id,
     if (!kikai_mkdir_parents(extracted)) {
       return FALSE;
     }
-    if (!extract_file(download, extracted, size, source->strip_parents)) {
+
+    // A new version extracted over the old one only rewrites the files that differ, so
+    // the build can pick up where it left off.
+    KikaiSourceChanges extracted_changes = {
+      .sources = !existed,
+      .build_system = !existed,
+    };
+    // The list from the last extraction is kept aside, so kikai_source_prune can remove
+    // whatever this one doesn't have any more.
+    g_autoptr(GFile) list = get_extracted_list(storage, module_id, download_id);
+    g_autofree gchar *old_name = g_strconcat(download_id, ".old", NULL);
+    g_autoptr(GFile) old_list = get_extracted_list(storage, module_id, old_name);
+    g_autoptr(GError) move_error = NULL;
+    if (!g_file_move(list, old_list, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL,
+                     &move_error) &&
+        !g_error_matches(move_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
+      g_printerr("Failed to move %s: %s", g_file_get_path(list), move_error->message);
+      return FALSE;
+    }
+
+    g_autoptr(GPtrArray) paths = g_ptr_array_new_with_free_func(g_free);
+    g_autofree gchar *root = g_file_get_path(extracted);
+    gint64 start = kikai_trace_now();
+    if (!extract_file_to(download, root, size, source->strip_parents,
+                         existed ? &extracted_changes : NULL, paths) ||
+        !save_extracted_list(list, paths)) {
+      return FALSE;
+    }
+    kikai_trace_span("extract", source->url, start);
+
+    // Whatever the after script edits was just put back the way the archive has it, so
+    // it's rewritten again on every extraction.
+    g_autoptr(GHashTable) snapshot = NULL;
+    if (existed && source->after != NULL &&
+        (snapshot = kikai_tree_snapshot(extracted)) == NULL) {
       return FALSE;
     }
 
     if (source->after != NULL) {
       gchar *args[] = {"/bin/sh", "-ec", (gchar *)source->after, NULL};
 
+      g_autofree gchar *log_name = g_strdup_printf("after-%.8s.log.gz", download_id);
+      g_autoptr(GFile) log = g_file_get_child(logs, log_name);
+
       g_autoptr(GError) error = NULL;
-      gint status;
-      if (!g_spawn_sync(g_file_get_path(extracted), args, NULL, G_SPAWN_DEFAULT, NULL,
-                        NULL, NULL, NULL, &status, &error)) {
-        g_printerr("Failed to spawn build step: %s", error->message);
+      if (!kikai_spawn("after", extracted, args, NULL, G_SPAWN_DEFAULT, log, &error)) {
+        g_printerr("Source after script failed: %s", error->message);
         return FALSE;
       }
+    }
 
-      if (!g_spawn_check_exit_status(status, &error)) {
-        g_printerr("Build step failed: %s", error->message);
+    if (snapshot != NULL) {
+      g_autoptr(GPtrArray) edited = kikai_tree_changes(extracted, snapshot);
+      if (edited == NULL) {
         return FALSE;
       }
+
+      extracted_changes.sources = extracted_changes.sources || edited->len != 0;
+      for (int i = 0; i < edited->len; i++) {
+        extracted_changes.build_system = extracted_changes.build_system ||
+                                         is_build_system_file(edited->pdata[i]);
+      }
     }
 
+    changes->sources = changes->sources || extracted_changes.sources;
+    changes->build_system = changes->build_system || extracted_changes.build_system;
+
     if (!set_key("extracted", module_id, download_id, hash, size)) {
       return FALSE;
     }
   }
 
-  *updated = *updated || update_extracted;
+  g_checksum_update(inputs, (guchar *)download_id, -1);
+  g_checksum_update(inputs, (guchar *)hash, -1);
+
+  return TRUE;
+}
+
+static GHashTable *load_extracted_list(GFile *list) {
+  g_autofree gchar *contents = NULL;
+  if (!g_file_load_contents(list, NULL, &contents, NULL, NULL, NULL)) {
+    return NULL;
+  }
+
+  GHashTable *paths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  g_auto(GStrv) lines = g_strsplit(contents, "\n", -1);
+  for (gchar **line = lines; *line; line++) {
+    if (**line != '\0') {
+      g_hash_table_add(paths, g_strdup(*line));
+    }
+  }
+  return paths;
+}
+
+static gint compare_reversed(gconstpointer a, gconstpointer b) {
+  return -strcmp(*(const gchar **)a, *(const gchar **)b);
+}
+
+gboolean kikai_source_prune(GFile *storage, GFile *extracted, const gchar *module_id,
+                            GArray *sources, KikaiSourceChanges *changes) {
+  g_autoptr(GFile) lists = kikai_join(storage, "extracted-files", module_id, NULL);
+  g_autoptr(GHashTable) current = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                        g_free, NULL);
+  g_autoptr(GHashTable) keep = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                                     NULL);
+  for (int i = 0; i < sources->len; i++) {
+    gchar *download_id = get_download_id(&g_array_index(sources, KikaiModuleSourceSpec,
+                                                        i));
+    g_autoptr(GFile) list = g_file_get_child(lists, download_id);
+    g_hash_table_add(current, download_id);
+
+    g_autoptr(GHashTable) paths = load_extracted_list(list);
+    if (paths == NULL) {
+      continue;
+    }
+
+    GHashTableIter iter;
+    gchar *path;
+    g_hash_table_iter_init(&iter, paths);
+    while (g_hash_table_iter_next(&iter, (gpointer *)&path, NULL)) {
+      g_hash_table_add(keep, g_strdup(path));
+    }
+  }
+
+  g_autofree gchar *lists_path = g_file_get_path(lists);
+  GDir *dir = g_dir_open(lists_path, 0, NULL);
+  if (dir == NULL) {
+    return TRUE;
+  }
+
+  g_autoptr(GPtrArray) stale = g_ptr_array_new_with_free_func(g_free);
+  g_autoptr(GPtrArray) stale_lists = g_ptr_array_new_with_free_func(g_object_unref);
+  const gchar *name;
+  while ((name = g_dir_read_name(dir)) != NULL) {
+    if (g_hash_table_contains(current, name)) {
+      continue;
+    }
+
+    GFile *list = g_file_get_child(lists, name);
+    g_ptr_array_add(stale_lists, list);
+    g_autoptr(GHashTable) paths = load_extracted_list(list);
+    if (paths == NULL) {
+      continue;
+    }
+
+    GHashTableIter iter;
+    gchar *path;
+    g_hash_table_iter_init(&iter, paths);
+    while (g_hash_table_iter_next(&iter, (gpointer *)&path, NULL)) {
+      if (!g_hash_table_contains(keep, path)) {
+        g_ptr_array_add(stale, g_strdup(path));
+      }
+    }
+  }
+  g_dir_close(dir);
+
+  // Children sort after their parents, so going backwards empties directories first.
+  g_ptr_array_sort(stale, compare_reversed);
+  g_autofree gchar *root = g_file_get_path(extracted);
+  for (int i = 0; i < stale->len; i++) {
+    const gchar *relative = stale->pdata[i];
+    g_autofree gchar *path = g_build_filename(root, relative, NULL);
+    struct stat st;
+    if (lstat(path, &st) == -1) {
+      continue;
+    }
+
+    // Directories something else put files in are left alone.
+    if (S_ISDIR(st.st_mode)) {
+      g_rmdir(path);
+      continue;
+    } else if (g_unlink(path) == -1) {
+      g_printerr("Failed to remove %s: %s", path, strerror(errno));
+      return FALSE;
+    }
+
+    changes->sources = TRUE;
+    changes->build_system = changes->build_system || is_build_system_file(relative);
+  }
+
+  for (int i = 0; i < stale_lists->len; i++) {
+    g_autoptr(GError) error = NULL;
+    if (!g_file_delete(stale_lists->pdata[i], NULL, &error) &&
+        !g_error_matches(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
+      g_printerr("Failed to remove %s: %s", g_file_get_path(stale_lists->pdata[i]),
+                 error->message);
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+// Drops a source's download, so the next run fetches it again. Local sources can change
+// without their URL changing.
+gboolean kikai_source_forget(GFile *storage, gchar *module_id,
+                             KikaiModuleSourceSpec *source) {
+  g_autofree gchar *download_id = get_download_id(source);
+  g_autoptr(GFile) download = kikai_join(storage, "downloads", module_id, download_id,
+                                         NULL);
+
+  g_autoptr(GError) error = NULL;
+  if (!g_file_delete(download, NULL, &error) &&
+      !g_error_matches(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
+    g_printerr("Failed to remove download: %s", error->message);
+    return FALSE;
+  }
 
   return TRUE;
 }
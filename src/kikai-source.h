@@ -4,5 +4,30 @@
 
 #include "kikai-builderspec.h"
 
-gboolean kikai_processsource(GFile *storage, GFile *extracted, gchar *module_id,
-                             KikaiModuleSourceSpec *source, gboolean *updated);
+// Sets up libcurl's global state, which has to happen before downloads start on several
+// threads at once.
+gboolean kikai_source_init();
+// Downloads url into target, returning the SHA-256 and size of what was downloaded.
+gboolean kikai_source_download(const gchar *url, GFile *target, gchar **hash,
+                               guint64 *size);
+typedef struct {
+  // Whether any file was written, and whether any of them is one the build system reads
+  // to configure itself, so the build has to be configured again.
+  gboolean sources, build_system;
+} KikaiSourceChanges;
+
+// Extracts archive into extracted, dropping the first strip_parents path components of
+// every entry, or keeping only the basename when it's negative. With changes, only the
+// entries that differ from what's already there are written, and recorded in changes.
+gboolean kikai_source_extract(GFile *archive, GFile *extracted, guint64 size,
+                              int strip_parents, KikaiSourceChanges *changes);
+
+gboolean kikai_processsource(GFile *storage, GFile *extracted, GFile *logs,
+                             gchar *module_id, KikaiModuleSourceSpec *source,
+                             KikaiSourceChanges *changes, GChecksum *inputs);
+// Removes the files that earlier extractions of the module's sources wrote and that
+// none of the current ones have, recording them in changes.
+gboolean kikai_source_prune(GFile *storage, GFile *extracted, const gchar *module_id,
+                            GArray *sources, KikaiSourceChanges *changes);
+gboolean kikai_source_forget(GFile *storage, gchar *module_id,
+                             KikaiModuleSourceSpec *source);
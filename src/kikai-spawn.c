@@ -0,0 +1,172 @@
+#include <glib.h>
+#include <glib-unix.h>
+#include <gio/gio.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "kikai-cgroup.h"
+#include "kikai-spawn.h"
+#include "kikai-trace.h"
+#include "kikai-utils.h"
+
+#define KIKAI_LOG_LINE_MAX 512
+
+typedef struct {
+  GOutputStream *os;
+  // The last few complete lines of output, plus whatever partial line follows them.
+  GQueue tail;
+  GString *partial;
+} LogData;
+
+static void tail_append(LogData *data, const gchar *buffer, gsize size) {
+  for (gsize i = 0; i < size; i++) {
+    if (buffer[i] != '\n') {
+      // Progress bars and the like can emit huge lines, so only their start is kept.
+      if (data->partial->len < KIKAI_LOG_LINE_MAX) {
+        g_string_append_c(data->partial, buffer[i]);
+      }
+      continue;
+    }
+
+    g_queue_push_tail(&data->tail, g_string_free(data->partial, FALSE));
+    data->partial = g_string_new(NULL);
+
+    if (g_queue_get_length(&data->tail) > KIKAI_LOG_TAIL_LINES) {
+      g_free(g_queue_pop_head(&data->tail));
+    }
+  }
+}
+
+static void show_tail(LogData *data, GFile *log) {
+  if (data->partial->len != 0) {
+    tail_append(data, "\n", 1);
+  }
+
+  g_autofree gchar *path = g_file_get_path(log);
+  fprintf(stderr, KIKAI_CBOLD "Last lines of %s:" KIKAI_CRESET "\n", path);
+  for (GList *line = data->tail.head; line != NULL; line = line->next) {
+    fprintf(stderr, "  %s\n", (gchar *)line->data);
+  }
+}
+
+// Pumps both pipes into the log until the child closes them. The pipes are non-blocking,
+// so a chatty stream never stalls behind a quiet one.
+static gboolean pump_output(LogData *data, gint out_fd, gint err_fd, GError **error) {
+  struct pollfd fds[] = {
+    {.fd = out_fd, .events = POLLIN},
+    {.fd = err_fd, .events = POLLIN},
+  };
+  int open_fds = G_N_ELEMENTS(fds);
+  gboolean success = TRUE;
+  gchar buffer[65536];
+
+  while (success && open_fds > 0) {
+    if (poll(fds, G_N_ELEMENTS(fds), -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), "poll: %s",
+                  strerror(errno));
+      success = FALSE;
+      break;
+    }
+
+    for (int i = 0; i < G_N_ELEMENTS(fds); i++) {
+      if (fds[i].fd == -1 || fds[i].revents == 0) {
+        continue;
+      }
+
+      gssize bytes = read(fds[i].fd, buffer, sizeof(buffer));
+      if (bytes == -1 && (errno == EAGAIN || errno == EINTR)) {
+        continue;
+      } else if (bytes <= 0) {
+        close(fds[i].fd);
+        fds[i].fd = -1;
+        open_fds--;
+        continue;
+      }
+
+      tail_append(data, buffer, bytes);
+      if (!g_output_stream_write_all(data->os, buffer, bytes, NULL, NULL, error)) {
+        success = FALSE;
+        break;
+      }
+    }
+  }
+
+  // Closing whatever is left keeps the child from blocking on a pipe nobody reads.
+  for (int i = 0; i < G_N_ELEMENTS(fds); i++) {
+    if (fds[i].fd != -1) {
+      close(fds[i].fd);
+    }
+  }
+
+  return success;
+}
+
+gboolean kikai_spawn(const gchar *descr, GFile *cwd, gchar **args, gchar **env,
+                     GSpawnFlags flags, GFile *log, GError **error) {
+  g_autoptr(GFile) log_parent = g_file_get_parent(log);
+  if (!kikai_mkdir_parents(log_parent)) {
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to create log directory");
+    return FALSE;
+  }
+
+  g_autoptr(GFileOutputStream) fos = g_file_replace(log, NULL, FALSE, G_FILE_CREATE_NONE,
+                                                    NULL, error);
+  if (fos == NULL) {
+    return FALSE;
+  }
+
+  g_autoptr(GZlibCompressor) compressor = g_zlib_compressor_new(
+    G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
+  g_autoptr(GOutputStream) os = g_converter_output_stream_new(G_OUTPUT_STREAM(fos),
+                                                              G_CONVERTER(compressor));
+
+  GPid pid;
+  gint out_fd, err_fd;
+  gint64 start = kikai_trace_now();
+  g_autofree gchar *cwd_path = cwd != NULL ? g_file_get_path(cwd) : NULL;
+  // Builds with a memory limit start out inside their module's cgroup.
+  const gchar *cgroup_procs = kikai_cgroup_get_procs();
+  if (!g_spawn_async_with_pipes(cwd_path, args, env, flags | G_SPAWN_DO_NOT_REAP_CHILD,
+                                cgroup_procs != NULL ? kikai_cgroup_child_setup : NULL,
+                                (gpointer)cgroup_procs, &pid, NULL, &out_fd, &err_fd,
+                                error)) {
+    return FALSE;
+  }
+
+  LogData data = {.os = os, .partial = g_string_new(NULL)};
+  g_queue_init(&data.tail);
+
+  g_unix_set_fd_nonblocking(out_fd, TRUE, NULL);
+  g_unix_set_fd_nonblocking(err_fd, TRUE, NULL);
+
+  gboolean success = pump_output(&data, out_fd, err_fd, error);
+
+  gint status;
+  struct rusage usage;
+  while (wait4(pid, &status, 0, &usage) == -1 && errno == EINTR);
+  g_spawn_close_pid(pid);
+  kikai_trace_process(descr, start, args, status, &usage);
+
+  if (!g_output_stream_close(os, NULL, success ? error : NULL)) {
+    success = FALSE;
+  }
+
+  if (success && !g_spawn_check_exit_status(status, error)) {
+    show_tail(&data, log);
+    success = FALSE;
+  }
+
+  g_queue_clear_full(&data.tail, g_free);
+  g_string_free(data.partial, TRUE);
+  return success;
+}
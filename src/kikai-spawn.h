@@ -0,0 +1,9 @@
+#pragma once
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#define KIKAI_LOG_TAIL_LINES 30
+
+gboolean kikai_spawn(const gchar *descr, GFile *cwd, gchar **args, gchar **env,
+                     GSpawnFlags flags, GFile *log, GError **error);
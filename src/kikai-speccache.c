@@ -0,0 +1,308 @@
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "kikai-speccache.h"
+
+// The validated spec is stored as a single GVariant, whose strings are used straight out
+// of the mapped cache file instead of being copied.
+#define TOOLCHAIN_TYPE "(ssmsbay)"
+#define TMPFS_TYPE "(stb)"
+#define SOURCE_TYPE "(smsi)"
+#define STEP_TYPE "(ssmasmas)"
+#define BUILD_TYPE "(ua" STEP_TYPE "msmsmsmsmsb)"
+#define MODULE_TYPE "(sa" SOURCE_TYPE "astutb" BUILD_TYPE ")"
+#define VARIANT_TYPE "(smsmsmsms)"
+#define CACHE_TYPE \
+  "(ssmsmsbb" TOOLCHAIN_TYPE TMPFS_TYPE "a" VARIANT_TYPE "a" MODULE_TYPE "as)"
+
+const gchar KIKAI_SPECCACHE_LAYOUT[] = CACHE_TYPE;
+const gchar KIKAI_SPECCACHE_MODULE_LAYOUT[] = MODULE_TYPE;
+
+static GVariant *maybe_string(const gchar *value) {
+  return g_variant_new_maybe(G_VARIANT_TYPE_STRING,
+                             value != NULL ? g_variant_new_string(value) : NULL);
+}
+
+static GVariant *maybe_strv(GArray *values) {
+  GVariant *strv = NULL;
+  if (values != NULL) {
+    strv = g_variant_new_strv((const gchar * const *)values->data, values->len);
+  }
+  return g_variant_new_maybe(G_VARIANT_TYPE_STRING_ARRAY, strv);
+}
+
+static GVariant *serialize_build(KikaiModuleBuildSpec *build) {
+  GVariantBuilder steps;
+  g_variant_builder_init(&steps, G_VARIANT_TYPE("a" STEP_TYPE));
+
+  const gchar *configure_options = NULL, *make_options = NULL, *cflags = NULL,
+              *cppflags = NULL, *ldflags = NULL;
+  gboolean autoconf_cache = FALSE;
+
+  switch (build->type) {
+  case KIKAI_BUILD_SIMPLE:
+    for (int i = 0; i < build->simple.steps->len; i++) {
+      KikaiModuleSimpleBuildStep *step = &g_array_index(build->simple.steps,
+                                                        KikaiModuleSimpleBuildStep, i);
+      g_variant_builder_add_value(&steps, g_variant_new("(ss@mas@mas)", step->name,
+                                                        step->run,
+                                                        maybe_strv(step->inputs),
+                                                        maybe_strv(step->outputs)));
+    }
+    cflags = build->simple.cflags;
+    cppflags = build->simple.cppflags;
+    ldflags = build->simple.ldflags;
+    break;
+  case KIKAI_BUILD_AUTOTOOLS:
+    configure_options = build->autotools.configure_options;
+    make_options = build->autotools.make_options;
+    cflags = build->autotools.cflags;
+    cppflags = build->autotools.cppflags;
+    ldflags = build->autotools.ldflags;
+    autoconf_cache = build->autotools.autoconf_cache;
+    break;
+  case KIKAI_BUILD_CMAKE:
+    configure_options = build->cmake.configure_options;
+    cflags = build->cmake.cflags;
+    cppflags = build->cmake.cppflags;
+    ldflags = build->cmake.ldflags;
+    break;
+  case KIKAI_BUILD_MESON:
+    configure_options = build->meson.configure_options;
+    cflags = build->meson.cflags;
+    cppflags = build->meson.cppflags;
+    ldflags = build->meson.ldflags;
+    break;
+  }
+
+  return g_variant_new("(u@a" STEP_TYPE "@ms@ms@ms@ms@msb)", build->type,
+                       g_variant_builder_end(&steps), maybe_string(configure_options),
+                       maybe_string(make_options), maybe_string(cflags),
+                       maybe_string(cppflags), maybe_string(ldflags), autoconf_cache);
+}
+
+GVariant *kikai_speccache_serialize_module(KikaiModuleSpec *module) {
+  GVariantBuilder sources;
+  g_variant_builder_init(&sources, G_VARIANT_TYPE("a" SOURCE_TYPE));
+  for (int i = 0; i < module->sources->len; i++) {
+    KikaiModuleSourceSpec *source = &g_array_index(module->sources, KikaiModuleSourceSpec,
+                                                   i);
+    g_variant_builder_add_value(&sources, g_variant_new("(s@msi)", source->url,
+                                                        maybe_string(source->after),
+                                                        source->strip_parents));
+  }
+
+  GVariant *dependencies = g_variant_new_strv(
+    (const gchar * const *)module->dependencies->data, module->dependencies->len);
+
+  return g_variant_new("(s@a" SOURCE_TYPE "@astutb@" BUILD_TYPE ")", module->name,
+                       g_variant_builder_end(&sources), dependencies,
+                       module->memory_per_job, module->cpus, module->memory_limit,
+                       module->strip, serialize_build(&module->build));
+}
+
+void kikai_speccache_store(KikaiBuilderSpec *builder, GFile *cache, const gchar *key) {
+  KikaiToolchainSpec *toolchain = &builder->toolchain;
+
+  GVariantBuilder platforms;
+  g_variant_builder_init(&platforms, G_VARIANT_TYPE_BYTESTRING);
+  for (int i = 0; i < toolchain->platforms->len; i++) {
+    g_variant_builder_add(&platforms, "y",
+                          (guchar)g_array_index(toolchain->platforms,
+                                                KikaiToolchainPlatform, i));
+  }
+
+  GVariantBuilder variants;
+  g_variant_builder_init(&variants, G_VARIANT_TYPE("a" VARIANT_TYPE));
+  for (int i = 0; i < builder->variants->len; i++) {
+    KikaiVariantSpec *variant = &g_array_index(builder->variants, KikaiVariantSpec, i);
+    g_variant_builder_add_value(&variants, g_variant_new(
+      "(s@ms@ms@ms@ms)", variant->name, maybe_string(variant->cflags),
+      maybe_string(variant->cppflags), maybe_string(variant->ldflags),
+      maybe_string(variant->install_root)));
+  }
+
+  GVariantBuilder modules;
+  g_variant_builder_init(&modules, G_VARIANT_TYPE("a" MODULE_TYPE));
+
+  GHashTableIter iter;
+  KikaiModuleSpec *module;
+  g_hash_table_iter_init(&iter, builder->modules);
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&module)) {
+    g_variant_builder_add_value(&modules, kikai_speccache_serialize_module(module));
+  }
+
+  GVariant *toolchain_v = g_variant_new("(ss@msb@ay)", toolchain->api, toolchain->stl,
+                                        maybe_string(toolchain->after),
+                                        toolchain->standalone,
+                                        g_variant_builder_end(&platforms));
+  GVariant *includes = g_variant_new_strv((const gchar * const *)builder->includes->data,
+                                          builder->includes->len);
+
+  GVariant *tmpfs_v = g_variant_new(TMPFS_TYPE, builder->tmpfs.path,
+                                    builder->tmpfs.budget, builder->tmpfs.sources);
+
+  g_autoptr(GVariant) root = g_variant_ref_sink(g_variant_new(
+    "(ss@ms@msbb@" TOOLCHAIN_TYPE "@" TMPFS_TYPE "@a" VARIANT_TYPE "@a" MODULE_TYPE
+    "@as)", key, builder->install_root, maybe_string(builder->artifact_cache),
+    maybe_string(builder->store), builder->compiler_cache, builder->cgroups, toolchain_v,
+    tmpfs_v, g_variant_builder_end(&variants), g_variant_builder_end(&modules),
+    includes));
+
+  // The cache is only an optimization, so failing to write it isn't an error.
+  g_autoptr(GBytes) data = g_variant_get_data_as_bytes(root);
+  g_autofree gchar *path = g_file_get_path(cache);
+  g_file_set_contents(path, g_bytes_get_data(data, NULL), g_bytes_get_size(data), NULL);
+}
+
+static GArray *load_strv(GVariant *strv) {
+  if (strv == NULL) {
+    return NULL;
+  }
+
+  gsize len;
+  const gchar **items = g_variant_get_strv(strv, &len);
+  GArray *array = g_array_new(TRUE, FALSE, sizeof(gchar *));
+  g_array_append_vals(array, items, len);
+  g_free(items);
+  g_variant_unref(strv);
+  return array;
+}
+
+static void load_build(KikaiModuleBuildSpec *build, GVariant *build_v) {
+  g_autoptr(GVariantIter) steps = NULL;
+  const gchar *configure_options, *make_options, *cflags, *cppflags, *ldflags;
+  gboolean autoconf_cache;
+  guint32 type;
+
+  g_variant_get(build_v, "(ua" STEP_TYPE "m&sm&sm&sm&sm&sb)", &type, &steps,
+                &configure_options, &make_options, &cflags, &cppflags, &ldflags,
+                &autoconf_cache);
+  build->type = type;
+
+  switch (build->type) {
+  case KIKAI_BUILD_SIMPLE:
+    build->simple.steps = g_array_new(FALSE, FALSE, sizeof(KikaiModuleSimpleBuildStep));
+
+    KikaiModuleSimpleBuildStep step;
+    GVariant *inputs, *outputs;
+    while (g_variant_iter_next(steps, "(&s&s@mas@mas)", &step.name, &step.run, &inputs,
+                               &outputs)) {
+      step.inputs = load_strv(g_variant_get_maybe(inputs));
+      step.outputs = load_strv(g_variant_get_maybe(outputs));
+      g_variant_unref(inputs);
+      g_variant_unref(outputs);
+      g_array_append_val(build->simple.steps, step);
+    }
+    build->simple.cflags = cflags;
+    build->simple.cppflags = cppflags;
+    build->simple.ldflags = ldflags;
+    break;
+  case KIKAI_BUILD_AUTOTOOLS:
+    build->autotools.configure_options = configure_options;
+    build->autotools.make_options = make_options;
+    build->autotools.cflags = cflags;
+    build->autotools.cppflags = cppflags;
+    build->autotools.ldflags = ldflags;
+    build->autotools.autoconf_cache = autoconf_cache;
+    break;
+  case KIKAI_BUILD_CMAKE:
+    build->cmake.configure_options = configure_options;
+    build->cmake.cflags = cflags;
+    build->cmake.cppflags = cppflags;
+    build->cmake.ldflags = ldflags;
+    break;
+  case KIKAI_BUILD_MESON:
+    build->meson.configure_options = configure_options;
+    build->meson.cflags = cflags;
+    build->meson.cppflags = cppflags;
+    build->meson.ldflags = ldflags;
+    break;
+  }
+}
+
+KikaiModuleSpec *kikai_speccache_load_module(GVariant *module_v) {
+  KikaiModuleSpec *module = g_new0(KikaiModuleSpec, 1);
+  g_autoptr(GVariantIter) sources = NULL;
+  g_autoptr(GVariant) build_v = NULL;
+  GVariant *dependencies;
+
+  g_variant_get(module_v, "(&sa" SOURCE_TYPE "@astutb@" BUILD_TYPE ")", &module->name,
+                &sources, &dependencies, &module->memory_per_job, &module->cpus,
+                &module->memory_limit, &module->strip, &build_v);
+
+  module->sources = g_array_new(FALSE, FALSE, sizeof(KikaiModuleSourceSpec));
+  KikaiModuleSourceSpec source;
+  while (g_variant_iter_next(sources, "(&sm&si)", &source.url, &source.after,
+                             &source.strip_parents)) {
+    g_array_append_val(module->sources, source);
+  }
+
+  module->dependencies = load_strv(dependencies);
+  load_build(&module->build, build_v);
+  return module;
+}
+
+gboolean kikai_speccache_load(KikaiBuilderSpec *builder, GFile *cache, const gchar *key) {
+  g_autofree gchar *path = g_file_get_path(cache);
+  GMappedFile *mapped = g_mapped_file_new(path, FALSE, NULL);
+  if (mapped == NULL) {
+    return FALSE;
+  }
+
+  // The spec's strings point into the mapping, so it stays alive for the whole run.
+  g_autoptr(GBytes) data = g_mapped_file_get_bytes(mapped);
+  g_mapped_file_unref(mapped);
+
+  g_autoptr(GVariant) root = g_variant_ref_sink(
+    g_variant_new_from_bytes(G_VARIANT_TYPE(CACHE_TYPE), data, FALSE));
+
+  // Anything malformed, most likely a truncated write, is treated as a cache miss.
+  const gchar *cached_key = NULL;
+  g_variant_get_child(root, 0, "&s", &cached_key);
+  if (g_strcmp0(cached_key, key) != 0 || !g_variant_is_normal_form(root)) {
+    return FALSE;
+  }
+
+  g_autoptr(GVariantIter) variants = NULL;
+  g_autoptr(GVariantIter) modules = NULL;
+  g_autoptr(GVariant) platforms = NULL;
+  GVariant *includes;
+  KikaiToolchainSpec *toolchain = &builder->toolchain;
+
+  g_variant_get(root, "(&s&sm&sm&sbb(&s&sm&sb@ay)(&stb)a" VARIANT_TYPE "a" MODULE_TYPE
+                "@as)", NULL, &builder->install_root, &builder->artifact_cache,
+                &builder->store, &builder->compiler_cache, &builder->cgroups,
+                &toolchain->api, &toolchain->stl, &toolchain->after,
+                &toolchain->standalone, &platforms, &builder->tmpfs.path,
+                &builder->tmpfs.budget, &builder->tmpfs.sources, &variants, &modules,
+                &includes);
+  builder->includes = load_strv(includes);
+
+  builder->variants = g_array_new(FALSE, FALSE, sizeof(KikaiVariantSpec));
+  KikaiVariantSpec variant;
+  while (g_variant_iter_next(variants, "(&sm&sm&sm&sm&s)", &variant.name, &variant.cflags,
+                             &variant.cppflags, &variant.ldflags,
+                             &variant.install_root)) {
+    g_array_append_val(builder->variants, variant);
+  }
+
+  gsize n_platforms;
+  const guchar *platform_bytes = g_variant_get_fixed_array(platforms, &n_platforms, 1);
+  toolchain->platforms = g_array_new(FALSE, FALSE, sizeof(KikaiToolchainPlatform));
+  for (gsize i = 0; i < n_platforms; i++) {
+    KikaiToolchainPlatform platform = platform_bytes[i];
+    g_array_append_val(toolchain->platforms, platform);
+  }
+
+  builder->modules = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+  GVariant *module_v;
+  while ((module_v = g_variant_iter_next_value(modules)) != NULL) {
+    KikaiModuleSpec *module = kikai_speccache_load_module(module_v);
+    g_hash_table_insert(builder->modules, (gpointer)module->name, module);
+    g_variant_unref(module_v);
+  }
+
+  g_variant_ref(root);
+  return TRUE;
+}
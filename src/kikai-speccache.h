@@ -0,0 +1,17 @@
+#pragma once
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "kikai-builderspec.h"
+
+extern const gchar KIKAI_SPECCACHE_LAYOUT[];
+extern const gchar KIKAI_SPECCACHE_MODULE_LAYOUT[];
+
+gboolean kikai_speccache_load(KikaiBuilderSpec *builder, GFile *cache, const gchar *key);
+void kikai_speccache_store(KikaiBuilderSpec *builder, GFile *cache, const gchar *key);
+
+// A single module on its own, as shipped to build workers. The loaded module's strings
+// point into module_v, which has to outlive it.
+GVariant *kikai_speccache_serialize_module(KikaiModuleSpec *module);
+KikaiModuleSpec *kikai_speccache_load_module(GVariant *module_v);
@@ -0,0 +1,207 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kikai-install.h"
+#include "kikai-store.h"
+#include "kikai-utils.h"
+
+static GFile *kikai_store = NULL;
+
+gboolean kikai_store_init(const gchar *path) {
+  // Like the artifact cache, the environment takes priority over kikai.yml.
+  const gchar *override = g_getenv("KIKAI_STORE");
+  if (override != NULL && *override != '\0') {
+    path = override;
+  }
+
+  g_clear_object(&kikai_store);
+  if (path == NULL) {
+    return TRUE;
+  }
+
+  kikai_store = g_file_new_for_path(path);
+  return kikai_mkdir_parents(kikai_store);
+}
+
+gboolean kikai_store_enabled() {
+  return kikai_store != NULL;
+}
+
+static GFile *get_entry(const gchar *key) {
+  g_autofree gchar *prefix = g_strndup(key, 2);
+  return kikai_join(kikai_store, prefix, key, NULL);
+}
+
+GFile *kikai_store_lookup(const gchar *key, const gchar *relocatable_key,
+                          gchar **found_key) {
+  const gchar *keys[] = {relocatable_key, key};
+  for (int i = 0; i < G_N_ELEMENTS(keys); i++) {
+    GFile *entry = get_entry(keys[i]);
+    if (g_file_query_exists(entry, NULL)) {
+      *found_key = g_strdup(keys[i]);
+      return entry;
+    }
+
+    g_object_unref(entry);
+  }
+
+  return NULL;
+}
+
+typedef struct {
+  const gchar *prefix;
+  guint files;
+  gboolean mentions_prefix;
+} ScanData;
+
+// Binaries can hold NUL bytes, so strstr won't do.
+static gboolean contains(const gchar *data, gsize size, const gchar *needle) {
+  gsize needle_size = strlen(needle);
+  for (const gchar *p = data; size >= needle_size;) {
+    const gchar *match = memchr(p, needle[0], size - needle_size + 1);
+    if (match == NULL) {
+      return FALSE;
+    } else if (memcmp(match, needle, needle_size) == 0) {
+      return TRUE;
+    }
+
+    size -= match + 1 - p;
+    p = match + 1;
+  }
+
+  return FALSE;
+}
+
+static gboolean scan_file(const gchar *relative, const gchar *path, struct stat *st,
+                          gpointer user_data) {
+  ScanData *scan = user_data;
+  scan->files++;
+  if (scan->mentions_prefix) {
+    return TRUE;
+  }
+
+  if (S_ISLNK(st->st_mode)) {
+    g_autofree gchar *target = g_file_read_link(path, NULL);
+    scan->mentions_prefix = target == NULL || strstr(target, scan->prefix) != NULL;
+  } else if (S_ISREG(st->st_mode) && st->st_size != 0) {
+    g_autoptr(GError) error = NULL;
+    GMappedFile *mapped = g_mapped_file_new(path, FALSE, &error);
+    if (mapped == NULL) {
+      g_printerr("Failed to read %s: %s", path, error->message);
+      return FALSE;
+    }
+
+    scan->mentions_prefix = contains(g_mapped_file_get_contents(mapped),
+                                     g_mapped_file_get_length(mapped), scan->prefix);
+    g_mapped_file_unref(mapped);
+  }
+
+  return TRUE;
+}
+
+static gboolean copy_file(const gchar *relative, const gchar *path, struct stat *st,
+                          gpointer user_data) {
+  g_autoptr(GFile) target = g_file_resolve_relative_path(user_data, relative);
+  g_autoptr(GFile) parent = g_file_get_parent(target);
+  g_autofree gchar *target_path = g_file_get_path(target);
+  return kikai_mkdir_parents(parent) && kikai_install_link(path, st, target_path);
+}
+
+// Entries are hard linked into every prefix using them, so writing to one of those files
+// in place would change it for all of them.
+static gboolean make_read_only(const gchar *relative, const gchar *path, struct stat *st,
+                               gpointer user_data) {
+  if (S_ISREG(st->st_mode) && g_chmod(path, st->st_mode & 07555) == -1) {
+    g_printerr("Failed to make %s read-only: %s", path, strerror(errno));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+// Puts the tree in place at once, so no other project ever sees a partial entry.
+static gboolean move_tree(GFile *staged, GFile *entry) {
+  g_autofree gchar *staged_path = g_file_get_path(staged);
+  g_autofree gchar *entry_path = g_file_get_path(entry);
+  if (!kikai_tree_walk(staged_path, make_read_only, NULL)) {
+    return FALSE;
+  }
+
+  if (g_rename(staged_path, entry_path) == 0) {
+    return TRUE;
+  } else if (errno == ENOTEMPTY || errno == EEXIST) {
+    // Another project stored the same tree first.
+    return TRUE;
+  } else if (errno != EXDEV) {
+    g_printerr("Failed to move %s into the store: %s", staged_path, strerror(errno));
+    return FALSE;
+  }
+
+  g_autofree gchar *tmp_path = g_strdup_printf("%s.kikai-tmp.%d", entry_path, getpid());
+  g_autoptr(GFile) tmp = g_file_new_for_path(tmp_path);
+  if (!kikai_rmtree(tmp) || !kikai_tree_walk(staged_path, copy_file, tmp)) {
+    return FALSE;
+  }
+
+  if (g_rename(tmp_path, entry_path) == -1) {
+    if (errno != ENOTEMPTY && errno != EEXIST) {
+      g_printerr("Failed to add %s to the store: %s", entry_path, strerror(errno));
+      return FALSE;
+    }
+
+    return kikai_rmtree(tmp);
+  }
+
+  return TRUE;
+}
+
+gboolean kikai_store_add(const gchar *key, const gchar *relocatable_key, GFile *staged,
+                         GFile *prefix, GFile **entry, gchar **stored_key) {
+  *entry = NULL;
+  g_autofree gchar *staged_path = g_file_get_path(staged);
+  g_autofree gchar *prefix_path = g_file_get_path(prefix);
+
+  // pkg-config files, libtool archives and rpaths all tend to embed the prefix, and
+  // such trees are only shared by projects whose install root is in the same place.
+  ScanData scan = {.prefix = prefix_path};
+  if (!kikai_tree_walk(staged_path, scan_file, &scan)) {
+    return FALSE;
+  } else if (scan.files == 0) {
+    return TRUE;
+  }
+
+  const gchar *chosen = scan.mentions_prefix ? key : relocatable_key;
+  g_autoptr(GFile) target = get_entry(chosen);
+  g_autoptr(GFile) parent = g_file_get_parent(target);
+  if (!kikai_mkdir_parents(parent) ||
+      (!g_file_query_exists(target, NULL) && !move_tree(staged, target))) {
+    return FALSE;
+  }
+
+  *entry = g_steal_pointer(&target);
+  *stored_key = g_strdup(chosen);
+  return TRUE;
+}
+
+gboolean kikai_store_is_merged(const gchar *module_id, const gchar *platform,
+                               const gchar *key) {
+  g_autofree gchar *db_key = g_strjoin("::", "store", module_id, platform, NULL);
+  g_autofree gchar *current = kikai_db_get(db_key);
+  if (current == &kikai_db_missing) {
+    g_steal_pointer(&current);
+    return FALSE;
+  }
+
+  return current != NULL && strcmp(current, key) == 0;
+}
+
+gboolean kikai_store_set_merged(const gchar *module_id, const gchar *platform,
+                                const gchar *key) {
+  g_autofree gchar *db_key = g_strjoin("::", "store", module_id, platform, NULL);
+  return kikai_db_set(db_key, key);
+}
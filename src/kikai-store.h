@@ -0,0 +1,26 @@
+#pragma once
+
+#include <glib.h>
+#include <gio/gio.h>
+
+// The store keeps installed module trees machine-wide, keyed by their artifact key, and
+// install roots are assembled from links into it, so identical builds from several
+// projects are only kept once.
+gboolean kikai_store_init(const gchar *path);
+gboolean kikai_store_enabled();
+
+// Finds a module's stored tree, preferring one stored under relocatable_key, the key
+// computed without the prefix. found_key is set to the key it was stored under.
+GFile *kikai_store_lookup(const gchar *key, const gchar *relocatable_key,
+                          gchar **found_key);
+// Moves a staged tree into the store, under relocatable_key when none of its files
+// mention the prefix and so can be shared whatever the install root. entry is left NULL
+// when nothing was staged.
+gboolean kikai_store_add(const gchar *key, const gchar *relocatable_key, GFile *staged,
+                         GFile *prefix, GFile **entry, gchar **stored_key);
+
+// Whether a module's install prefix was last merged from the given store entry.
+gboolean kikai_store_is_merged(const gchar *module_id, const gchar *platform,
+                               const gchar *key);
+gboolean kikai_store_set_merged(const gchar *module_id, const gchar *platform,
+                                const gchar *key);
@@ -0,0 +1,318 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include <elf.h>
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kikai-install.h"
+#include "kikai-strip.h"
+#include "kikai-utils.h"
+
+// Where debug files go, relative to the install prefix, which is also where debuggers
+// look for them by build ID.
+#define DEBUG_DIR "lib/debug"
+
+typedef struct {
+  const gchar *objcopy, *strip, *toolchain_hash;
+  GFile *cache, *staged;
+  GMutex lock;
+  gboolean success;
+  // Makes temporary names unique between threads.
+  gint counter;
+} StripRun;
+
+typedef struct {
+  gchar *relative, *path;
+} StripFile;
+
+static void strip_file_free(gpointer data) {
+  StripFile *file = data;
+  g_free(file->relative);
+  g_free(file->path);
+  g_free(file);
+}
+
+static gboolean is_strippable(const gchar *path) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    return FALSE;
+  }
+
+  // Relocatable objects are left alone, since stripping them breaks linking.
+  guchar ident[EI_NIDENT + 2];
+  gboolean elf = fread(ident, 1, sizeof(ident), fp) == sizeof(ident) &&
+                 memcmp(ident, ELFMAG, SELFMAG) == 0;
+  fclose(fp);
+  if (!elf) {
+    return FALSE;
+  }
+
+  const guchar *e_type = ident + EI_NIDENT;
+  guint16 type = ident[EI_DATA] == ELFDATA2MSB ? e_type[0] << 8 | e_type[1]
+                 : e_type[1] << 8 | e_type[0];
+  return type == ET_EXEC || type == ET_DYN;
+}
+
+static gboolean collect_file(const gchar *relative, const gchar *path, struct stat *st,
+                             gpointer user_data) {
+  GPtrArray *files = user_data;
+  if (!S_ISREG(st->st_mode) || g_str_has_prefix(relative, DEBUG_DIR "/") ||
+      !is_strippable(path)) {
+    return TRUE;
+  }
+
+  StripFile *file = g_new0(StripFile, 1);
+  file->relative = g_strdup(relative);
+  file->path = g_strdup(path);
+  g_ptr_array_add(files, file);
+  return TRUE;
+}
+
+static guint64 read_word(const guchar *data, gboolean is64) {
+  if (is64) {
+    guint64 value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+  }
+
+  guint32 value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+// Reads the GNU build ID out of the note segments. Only ELF files in the host's byte
+// order are understood, which covers every Android target on the usual build hosts.
+static gchar *get_build_id(const guchar *data, gsize size) {
+  if (size < sizeof(Elf64_Ehdr) ||
+      data[EI_DATA] != (G_BYTE_ORDER == G_LITTLE_ENDIAN ? ELFDATA2LSB : ELFDATA2MSB)) {
+    return NULL;
+  }
+
+  gboolean is64 = data[EI_CLASS] == ELFCLASS64;
+  guint64 phoff = read_word(data + (is64 ? offsetof(Elf64_Ehdr, e_phoff)
+                                    : offsetof(Elf32_Ehdr, e_phoff)), is64);
+  guint16 phentsize, phnum;
+  memcpy(&phentsize, data + (is64 ? offsetof(Elf64_Ehdr, e_phentsize)
+                             : offsetof(Elf32_Ehdr, e_phentsize)), sizeof(phentsize));
+  memcpy(&phnum, data + (is64 ? offsetof(Elf64_Ehdr, e_phnum)
+                         : offsetof(Elf32_Ehdr, e_phnum)), sizeof(phnum));
+
+  for (guint16 i = 0; i < phnum; i++) {
+    guint64 header = phoff + (guint64)i * phentsize;
+    if (header + phentsize > size) {
+      break;
+    }
+
+    guint32 type;
+    memcpy(&type, data + header, sizeof(type));
+    if (type != PT_NOTE) {
+      continue;
+    }
+
+    guint64 offset = read_word(data + header + (is64 ? offsetof(Elf64_Phdr, p_offset)
+                                                : offsetof(Elf32_Phdr, p_offset)), is64);
+    guint64 filesz = read_word(data + header + (is64 ? offsetof(Elf64_Phdr, p_filesz)
+                                                : offsetof(Elf32_Phdr, p_filesz)), is64);
+    guint64 align = read_word(data + header + (is64 ? offsetof(Elf64_Phdr, p_align)
+                                               : offsetof(Elf32_Phdr, p_align)), is64);
+    align = align == 8 ? 8 : 4;
+    if (offset > size || filesz > size - offset) {
+      continue;
+    }
+
+    const guchar *note = data + offset, *end = note + filesz;
+    while (note + sizeof(Elf32_Nhdr) <= end) {
+      Elf32_Nhdr nhdr;
+      memcpy(&nhdr, note, sizeof(nhdr));
+      const guchar *name = note + sizeof(nhdr);
+      const guchar *desc = name + ((nhdr.n_namesz + align - 1) & ~(align - 1));
+      note = desc + ((nhdr.n_descsz + align - 1) & ~(align - 1));
+      if (note > end) {
+        break;
+      }
+
+      if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == sizeof(ELF_NOTE_GNU) &&
+          memcmp(name, ELF_NOTE_GNU, sizeof(ELF_NOTE_GNU)) == 0 && nhdr.n_descsz > 1) {
+        GString *id = g_string_new(NULL);
+        for (guint32 j = 0; j < nhdr.n_descsz; j++) {
+          g_string_append_printf(id, "%02x", desc[j]);
+        }
+        return g_string_free(id, FALSE);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+static gboolean run_tool(gchar **args) {
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *messages = NULL;
+  gint status;
+  if (!g_spawn_sync(NULL, args, NULL, G_SPAWN_STDOUT_TO_DEV_NULL, NULL, NULL, NULL,
+                    &messages, &status, &error) ||
+      !g_spawn_check_exit_status(status, &error)) {
+    g_printerr("%s failed on %s: %s\n%s", args[0], args[g_strv_length(args) - 1],
+               error->message, messages != NULL ? messages : "");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+// Puts a cached file at target, replacing whatever was there.
+static gboolean link_from_cache(StripRun *run, const gchar *cached, const gchar *target) {
+  struct stat st;
+  if (lstat(cached, &st) == -1) {
+    g_printerr("Failed to stat %s: %s", cached, strerror(errno));
+    return FALSE;
+  }
+
+  g_autofree gchar *parent = g_path_get_dirname(target);
+  // Copies of a file share a build ID, and so the debug file's target too.
+  g_autofree gchar *tmp = g_strdup_printf("%s.kikai-tmp.%d.%d", target, getpid(),
+                                          g_atomic_int_add(&run->counter, 1));
+  g_unlink(tmp);
+  if (g_mkdir_with_parents(parent, 0755) == -1 || !kikai_install_link(cached, &st, tmp)) {
+    return FALSE;
+  } else if (g_rename(tmp, target) == -1) {
+    g_printerr("Failed to replace %s: %s", target, strerror(errno));
+    g_unlink(tmp);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean strip_one(StripRun *run, StripFile *file) {
+  g_autoptr(GError) error = NULL;
+  GMappedFile *mapped = g_mapped_file_new(file->path, FALSE, &error);
+  if (mapped == NULL) {
+    g_printerr("Failed to read %s: %s", file->path, error->message);
+    return FALSE;
+  }
+
+  const guchar *data = (const guchar *)g_mapped_file_get_contents(mapped);
+  gsize size = g_mapped_file_get_length(mapped);
+  g_autofree gchar *content_hash = g_compute_checksum_for_data(G_CHECKSUM_SHA256, data,
+                                                               size);
+  g_autofree gchar *build_id = get_build_id(data, size);
+  g_mapped_file_unref(mapped);
+
+  // The tools come with the toolchain, so its hash covers their version too.
+  g_autofree gchar *key = kikai_hash_bytes(content_hash, -1, run->toolchain_hash, -1,
+                                           NULL);
+  g_autofree gchar *prefix = g_strndup(key, 2);
+  g_autoptr(GFile) dir = g_file_get_child(run->cache, prefix);
+  g_autofree gchar *dir_path = g_file_get_path(dir);
+  g_autofree gchar *stripped = g_build_filename(dir_path, key, NULL);
+  g_autofree gchar *debug = g_strconcat(stripped, ".debug", NULL);
+
+  // The debug file is moved into the cache first, so a stripped file there always has
+  // its debug file next to it.
+  if (!g_file_test(stripped, G_FILE_TEST_IS_REGULAR)) {
+    gint n = g_atomic_int_add(&run->counter, 1);
+    g_autofree gchar *stripped_tmp = g_strdup_printf("%s.kikai-tmp.%d.%d", stripped,
+                                                     getpid(), n);
+    g_autofree gchar *debug_tmp = g_strdup_printf("%s.kikai-tmp.%d.%d", debug, getpid(),
+                                                  n);
+    gchar *debug_args[] = {(gchar *)run->objcopy, "--only-keep-debug", file->path,
+                           debug_tmp, NULL};
+    gchar *strip_args[] = {(gchar *)run->strip, "--strip-unneeded", "-o", stripped_tmp,
+                           file->path, NULL};
+
+    gboolean success = kikai_mkdir_parents(dir) && run_tool(debug_args) &&
+                       run_tool(strip_args);
+    if (success && (g_rename(debug_tmp, debug) == -1 ||
+                    g_rename(stripped_tmp, stripped) == -1)) {
+      g_printerr("Failed to cache stripped %s: %s", file->path, strerror(errno));
+      success = FALSE;
+    }
+
+    g_unlink(debug_tmp);
+    g_unlink(stripped_tmp);
+    if (!success) {
+      return FALSE;
+    }
+  }
+
+  // Files without a build ID get their debug info next to where the file itself would
+  // be under lib/debug.
+  g_autofree gchar *debug_relative = NULL;
+  if (build_id != NULL) {
+    debug_relative = g_strdup_printf(DEBUG_DIR "/.build-id/%.2s/%s.debug", build_id,
+                                     build_id + 2);
+  } else {
+    debug_relative = g_strconcat(DEBUG_DIR "/", file->relative, ".debug", NULL);
+  }
+
+  g_autofree gchar *staged_path = g_file_get_path(run->staged);
+  g_autofree gchar *debug_target = g_build_filename(staged_path, debug_relative, NULL);
+  return link_from_cache(run, debug, debug_target) &&
+         link_from_cache(run, stripped, file->path);
+}
+
+static void strip_worker(gpointer data, gpointer user_data) {
+  StripRun *run = user_data;
+  StripFile *file = data;
+
+  if (!strip_one(run, file)) {
+    g_mutex_lock(&run->lock);
+    run->success = FALSE;
+    g_mutex_unlock(&run->lock);
+  }
+}
+
+gboolean kikai_strip_tree(GFile *storage, KikaiToolchain *toolchain, GFile *staged,
+                          guint jobs) {
+  g_autofree gchar *objcopy = g_build_filename(toolchain->path, "bin", "llvm-objcopy",
+                                               NULL);
+  g_autofree gchar *strip = g_build_filename(toolchain->path, "bin", "llvm-strip", NULL);
+  if (!g_file_test(objcopy, G_FILE_TEST_IS_EXECUTABLE) ||
+      !g_file_test(strip, G_FILE_TEST_IS_EXECUTABLE)) {
+    g_printerr("llvm-objcopy and llvm-strip are required in %s/bin.", toolchain->path);
+    return FALSE;
+  }
+
+  g_autoptr(GPtrArray) files = g_ptr_array_new_with_free_func(strip_file_free);
+  g_autofree gchar *staged_path = g_file_get_path(staged);
+  if (!kikai_tree_walk(staged_path, collect_file, files)) {
+    return FALSE;
+  } else if (files->len == 0) {
+    return TRUE;
+  }
+
+  kikai_printstatus("build", "  - strip");
+
+  g_autoptr(GFile) cache = g_file_get_child(storage, "strip");
+  StripRun run = {
+    .objcopy = objcopy,
+    .strip = strip,
+    .toolchain_hash = toolchain->hash,
+    .cache = cache,
+    .staged = staged,
+    .success = TRUE,
+  };
+  g_mutex_init(&run.lock);
+
+  g_autoptr(GError) error = NULL;
+  GThreadPool *pool = g_thread_pool_new(strip_worker, &run, MAX(jobs, 1), FALSE, &error);
+  if (pool == NULL) {
+    g_printerr("Failed to start strip threads: %s", error->message);
+    g_mutex_clear(&run.lock);
+    return FALSE;
+  }
+
+  for (int i = 0; i < files->len; i++) {
+    g_thread_pool_push(pool, files->pdata[i], NULL);
+  }
+
+  // Waits for every file to be done.
+  g_thread_pool_free(pool, FALSE, TRUE);
+  g_mutex_clear(&run.lock);
+  return run.success;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "kikai-toolchain.h"
+
+// Strips every ELF executable and shared library under staged, up to jobs at a time,
+// moving their debug info to lib/debug/.build-id. Files that were stripped before, going
+// by their content, are taken from a cache in storage instead.
+gboolean kikai_strip_tree(GFile *storage, KikaiToolchain *toolchain, GFile *staged,
+                          guint jobs);
@@ -0,0 +1,157 @@
+#include <glib.h>
+#include <gio/gio.h>
+
+#include <stdlib.h>
+#include <sys/statvfs.h>
+
+#include "kikai-tmpfs.h"
+#include "kikai-utils.h"
+
+// Below this much free space, a failed build is assumed to have run out of room.
+#define TMPFS_RESERVE (16 * 1024 * 1024ull)
+// A module that was never built is assumed to take this share of the budget.
+#define TMPFS_UNRECORDED_SHARE 4
+
+static const KikaiTmpfsSpec *tmpfs_spec = NULL;
+static GFile *tmpfs_root = NULL;
+// What the modules being built in RAM right now were expected to take between them.
+static GMutex tmpfs_lock;
+static guint64 tmpfs_claimed = 0;
+
+static void tmpfs_cleanup() {
+  if (tmpfs_root != NULL) {
+    kikai_rmtree(tmpfs_root);
+  }
+}
+
+gboolean kikai_tmpfs_init(GFile *storage, const KikaiTmpfsSpec *spec) {
+  if (spec->budget == 0 || tmpfs_root != NULL) {
+    return TRUE;
+  }
+
+  // Each checkout gets its own directory, so several can share the same tmpfs.
+  g_autofree gchar *storage_path = g_file_get_path(storage);
+  g_autofree gchar *id = kikai_hash_bytes(storage_path, -1, NULL);
+  g_autofree gchar *name = g_strdup_printf("kikai-%.12s", id);
+
+  tmpfs_spec = spec;
+  tmpfs_root = kikai_join(g_file_new_for_path(spec->path), name, NULL);
+
+  // Anything left over is from an interrupted run, and only takes up memory.
+  if (!kikai_rmtree(tmpfs_root) || !kikai_mkdir_parents(tmpfs_root)) {
+    return FALSE;
+  }
+
+  atexit(tmpfs_cleanup);
+  return TRUE;
+}
+
+GFile *kikai_tmpfs_get_root() {
+  return tmpfs_root;
+}
+
+gboolean kikai_tmpfs_keep_sources() {
+  return tmpfs_root != NULL && tmpfs_spec->sources;
+}
+
+GFile *kikai_tmpfs_get_dir(const gchar *module_id) {
+  return g_file_get_child(tmpfs_root, module_id);
+}
+
+gboolean kikai_tmpfs_clear(const gchar *module_id, guint64 claimed) {
+  if (tmpfs_root == NULL) {
+    return TRUE;
+  }
+
+  g_mutex_lock(&tmpfs_lock);
+  tmpfs_claimed -= claimed;
+  g_mutex_unlock(&tmpfs_lock);
+
+  g_autoptr(GFile) dir = kikai_tmpfs_get_dir(module_id);
+  return kikai_rmtree(dir);
+}
+
+static guint64 get_available() {
+  g_autofree gchar *path = g_file_get_path(tmpfs_root);
+  struct statvfs st;
+  if (statvfs(path, &st) == -1) {
+    return 0;
+  }
+
+  return (guint64)st.f_bavail * st.f_frsize;
+}
+
+// Reads what a module took the last time, or an estimate if it was never recorded.
+static gboolean get_recorded(const gchar *module_id, guint64 *used) {
+  g_autofree gchar *key = g_strjoin("::", "tmpfs", module_id, NULL);
+  g_autofree gchar *value = kikai_db_get(key);
+  if (value == NULL) {
+    return FALSE;
+  }
+
+  if (value == &kikai_db_missing) {
+    g_steal_pointer(&value);
+    *used = tmpfs_spec->budget / TMPFS_UNRECORDED_SHARE;
+  } else {
+    *used = g_ascii_strtoull(value, NULL, 10);
+  }
+
+  return TRUE;
+}
+
+gboolean kikai_tmpfs_claim(const gchar *module_id, guint64 *claimed) {
+  *claimed = 0;
+  guint64 used;
+  if (tmpfs_root == NULL || !get_recorded(module_id, &used)) {
+    return FALSE;
+  }
+
+  // An estimate can still be too low, so a module may spill to disk after all.
+  g_mutex_lock(&tmpfs_lock);
+  gboolean fits = tmpfs_claimed < tmpfs_spec->budget &&
+                  tmpfs_claimed + used <= tmpfs_spec->budget &&
+                  used + TMPFS_RESERVE <= get_available();
+  if (fits) {
+    tmpfs_claimed += used;
+    *claimed = used;
+  }
+  g_mutex_unlock(&tmpfs_lock);
+
+  return fits;
+}
+
+guint64 kikai_tmpfs_get_recorded(const gchar *module_id) {
+  guint64 used = 0;
+  if (tmpfs_root == NULL || !get_recorded(module_id, &used)) {
+    return 0;
+  }
+
+  return used;
+}
+
+gboolean kikai_tmpfs_exhausted(guint64 used) {
+  return used > tmpfs_spec->budget || get_available() < TMPFS_RESERVE;
+}
+
+gboolean kikai_tmpfs_record(const gchar *module_id, guint64 used) {
+  if (tmpfs_root == NULL) {
+    return TRUE;
+  }
+
+  g_autofree gchar *key = g_strjoin("::", "tmpfs", module_id, NULL);
+  g_autofree gchar *value = g_strdup_printf("%" G_GUINT64_FORMAT, used);
+  return kikai_db_set(key, value);
+}
+
+static gboolean add_usage(const gchar *relative, const gchar *path, struct stat *st,
+                          gpointer user_data) {
+  *(guint64 *)user_data += (guint64)st->st_blocks * 512;
+  return TRUE;
+}
+
+guint64 kikai_tmpfs_usage(GFile *dir) {
+  guint64 used = 0;
+  g_autofree gchar *path = g_file_get_path(dir);
+  kikai_tree_walk(path, add_usage, &used);
+  return used;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "kikai-builderspec.h"
+
+gboolean kikai_tmpfs_init(GFile *storage, const KikaiTmpfsSpec *spec);
+// Where RAM-backed directories go, or NULL when they're disabled.
+GFile *kikai_tmpfs_get_root();
+gboolean kikai_tmpfs_keep_sources();
+// A module's own RAM-backed directory, so modules built at the same time stay apart.
+GFile *kikai_tmpfs_get_dir(const gchar *module_id);
+// Empties a module's RAM-backed directory once it no longer needs it, handing back the
+// space kikai_tmpfs_claim set aside.
+gboolean kikai_tmpfs_clear(const gchar *module_id, guint64 claimed);
+
+// Sets aside room in RAM for a module's build directories, going by how much they took
+// the last time the module was built or by an estimate, and returns whether there was
+// enough of it.
+gboolean kikai_tmpfs_claim(const gchar *module_id, guint64 *claimed);
+// How much a module's build directories took in RAM the last time, or the estimate used
+// for modules that never were built in RAM.
+guint64 kikai_tmpfs_get_recorded(const gchar *module_id);
+// Whether a module that used the given amount of space ran out of room.
+gboolean kikai_tmpfs_exhausted(guint64 used);
+gboolean kikai_tmpfs_record(const gchar *module_id, guint64 used);
+
+guint64 kikai_tmpfs_usage(GFile *dir);
@@ -3,8 +3,12 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
+#include "kikai-dedup.h"
+#include "kikai-spawn.h"
 #include "kikai-toolchain.h"
+#include "kikai-trace.h"
 #include "kikai-utils.h"
 
 #ifdef __x86_64__
@@ -30,8 +34,31 @@ static gchar *find_ndk() {
   return NULL;
 }
 
-static gboolean needs_update(gchar *current_hash) {
-  g_autofree gchar *old_hash = kikai_db_get("toolchain");
+// Identifies the NDK by the revision it declares, or by its path when it declares none.
+static gchar *get_ndk_revision(const gchar *ndk_path) {
+  g_autofree gchar *path = g_build_filename(ndk_path, "source.properties", NULL);
+  g_autofree gchar *contents = NULL;
+  if (g_file_get_contents(path, &contents, NULL, NULL)) {
+    g_auto(GStrv) lines = g_strsplit(contents, "\n", -1);
+    for (gchar **line = lines; *line; line++) {
+      gchar *eq = strchr(*line, '=');
+      if (eq == NULL) {
+        continue;
+      }
+
+      *eq = '\0';
+      if (strcmp(g_strstrip(*line), "Pkg.Revision") == 0) {
+        return g_strdup(g_strstrip(eq + 1));
+      }
+    }
+  }
+
+  return g_strdup(ndk_path);
+}
+
+static gboolean needs_update(const gchar *platform, const gchar *current_hash) {
+  g_autofree gchar *key = g_strjoin("::", "toolchain", platform, NULL);
+  g_autofree gchar *old_hash = kikai_db_get(key);
   if (old_hash == NULL || old_hash == &kikai_db_missing) {
     g_steal_pointer(&old_hash);
     return TRUE;
@@ -39,6 +66,121 @@ static gboolean needs_update(gchar *current_hash) {
   return strcmp(current_hash, old_hash) != 0;
 }
 
+typedef struct {
+  const gchar *platform, *hash, *script, *api, *stl, *after;
+  GFile *target, *manifest, *logs;
+  gboolean success;
+} ToolchainJob;
+
+static gboolean add_to_manifest(const gchar *relative, const gchar *path, struct stat *st,
+                                gpointer user_data) {
+  g_string_append_printf(user_data, "%" G_GUINT64_FORMAT " %s\n", (guint64)st->st_size,
+                         relative);
+  return TRUE;
+}
+
+static gboolean write_manifest(GFile *target, GFile *manifest) {
+  g_autoptr(GString) contents = g_string_new(NULL);
+  if (!kikai_tree_walk(g_file_get_path(target), add_to_manifest, contents)) {
+    return FALSE;
+  }
+
+  g_autoptr(GError) error = NULL;
+  if (!g_file_replace_contents(manifest, contents->str, contents->len, NULL, FALSE,
+                               G_FILE_CREATE_NONE, NULL, NULL, &error)) {
+    g_printerr("Failed to write toolchain manifest: %s", error->message);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+// Checks that every file recorded when the toolchain was created is still there with the
+// same size, which catches deleted or truncated toolchains without regenerating them.
+static gboolean validate_manifest(GFile *target, GFile *manifest) {
+  g_autofree gchar *contents = NULL;
+  if (!g_file_load_contents(manifest, NULL, &contents, NULL, NULL, NULL)) {
+    return FALSE;
+  }
+
+  g_autofree gchar *root = g_file_get_path(target);
+  g_auto(GStrv) lines = g_strsplit(contents, "\n", -1);
+
+  for (gchar **line = lines; *line && **line; line++) {
+    gchar *relative = NULL;
+    guint64 size = g_ascii_strtoull(*line, &relative, 10);
+    if (relative == NULL || *relative != ' ') {
+      return FALSE;
+    }
+
+    g_autofree gchar *path = g_build_filename(root, relative + 1, NULL);
+    struct stat st;
+    if (lstat(path, &st) == -1 || st.st_size != size) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+static gpointer create_toolchain(gpointer user_data) {
+  ToolchainJob *job = user_data;
+  g_autoptr(GError) error = NULL;
+  gint64 start = kikai_trace_now();
+
+  g_file_delete(job->manifest, NULL, NULL);
+
+  g_autofree gchar *create_name = g_strconcat(job->platform, ".log.gz", NULL);
+  g_autoptr(GFile) create_log = g_file_get_child(job->logs, create_name);
+  gchar *create_args[] = {(gchar*)job->script, "--arch", (gchar*)job->platform,
+                          "--api", (gchar*)job->api, "--stl", (gchar*)job->stl, "--force",
+                          "--install-dir", g_file_get_path(job->target), NULL};
+  if (!kikai_spawn("make_standalone_toolchain.py", NULL, create_args, NULL,
+                   G_SPAWN_DEFAULT, create_log, &error)) {
+    g_printerr("make_standalone_toolchain for %s failed: %s", job->platform,
+               error->message);
+    return NULL;
+  }
+
+  if (job->after != NULL) {
+    g_autofree gchar *after_name = g_strconcat(job->platform, "-after.log.gz", NULL);
+    g_autoptr(GFile) after_log = g_file_get_child(job->logs, after_name);
+    gchar *args[] = {"/bin/sh", "-ec", (gchar*)job->after, NULL};
+    if (!kikai_spawn("toolchain.after", job->target, args, NULL, G_SPAWN_DEFAULT,
+                     after_log, &error)) {
+      g_printerr("toolchain.after for %s failed: %s", job->platform, error->message);
+      return NULL;
+    }
+  }
+
+  job->success = write_manifest(job->target, job->manifest);
+  kikai_trace_span("toolchain", job->platform, start);
+  return NULL;
+}
+
+// Standalone toolchains are mostly copies of the same NDK files, so they're linked back
+// to the NDK and to each other once created.
+static gboolean dedup_toolchains(GFile *ndk_file, GArray *toolchains) {
+  const gchar *ndk_dirs[] = {"toolchains/llvm/prebuilt/linux-"ARCH, "sysroot",
+                             "platforms", "sources/cxx-stl", NULL};
+
+  g_autoptr(GPtrArray) roots = g_ptr_array_new_with_free_func(g_free);
+  for (const gchar **dir = ndk_dirs; *dir; dir++) {
+    g_autoptr(GFile) root = g_file_resolve_relative_path(ndk_file, *dir);
+    if (g_file_query_exists(root, NULL)) {
+      g_ptr_array_add(roots, g_file_get_path(root));
+    }
+  }
+
+  guint reference = roots->len;
+  for (int i = 0; i < toolchains->len; i++) {
+    g_ptr_array_add(roots, g_strdup(g_array_index(toolchains, KikaiToolchain, i).path));
+  }
+  g_ptr_array_add(roots, NULL);
+
+  return kikai_dedup_trees((gchar **)roots->pdata, reference);
+}
+
 gboolean kikai_toolchain_create(GFile *storage, GArray *toolchains,
                                 const KikaiToolchainSpec *spec) {
   gchar *ndk_path = find_ndk();
@@ -47,6 +189,7 @@ gboolean kikai_toolchain_create(GFile *storage, GArray *toolchains,
   }
 
   g_autoptr(GFile) ndk_file = g_file_new_for_path(ndk_path);
+  g_autofree gchar *revision = get_ndk_revision(ndk_path);
 
   g_autoptr(GFile) make_standalone_toolchain = kikai_join(ndk_file, "build", "tools",
                                                           "make_standalone_toolchain.py", NULL);
@@ -59,10 +202,12 @@ gboolean kikai_toolchain_create(GFile *storage, GArray *toolchains,
   const gchar *platform_names[] = {"armv7a", "arm64", "x86", "x86_64"};
   const gchar *platform_triples[] = {"armv7a-linux-androideabi", "aarch64-linux-android",
                                      "i686-linux-android", "x86_64-linux-android"};
+  const gchar *platform_abis[] = {"armeabi-v7a", "arm64-v8a", "x86", "x86_64"};
+  const gchar *platform_cpu_families[] = {"arm", "aarch64", "x86", "x86_64"};
 
-  for (int i = 0; i < spec->platforms->len; i++) {
-    g_autoptr(GError) error = NULL;
+  g_autoptr(GArray) jobs = g_array_new(FALSE, FALSE, sizeof(ToolchainJob));
 
+  for (int i = 0; i < spec->platforms->len; i++) {
     KikaiToolchainPlatform platform = g_array_index(spec->platforms,
                                                     KikaiToolchainPlatform, i);
     const gchar *platform_name = platform_names[platform];
@@ -85,6 +230,7 @@ gboolean kikai_toolchain_create(GFile *storage, GArray *toolchains,
     KikaiToolchain toolchain;
     toolchain.standalone = spec->standalone;
     toolchain.platform = g_strdup(platform_name);
+    toolchain.api = g_strdup(spec->api);
 
     toolchain.path = g_strdup(g_file_get_path(target));
 
@@ -95,6 +241,16 @@ gboolean kikai_toolchain_create(GFile *storage, GArray *toolchains,
     toolchain.cxx = g_build_filename(g_file_get_path(target), "bin", cxx, NULL);
 
     toolchain.triple = g_strdup(triple);
+    toolchain.ndk = ndk_path;
+    toolchain.stl = spec->stl;
+    toolchain.abi = platform_abis[platform];
+    toolchain.cpu_family = platform_cpu_families[platform];
+    toolchain.id = kikai_hash_bytes(platform_name, -1, "", 1, revision, -1, "", 1,
+                                    spec->api, -1, "", 1, spec->stl, -1, "", 1,
+                                    spec->standalone ? "standalone" : "", -1, "", 1,
+                                    spec->after != NULL ? spec->after : "", -1, NULL);
+    toolchain.hash = kikai_hash_bytes(toolchain.id, -1, toolchain.cc, -1,
+                                      toolchain.cxx, -1, NULL);
 
     g_array_append_val(toolchains, toolchain);
 
@@ -102,50 +258,57 @@ gboolean kikai_toolchain_create(GFile *storage, GArray *toolchains,
       continue;
     }
 
-    g_autofree gchar *current_hash = kikai_hash_bytes(spec->api, -1, spec->stl, -1,
-                                                      spec->after, -1, NULL);
+    g_autofree gchar *manifest_name = g_strconcat(platform_name, ".manifest", NULL);
+    g_autoptr(GFile) manifest = kikai_join(storage, "toolchains", manifest_name, NULL);
 
-    if (!needs_update(current_hash)) {
+    if (!needs_update(platform_name, toolchain.hash) &&
+        validate_manifest(target, manifest)) {
       continue;
     }
 
-    kikai_printstatus("toolchain", "Creating %s toolchain (this may take a while)...",
-                      platform_name);
-
-    g_autoptr(GSubprocess) sp = g_subprocess_new(G_SUBPROCESS_FLAGS_NONE, &error,
-                                      g_file_get_path(make_standalone_toolchain),
-                                      "--arch", (gchar*)platform_name,
-                                      "--api", spec->api, "--stl", spec->stl, "--force",
-                                      "--install-dir", g_file_get_path(target), NULL);
-    if (sp == NULL) {
-      g_printerr("Failed to spawn make_standalone_toolchain.py: %s", error->message);
-      return FALSE;
-    }
+    ToolchainJob job = {
+      .platform = platform_name,
+      .hash = toolchain.hash,
+      .script = g_file_get_path(make_standalone_toolchain),
+      .api = spec->api,
+      .stl = spec->stl,
+      .after = spec->after,
+      .target = g_object_ref(target),
+      .manifest = g_object_ref(manifest),
+      .logs = kikai_join(storage, "logs", "toolchain", NULL),
+    };
+    g_array_append_val(jobs, job);
+  }
 
-    if (!g_subprocess_wait_check(sp, NULL, &error)) {
-      g_printerr("make_standalone_toolchain failed: %s", error->message);
-      return FALSE;
-    }
+  // Each platform's toolchain is independent, so they are all created at once.
+  g_autoptr(GPtrArray) threads = g_ptr_array_new();
+  for (int i = 0; i < jobs->len; i++) {
+    ToolchainJob *job = &g_array_index(jobs, ToolchainJob, i);
+    kikai_printstatus("toolchain", "Creating %s toolchain (this may take a while)...",
+                      job->platform);
+    g_ptr_array_add(threads, g_thread_new(job->platform, create_toolchain, job));
+  }
 
-    if (spec->after != NULL) {
-      gchar *args[] = {"/bin/sh", "-ec", (gchar*)spec->after, NULL};
-      gint status;
-      if (!g_spawn_sync(g_file_get_path(target), args, NULL, G_SPAWN_DEFAULT, NULL, NULL,
-                        NULL, NULL, &status, &error)) {
-        g_printerr("Failed to spawn toolchain.after: %s", error->message);
-        return FALSE;
-      }
+  gboolean success = TRUE;
+  for (int i = 0; i < jobs->len; i++) {
+    ToolchainJob *job = &g_array_index(jobs, ToolchainJob, i);
+    g_thread_join(threads->pdata[i]);
 
-      if (!g_spawn_check_exit_status(status, &error)) {
-        g_printerr("toolchain.after failed: %s", error->message);
-        return FALSE;
-      }
+    g_autofree gchar *key = g_strjoin("::", "toolchain", job->platform, NULL);
+    if (!job->success || !kikai_db_set(key, job->hash)) {
+      success = FALSE;
     }
 
-    if (!kikai_db_set("toolchain", current_hash)) {
-      return FALSE;
-    }
+    g_object_unref(job->target);
+    g_object_unref(job->manifest);
+    g_object_unref(job->logs);
   }
 
-  return TRUE;
+  if (success && jobs->len != 0) {
+    gint64 start = kikai_trace_now();
+    success = dedup_toolchains(ndk_file, toolchains);
+    kikai_trace_span("toolchain", "dedup", start);
+  }
+
+  return success;
 }
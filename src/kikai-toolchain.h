@@ -8,7 +8,12 @@
 typedef struct KikaiToolchain KikaiToolchain;
 
 struct KikaiToolchain {
-  const gchar *platform, *path, *cc, *cxx, *triple;
+  const gchar *platform, *api, *path, *cc, *cxx, *triple, *hash;
+  // Like hash, but the same for the same compiler wherever it's installed, so it can key
+  // what's shared between projects.
+  const gchar *id;
+  // What the NDK's CMake toolchain file and Meson's cross files call this platform.
+  const gchar *ndk, *stl, *abi, *cpu_family;
   gboolean standalone;
 };
 
@@ -0,0 +1,110 @@
+#include <glib.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "kikai-trace.h"
+
+static FILE *trace = NULL;
+static gint64 trace_origin = 0;
+static gboolean trace_first = TRUE;
+static GMutex trace_lock;
+
+static void trace_close() {
+  fputs("\n]}\n", trace);
+  fclose(trace);
+}
+
+gboolean kikai_trace_open(const gchar *path) {
+  trace = fopen(path, "w");
+  if (trace == NULL) {
+    g_printerr("Failed to open %s: %s", path, strerror(errno));
+    return FALSE;
+  }
+
+  trace_origin = g_get_monotonic_time();
+  fputs("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [", trace);
+  atexit(trace_close);
+  return TRUE;
+}
+
+gint64 kikai_trace_now() {
+  return trace != NULL ? g_get_monotonic_time() : 0;
+}
+
+static void append_json_string(GString *out, const gchar *value) {
+  g_string_append_c(out, '"');
+  for (const gchar *p = value; *p; p++) {
+    if (*p == '"' || *p == '\\') {
+      g_string_append_c(out, '\\');
+      g_string_append_c(out, *p);
+    } else if ((guchar)*p < 0x20) {
+      g_string_append_printf(out, "\\u%04x", *p);
+    } else {
+      g_string_append_c(out, *p);
+    }
+  }
+  g_string_append_c(out, '"');
+}
+
+// Writes a complete ("X") event, with args being either NULL or the already-formatted
+// members of the event's args object.
+static void write_event(const gchar *category, const gchar *name, gint64 start,
+                        const gchar *args) {
+  gint64 end = g_get_monotonic_time();
+
+  g_autoptr(GString) event = g_string_new("{\"name\": ");
+  append_json_string(event, name);
+  g_string_append(event, ", \"cat\": ");
+  append_json_string(event, category);
+  g_string_append_printf(event, ", \"ph\": \"X\", \"ts\": %" G_GINT64_FORMAT
+                         ", \"dur\": %" G_GINT64_FORMAT ", \"pid\": %d, \"tid\": %ld",
+                         start - trace_origin, end - start, getpid(),
+                         (long)syscall(SYS_gettid));
+  if (args != NULL) {
+    g_string_append_printf(event, ", \"args\": {%s}", args);
+  }
+  g_string_append_c(event, '}');
+
+  g_mutex_lock(&trace_lock);
+  fputs(trace_first ? "\n" : ",\n", trace);
+  fputs(event->str, trace);
+  trace_first = FALSE;
+  g_mutex_unlock(&trace_lock);
+}
+
+void kikai_trace_span(const gchar *category, const gchar *name, gint64 start) {
+  if (trace != NULL) {
+    write_event(category, name, start, NULL);
+  }
+}
+
+void kikai_trace_process(const gchar *name, gint64 start, gchar **args, gint status,
+                         const struct rusage *usage) {
+  if (trace == NULL) {
+    return;
+  }
+
+  g_autoptr(GString) members = g_string_new("\"command\": ");
+  g_autofree gchar *command = g_strjoinv(" ", args);
+  append_json_string(members, command);
+
+  // The usage covers the child along with every descendant it waited for, which for
+  // make means the whole compiler tree.
+  g_string_append_printf(members,
+                         ", \"status\": %d, \"user_ms\": %ld, \"system_ms\": %ld"
+                         ", \"max_rss_kb\": %ld, \"read_blocks\": %ld"
+                         ", \"write_blocks\": %ld, \"major_faults\": %ld"
+                         ", \"context_switches\": %ld",
+                         status,
+                         usage->ru_utime.tv_sec * 1000 + usage->ru_utime.tv_usec / 1000,
+                         usage->ru_stime.tv_sec * 1000 + usage->ru_stime.tv_usec / 1000,
+                         usage->ru_maxrss, usage->ru_inblock, usage->ru_oublock,
+                         usage->ru_majflt, usage->ru_nvcsw + usage->ru_nivcsw);
+
+  write_event("process", name, start, members->str);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <glib.h>
+
+#include <sys/resource.h>
+
+// Records spans in the Chrome trace event format, which chrome://tracing and Perfetto
+// can both load. Everything is a no-op until kikai_trace_open is called.
+gboolean kikai_trace_open(const gchar *path);
+gint64 kikai_trace_now();
+void kikai_trace_span(const gchar *category, const gchar *name, gint64 start);
+void kikai_trace_process(const gchar *name, gint64 start, gchar **args, gint status,
+                         const struct rusage *usage);
@@ -1,8 +1,10 @@
 #include <glib.h>
 #include <glib/gprintf.h>
+#include <glib/gstdio.h>
 
 #include "kikai-utils.h"
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -66,6 +68,11 @@ gchar *kikai_hash_bytes(const gchar *first, ...) {
   return g_strdup(g_checksum_get_string(sha));
 }
 
+void kikai_checksum_update_string(GChecksum *sha, const gchar *value) {
+  g_checksum_update(sha, (guchar *)(value != NULL ? value : ""), -1);
+  g_checksum_update(sha, (guchar *)"", 1);
+}
+
 GFile *kikai_join(GFile *parent, const gchar *child, ...) {
   va_list args;
   va_start(args, child);
@@ -85,7 +92,115 @@ GFile *kikai_join(GFile *parent, const gchar *child, ...) {
   return current;
 }
 
+static gboolean tree_walk_dir(const gchar *root, const gchar *relative,
+                              KikaiTreeFunc func, gpointer user_data) {
+  g_autofree gchar *path = relative != NULL ? g_build_filename(root, relative, NULL)
+                           : g_strdup(root);
+  g_autoptr(GError) error = NULL;
+
+  GDir *dir = g_dir_open(path, 0, &error);
+  if (dir == NULL) {
+    g_printerr("Failed to open %s: %s", path, error->message);
+    return FALSE;
+  }
+
+  gboolean success = TRUE;
+  const gchar *name;
+  while (success && (name = g_dir_read_name(dir)) != NULL) {
+    g_autofree gchar *child_relative = relative != NULL
+                                       ? g_build_filename(relative, name, NULL)
+                                       : g_strdup(name);
+    g_autofree gchar *child = g_build_filename(root, child_relative, NULL);
+
+    struct stat st;
+    if (lstat(child, &st) == -1) {
+      g_printerr("Failed to stat %s: %s", child, strerror(errno));
+      success = FALSE;
+      break;
+    }
+
+    // Directories are only descended into; the callback sees everything else.
+    if (S_ISDIR(st.st_mode)) {
+      success = tree_walk_dir(root, child_relative, func, user_data);
+    } else {
+      success = func(child_relative, child, &st, user_data);
+    }
+  }
+
+  g_dir_close(dir);
+  return success;
+}
+
+gboolean kikai_tree_walk(const gchar *root, KikaiTreeFunc func, gpointer user_data) {
+  if (!g_file_test(root, G_FILE_TEST_IS_DIR)) {
+    return TRUE;
+  }
+
+  return tree_walk_dir(root, NULL, func, user_data);
+}
+
+static gboolean list_file(const gchar *relative, const gchar *path, struct stat *st,
+                          gpointer user_data) {
+  GPtrArray *paths = user_data;
+  g_ptr_array_add(paths, g_strdup(relative));
+  return TRUE;
+}
+
+gboolean kikai_tree_list(const gchar *root, GPtrArray *paths) {
+  return kikai_tree_walk(root, list_file, paths);
+}
+
+static gboolean rmtree_path(const gchar *path) {
+  struct stat st;
+  if (lstat(path, &st) == -1) {
+    if (errno == ENOENT) {
+      return TRUE;
+    }
+
+    g_printerr("Failed to stat %s: %s", path, strerror(errno));
+    return FALSE;
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    g_autoptr(GError) error = NULL;
+    GDir *dir = g_dir_open(path, 0, &error);
+    if (dir == NULL) {
+      g_printerr("Failed to open %s: %s", path, error->message);
+      return FALSE;
+    }
+
+    gboolean success = TRUE;
+    const gchar *name;
+    while (success && (name = g_dir_read_name(dir)) != NULL) {
+      g_autofree gchar *child = g_build_filename(path, name, NULL);
+      success = rmtree_path(child);
+    }
+
+    g_dir_close(dir);
+    if (!success) {
+      return FALSE;
+    }
+
+    if (g_rmdir(path) == -1) {
+      g_printerr("Failed to remove %s: %s", path, strerror(errno));
+      return FALSE;
+    }
+  } else if (g_unlink(path) == -1) {
+    g_printerr("Failed to remove %s: %s", path, strerror(errno));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+gboolean kikai_rmtree(GFile *dir) {
+  g_autofree gchar *path = g_file_get_path(dir);
+  return rmtree_path(path);
+}
+
 static GDBM_FILE kikai_db = NULL;
+// gdbm itself isn't thread-safe, so every access goes through this lock.
+static GMutex kikai_db_lock;
 gchar kikai_db_missing = '\0';
 
 gboolean kikai_db_load(GFile *storage) {
@@ -109,6 +224,7 @@ void kikai_db_close() {
 
 gchar *kikai_db_get(const gchar *key) {
   datum dkey = {.dptr = (gchar *)key, .dsize = strlen(key)};
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&kikai_db_lock);
   datum dvalue = gdbm_fetch(kikai_db, dkey);
 
   if (dvalue.dptr == NULL) {
@@ -126,6 +242,7 @@ gchar *kikai_db_get(const gchar *key) {
 gboolean kikai_db_set(const gchar *key, const gchar *value) {
   datum dkey = {.dptr = (gchar *)key, .dsize = strlen(key)};
   datum dvalue = {.dptr = (gchar *)value, .dsize = strlen(value) + 1};
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&kikai_db_lock);
 
   if (gdbm_store(kikai_db, dkey, dvalue, GDBM_REPLACE) == -1) {
     g_printerr("Failed store key %s: %s", key, gdbm_db_strerror(kikai_db));
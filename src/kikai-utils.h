@@ -3,6 +3,8 @@
 #include <glib.h>
 #include <gio/gio.h>
 
+#include <sys/stat.h>
+
 #define KIKAI_CRESET "\033[0m"
 #define KIKAI_CBOLD "\033[1m"
 
@@ -12,8 +14,18 @@
 void kikai_printstatus(const gchar *descr, const gchar *fmt, ...) G_GNUC_PRINTF(2, 3);
 gboolean kikai_mkdir_parents(GFile *dir);
 gchar *kikai_hash_bytes(const gchar *first, ...) G_GNUC_NULL_TERMINATED;
+// Adds value (NULL hashing like "") and a NUL terminator, so consecutive strings can't
+// run into each other.
+void kikai_checksum_update_string(GChecksum *sha, const gchar *value);
 GFile *kikai_join(GFile *parent, const gchar *child, ...) G_GNUC_NULL_TERMINATED;
 
+typedef gboolean (*KikaiTreeFunc)(const gchar *relative, const gchar *path,
+                                  struct stat *st, gpointer user_data);
+gboolean kikai_tree_walk(const gchar *root, KikaiTreeFunc func, gpointer user_data);
+// Appends the relative path of every non-directory under root to paths.
+gboolean kikai_tree_list(const gchar *root, GPtrArray *paths);
+gboolean kikai_rmtree(GFile *dir);
+
 extern gchar kikai_db_missing;
 
 gboolean kikai_db_load(GFile *storage);
@@ -0,0 +1,210 @@
+#include <glib.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "kikai-watch.h"
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                      IN_MOVED_TO | IN_DELETE_SELF)
+
+typedef struct {
+  gchar *path;
+  // Set when the whole directory is watched; files maps single watched names to tags.
+  gchar *tree_tag;
+  gboolean recursive;
+  GHashTable *files;
+} WatchDir;
+
+struct KikaiWatch {
+  int fd;
+  GHashTable *dirs;
+};
+
+static void watch_dir_free(gpointer data) {
+  WatchDir *dir = data;
+  g_free(dir->path);
+  g_free(dir->tree_tag);
+  g_hash_table_unref(dir->files);
+  g_free(dir);
+}
+
+KikaiWatch *kikai_watch_new() {
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd == -1) {
+    g_printerr("Failed to initialize inotify: %s", strerror(errno));
+    return NULL;
+  }
+
+  KikaiWatch *watch = g_new0(KikaiWatch, 1);
+  watch->fd = fd;
+  watch->dirs = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                      watch_dir_free);
+  return watch;
+}
+
+static WatchDir *add_dir(KikaiWatch *watch, const gchar *path) {
+  int wd = inotify_add_watch(watch->fd, path, WATCH_EVENTS | IN_ONLYDIR);
+  if (wd == -1) {
+    g_printerr("Failed to watch %s: %s", path, strerror(errno));
+    return NULL;
+  }
+
+  // Watching the same directory twice returns the same descriptor.
+  WatchDir *dir = g_hash_table_lookup(watch->dirs, GINT_TO_POINTER(wd));
+  if (dir == NULL) {
+    dir = g_new0(WatchDir, 1);
+    dir->path = g_strdup(path);
+    dir->files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    g_hash_table_insert(watch->dirs, GINT_TO_POINTER(wd), dir);
+  }
+
+  return dir;
+}
+
+gboolean kikai_watch_add_file(KikaiWatch *watch, const gchar *path, const gchar *tag) {
+  g_autofree gchar *dirname = g_path_get_dirname(path);
+  WatchDir *dir = add_dir(watch, dirname);
+  if (dir == NULL) {
+    return FALSE;
+  }
+
+  g_hash_table_insert(dir->files, g_path_get_basename(path), g_strdup(tag));
+  return TRUE;
+}
+
+gboolean kikai_watch_add_dir(KikaiWatch *watch, const gchar *path, const gchar *tag,
+                             gboolean recursive) {
+  WatchDir *dir = add_dir(watch, path);
+  if (dir == NULL) {
+    return FALSE;
+  }
+
+  g_free(dir->tree_tag);
+  dir->tree_tag = g_strdup(tag);
+  dir->recursive = recursive;
+  if (!recursive) {
+    return TRUE;
+  }
+
+  g_autoptr(GError) error = NULL;
+  GDir *entries = g_dir_open(path, 0, &error);
+  if (entries == NULL) {
+    g_printerr("Failed to open %s: %s", path, error->message);
+    return FALSE;
+  }
+
+  gboolean success = TRUE;
+  const gchar *entry;
+  while (success && (entry = g_dir_read_name(entries)) != NULL) {
+    g_autofree gchar *child = g_build_filename(path, entry, NULL);
+    if (g_file_test(child, G_FILE_TEST_IS_DIR) &&
+        !g_file_test(child, G_FILE_TEST_IS_SYMLINK)) {
+      success = kikai_watch_add_dir(watch, child, tag, TRUE);
+    }
+  }
+
+  g_dir_close(entries);
+  return success;
+}
+
+static void read_events(KikaiWatch *watch, GHashTable *tags) {
+  gchar buffer[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  for (;;) {
+    ssize_t len = read(watch->fd, buffer, sizeof(buffer));
+    if (len <= 0) {
+      if (len == -1 && errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+
+    for (gchar *ptr = buffer; ptr < buffer + len;) {
+      struct inotify_event *event = (struct inotify_event *)ptr;
+      ptr += sizeof(struct inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        // Events were lost, so everything may have changed.
+        GHashTableIter iter;
+        WatchDir *dir;
+        g_hash_table_iter_init(&iter, watch->dirs);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&dir)) {
+          if (dir->tree_tag != NULL) {
+            g_hash_table_add(tags, g_strdup(dir->tree_tag));
+          }
+
+          GHashTableIter files;
+          gchar *tag;
+          g_hash_table_iter_init(&files, dir->files);
+          while (g_hash_table_iter_next(&files, NULL, (gpointer *)&tag)) {
+            g_hash_table_add(tags, g_strdup(tag));
+          }
+        }
+        continue;
+      }
+
+      WatchDir *dir = g_hash_table_lookup(watch->dirs, GINT_TO_POINTER(event->wd));
+      if (dir == NULL) {
+        continue;
+      } else if (event->mask & IN_IGNORED) {
+        g_hash_table_remove(watch->dirs, GINT_TO_POINTER(event->wd));
+        continue;
+      }
+
+      const gchar *tag = event->len > 0 ? g_hash_table_lookup(dir->files, event->name)
+                         : NULL;
+      if (tag == NULL) {
+        tag = dir->tree_tag;
+      }
+      if (tag == NULL) {
+        continue;
+      }
+
+      g_hash_table_add(tags, g_strdup(tag));
+
+      if (dir->recursive && event->len > 0 && (event->mask & IN_ISDIR) &&
+          (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+        g_autofree gchar *child = g_build_filename(dir->path, event->name, NULL);
+        kikai_watch_add_dir(watch, child, dir->tree_tag, TRUE);
+      }
+    }
+  }
+}
+
+GHashTable *kikai_watch_wait(KikaiWatch *watch, guint settle_ms) {
+  GHashTable *tags = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  struct pollfd pfd = {.fd = watch->fd, .events = POLLIN};
+
+  // A checkout touches many files at once, so changes are collected until they settle.
+  int timeout = -1;
+  for (;;) {
+    int ready = poll(&pfd, 1, timeout);
+    if (ready == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      g_printerr("Failed to wait for changes: %s", strerror(errno));
+      g_hash_table_unref(tags);
+      return NULL;
+    } else if (ready == 0) {
+      if (g_hash_table_size(tags) > 0) {
+        return tags;
+      }
+      timeout = -1;
+      continue;
+    }
+
+    read_events(watch, tags);
+    timeout = settle_ms;
+  }
+}
+
+void kikai_watch_drain(KikaiWatch *watch) {
+  g_autoptr(GHashTable) tags = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                                     NULL);
+  read_events(watch, tags);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <glib.h>
+
+typedef struct KikaiWatch KikaiWatch;
+
+KikaiWatch *kikai_watch_new();
+// Watches the file's directory, so editors that save by replacing the file are noticed.
+gboolean kikai_watch_add_file(KikaiWatch *watch, const gchar *path, const gchar *tag);
+// Recursive watches also cover subdirectories created later.
+gboolean kikai_watch_add_dir(KikaiWatch *watch, const gchar *path, const gchar *tag,
+                             gboolean recursive);
+// Returns the set of tags that changed, once nothing has changed for settle_ms.
+GHashTable *kikai_watch_wait(KikaiWatch *watch, guint settle_ms);
+// Discards pending changes, such as the ones made by a build itself.
+void kikai_watch_drain(KikaiWatch *watch);
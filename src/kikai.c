@@ -6,31 +6,114 @@
 #include <string.h>
 #include <stdio.h>
 
+#include "kikai-artifact.h"
 #include "kikai-builderspec.h"
 #include "kikai-build.h"
+#include "kikai-ccache.h"
+#include "kikai-cgroup.h"
+#include "kikai-fingerprint.h"
+#include "kikai-install.h"
+#include "kikai-jobs.h"
+#include "kikai-remote.h"
+#include "kikai-scheduler.h"
 #include "kikai-source.h"
+#include "kikai-store.h"
+#include "kikai-strip.h"
+#include "kikai-tmpfs.h"
 #include "kikai-toolchain.h"
+#include "kikai-trace.h"
 #include "kikai-utils.h"
+#include "kikai-watch.h"
+
+// How long watch mode waits for changes to settle before rebuilding.
+#define WATCH_SETTLE_MS 300
+
+typedef struct {
+  GFile *storage, *install_root;
+  KikaiBuilderSpec builder;
+  GArray *modules_to_run, *toolchains;
+  // The modules named on the command line, or NULL for all of them.
+  gchar **requested;
+  // The variant named on the command line, or NULL to build modules as they're specced.
+  const gchar *variant_name;
+  KikaiVariantSpec *variant;
+  // Set when a module had no fingerprint, so only a full run can tell it's up to date.
+  gboolean unfingerprinted;
+} KikaiRun;
+
+// The state shared by the threads building modules at the same time.
+typedef struct {
+  KikaiRun *run;
+  GHashTable *changed, *artifact_keys, *fingerprints;
+  // Guards artifact_keys and the install prefixes.
+  GMutex lock;
+  gboolean remote;
+} BuildState;
+
+// How a module is going to be built, decided before anything starts.
+typedef struct {
+  KikaiModuleSpec *module;
+  gboolean changed, remote;
+  guint jobs;
+  // What the module's cgroup is limited to, when cgroups are in use.
+  guint64 memory_limit;
+} ModulePlan;
 
 static void on_error(const gchar *string) {
   fprintf(stderr, KIKAI_CBOLD KIKAI_CRED "Error: " KIKAI_CRESET "%s\n", string);
 }
 
+// Downloads and extracted sources are the same whatever the variant, so they're kept
+// under an id of the module's name alone.
+static gchar *get_source_id(const gchar *name) {
+  return kikai_hash_bytes(name, -1, NULL);
+}
+
+// A module's id names its build directories and recorded state, so each variant gets
+// its own and switching between them doesn't throw the others' builds away.
+static gchar *get_module_id(KikaiRun *run, const gchar *name) {
+  if (run->variant == NULL) {
+    return get_source_id(name);
+  }
+
+  return kikai_hash_bytes(name, -1, "", 1, run->variant->name, -1, NULL);
+}
+
+// Variants install next to the default install root unless they say otherwise, so their
+// trees never mix.
+static GFile *get_install_root(KikaiRun *run) {
+  KikaiVariantSpec *variant = run->variant;
+  if (variant == NULL) {
+    return g_file_new_for_path(run->builder.install_root);
+  } else if (variant->install_root != NULL) {
+    return g_file_new_for_path(variant->install_root);
+  }
+
+  g_autoptr(GFile) root = g_file_new_for_path(run->builder.install_root);
+  g_autoptr(GFile) parent = g_file_get_parent(root);
+  g_autofree gchar *basename = g_file_get_basename(root);
+  g_autofree gchar *name = g_strjoin("-", basename, variant->name, NULL);
+  return g_file_get_child(parent, name);
+}
+
 static gboolean process_deps(GArray *modules_to_run, GHashTable *already_present,
-                             GHashTable *all_modules, gchar **requested_modules) {
+                             KikaiBuilderSpec *builder, gchar **requested_modules) {
   for (; *requested_modules; requested_modules++) {
     gchar *module_name = *requested_modules;
     if (!g_hash_table_add(already_present, module_name)) {
       continue;
     }
 
-    KikaiModuleSpec *module = g_hash_table_lookup(all_modules, module_name);
-    if (module == NULL) {
+    // Modules from included files are only loaded here, once something needs them.
+    KikaiModuleSpec *module;
+    if (!kikai_builderspec_get_module(builder, module_name, &module)) {
+      return FALSE;
+    } else if (module == NULL) {
       g_printerr("Non-existent module: %s", module_name);
       return FALSE;
     }
 
-    if (!process_deps(modules_to_run, already_present, all_modules,
+    if (!process_deps(modules_to_run, already_present, builder,
                       (gchar **)module->dependencies->data)) {
       return FALSE;
     }
@@ -41,90 +124,661 @@ static gboolean process_deps(GArray *modules_to_run, GHashTable *already_present
   return TRUE;
 }
 
-int main(int argc, char **argv) {
-  g_set_printerr_handler(on_error);
+static gboolean load_spec(KikaiRun *run) {
+  gint64 start = kikai_trace_now();
+  g_autoptr(GFile) spec_cache = g_file_get_child(run->storage, "spec.cache");
+  if (!kikai_builderspec_parse(&run->builder, "kikai.yml", spec_cache)) {
+    return FALSE;
+  }
+  kikai_trace_span("spec", "kikai.yml", start);
 
-  if (argc >= 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)) {
-    puts("usage: kikai [modules...]");
-    return 0;
+  run->variant = NULL;
+  if (run->variant_name != NULL) {
+    kikai_builderspec_get_variant(&run->builder, run->variant_name, &run->variant);
+    if (run->variant == NULL) {
+      g_printerr("Non-existent variant: %s", run->variant_name);
+      return FALSE;
+    }
   }
 
-  KikaiBuilderSpec builder;
-  if (!kikai_builderspec_parse(&builder, "kikai.yml")) {
-    return 1;
+  if (run->builder.compiler_cache && kikai_ccache_launcher() == NULL &&
+      !kikai_ccache_enable(run->storage)) {
+    return FALSE;
   }
 
-  GFile *storage = g_file_new_for_path(".kikai");
-  if (!kikai_mkdir_parents(storage)) {
-    return 1;
+  if (!kikai_artifact_init(run->storage, run->builder.artifact_cache) ||
+      !kikai_store_init(run->builder.store) ||
+      !kikai_tmpfs_init(run->storage, &run->builder.tmpfs) || !kikai_remote_init() ||
+      (run->builder.cgroups && !kikai_cgroup_init())) {
+    return FALSE;
   }
-  g_assert(g_file_query_exists(storage, NULL));
 
-  if (!kikai_db_load(storage)) {
-    return 1;
+  gchar **requested_modules = run->requested;
+  if (requested_modules == NULL) {
+    requested_modules = kikai_builderspec_get_module_names(&run->builder);
+  }
+
+  run->modules_to_run = g_array_new(FALSE, FALSE, sizeof(gchar *));
+  g_autoptr(GHashTable) already_present = g_hash_table_new(g_str_hash, g_str_equal);
+  if (!process_deps(run->modules_to_run, already_present, &run->builder,
+                    requested_modules)) {
+    return FALSE;
+  }
+
+  for (int i = 0; run->variant != NULL && i < run->modules_to_run->len; i++) {
+    KikaiModuleSpec *module = g_array_index(run->modules_to_run, KikaiModuleSpec*, i);
+    kikai_builderspec_apply_variant(module, run->variant);
+  }
+
+  run->toolchains = g_array_new(FALSE, FALSE, sizeof(KikaiToolchain));
+  if (!kikai_toolchain_create(run->storage, run->toolchains, &run->builder.toolchain)) {
+    return FALSE;
+  }
+
+  run->install_root = get_install_root(run);
+  return kikai_mkdir_parents(run->install_root);
+}
+
+// Every module the given one depends on, directly or not, by id.
+static void collect_dependencies(KikaiRun *run, KikaiModuleSpec *module,
+                                 GHashTable *ids) {
+  for (gchar **dep = (gchar **)module->dependencies->data; *dep; dep++) {
+    gchar *id = get_module_id(run, *dep);
+    if (!g_hash_table_add(ids, id)) {
+      continue;
+    }
+
+    // Everything was loaded up front by process_deps.
+    KikaiModuleSpec *dependency;
+    kikai_builderspec_get_module(&run->builder, *dep, &dependency);
+    collect_dependencies(run, dependency, ids);
   }
+}
 
-  gchar **requested_modules;
-  if (argc == 1) {
-    guint len;
-    requested_modules = (gchar **)g_hash_table_get_keys_as_array(builder.modules, &len);
+// Builds a single module for every platform, with its build directories either in RAM
+// or in storage, or on a worker when one is given. used is set to the most space the
+// build directories took at once.
+static gboolean build_module(BuildState *state, ModulePlan *plan, const gchar *id,
+                             gboolean in_ram, KikaiWorker *worker, guint64 *used) {
+  KikaiRun *run = state->run;
+  KikaiModuleSpec *module = plan->module;
+  gboolean module_changed = plan->changed;
+  GFile *storage = run->storage;
+  GArray *toolchains = run->toolchains;
+  g_autoptr(GFile) work = in_ram ? kikai_tmpfs_get_dir(id) : g_object_ref(storage);
+
+  g_autofree gchar *short_id = g_strdup(id);
+  short_id[8] = '\0';
+
+  g_autofree gchar *folder = g_strconcat(module->name, "--", short_id, NULL);
+  g_autofree gchar *source_id = get_source_id(module->name);
+  g_autoptr(GFile) module_logs = kikai_join(storage, "logs", folder, NULL);
+  g_autoptr(GFile) module_build = kikai_join(work, "build", folder, NULL);
+  g_autoptr(GFile) extracted = kikai_join(in_ram && kikai_tmpfs_keep_sources() ? work
+                                          : storage, "extracted", source_id, NULL);
+  *used = 0;
+
+  // Whatever is in storage from an earlier build on disk would be stale by the time the
+  // module is built there again.
+  if (in_ram) {
+    g_autoptr(GFile) disk_build = kikai_join(storage, "build", folder, NULL);
+    g_autoptr(GFile) disk_extracted = kikai_join(storage, "extracted", source_id, NULL);
+    if (!kikai_rmtree(disk_build) ||
+        (kikai_tmpfs_keep_sources() && !kikai_rmtree(disk_extracted))) {
+      return FALSE;
+    }
+  }
+
+  KikaiSourceChanges changes = {FALSE, FALSE};
+  g_autoptr(GChecksum) inputs = g_checksum_new(G_CHECKSUM_SHA256);
+
+  if (worker != NULL) {
+    kikai_printstatus("build", "Building: %s (on %s)", module->name,
+                      kikai_remote_get_address(worker));
   } else {
-    requested_modules = argv + 1;
+    kikai_printstatus("build", "Building: %s%s", module->name,
+                      in_ram ? " (in RAM)" : "");
+  }
+  gint64 sources_start = kikai_trace_now();
+  for (int i = 0; i < module->sources->len; i++) {
+    KikaiModuleSourceSpec *source = &g_array_index(module->sources,
+                                                   KikaiModuleSourceSpec, i);
+    if (!kikai_processsource(storage, extracted, module_logs, source_id, source,
+                             &changes, inputs)) {
+      return FALSE;
+    }
+  }
+  if (!kikai_source_prune(storage, extracted, source_id, module->sources, &changes)) {
+    return FALSE;
   }
 
-  g_autoptr(GArray) modules_to_run = g_array_new(FALSE, FALSE, sizeof(gchar *));
-  g_autoptr(GHashTable) already_present = g_hash_table_new(g_str_hash, g_str_equal);
-  if (!process_deps(modules_to_run, already_present,
-                    builder.modules, requested_modules)) {
+  // Variants share the extracted sources, so one last built against others has to catch
+  // up with whatever changed since, build system included.
+  g_autofree gchar *built_key = g_strjoin("::", "built-sources", id, NULL);
+  g_autofree gchar *built = kikai_db_get(built_key);
+  if (built == NULL) {
     return FALSE;
+  } else if (built == &kikai_db_missing) {
+    g_steal_pointer(&built);
   }
+  gboolean behind = built != NULL && strcmp(built, g_checksum_get_string(inputs)) != 0;
+  kikai_trace_span("sources", module->name, sources_start);
 
-  GArray *toolchains = g_array_new(FALSE, FALSE, sizeof(KikaiToolchain));
-  if (!kikai_toolchain_create(storage, toolchains, &builder.toolchain)) {
-    return 1;
+  guint64 sources_used = worker == NULL && kikai_tmpfs_get_root() != NULL
+                         ? kikai_tmpfs_usage(extracted) : 0;
+
+  // Workers get the sources as they are after extraction and any after scripts, packed
+  // the first time a platform isn't in the artifact cache.
+  g_autoptr(GFile) scratch = kikai_join(storage, "remote", folder, NULL);
+  g_autoptr(GFile) sources_archive = g_file_get_child(scratch, "sources.tar.zst");
+  g_autoptr(GHashTable) dependencies = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                             g_free, NULL);
+  if (worker != NULL) {
+    collect_dependencies(run, module, dependencies);
+    if (!kikai_rmtree(scratch) || !kikai_mkdir_parents(scratch)) {
+      return FALSE;
+    }
   }
 
-  g_autoptr(GFile) install_root = g_file_new_for_path(builder.install_root);
-  if (!kikai_mkdir_parents(install_root)) {
-    return 1;
+  for (int i = 0; i < toolchains->len; i++) {
+    KikaiToolchain *toolchain = &g_array_index(toolchains, KikaiToolchain, i);
+    kikai_printstatus("build", "- %s", toolchain->platform);
+    gint64 platform_start = kikai_trace_now();
+
+    // A build directory that's gone, say because it was in RAM, has to be configured
+    // from scratch whatever the recorded state says.
+    g_autoptr(GFile) buildroot = g_file_get_child(module_build, toolchain->platform);
+    gboolean fresh = !g_file_query_exists(buildroot, NULL);
+    if (worker == NULL && !kikai_mkdir_parents(buildroot)) {
+      return FALSE;
+    }
+
+    g_autoptr(GFile) prefix = g_file_get_child(run->install_root, toolchain->platform);
+    g_autoptr(GFile) staging = kikai_join(storage, "staging", folder,
+                                          toolchain->platform, NULL);
+    g_autoptr(GFile) staged = kikai_install_get_staged(staging, prefix);
+    g_autoptr(GFile) logs = g_file_get_child(module_logs, toolchain->platform);
+
+    g_mutex_lock(&state->lock);
+    g_autofree gchar *key = kikai_artifact_key(module, inputs, toolchain, prefix,
+                                               state->artifact_keys);
+    g_autofree gchar *relocatable_key = kikai_store_enabled()
+                                        ? kikai_artifact_key(module, inputs, toolchain,
+                                                             NULL, state->artifact_keys)
+                                        : NULL;
+    g_mutex_unlock(&state->lock);
+
+    // A locally modified tree doesn't match what the artifact key describes, so it's
+    // neither restored from nor stored into the artifact cache or the store.
+    gboolean use_store = relocatable_key != NULL && !module_changed;
+    gboolean cached = FALSE, installed = FALSE;
+    g_autofree gchar *stored_key = NULL;
+    g_autoptr(GFile) stored = use_store ? kikai_store_lookup(key, relocatable_key,
+                                                             &stored_key) : NULL;
+    if (stored != NULL) {
+      cached = TRUE;
+    } else if (!module_changed &&
+               !kikai_artifact_restore(storage, id, toolchain->platform, key, staged,
+                                       prefix, &cached, &installed)) {
+      return FALSE;
+    }
+
+    if (!cached && worker != NULL) {
+      KikaiRemoteJob job = {
+        .module = module,
+        .toolchain = toolchain,
+        .platform = g_array_index(run->builder.toolchain.platforms,
+                                  KikaiToolchainPlatform, i),
+        .key = key,
+        .sources_hash = g_checksum_get_string(inputs),
+        .prefix = prefix,
+        .sources = sources_archive,
+        .dependencies = dependencies,
+        .scratch = scratch,
+      };
+
+      if ((!g_file_query_exists(sources_archive, NULL) &&
+           !kikai_remote_pack_tree(extracted, sources_archive)) ||
+          !kikai_remote_build(storage, worker, &job, staged, &installed)) {
+        return FALSE;
+      }
+    } else if (!cached) {
+      KikaiBuildContext ctx = {
+        .storage = storage,
+        .toolchain = toolchain,
+        .module_id = id,
+        .sources_hash = g_checksum_get_string(inputs),
+        .sources = extracted,
+        .buildroot = buildroot,
+        .install = prefix,
+        .staging = staging,
+        .logs = logs,
+        .jobs = plan->jobs,
+        .updated = changes.build_system || fresh || behind,
+        .changed = module_changed || changes.sources,
+      };
+
+      gboolean success = kikai_build(&ctx, module->build, &installed);
+      if (kikai_tmpfs_get_root() != NULL) {
+        *used = MAX(*used, sources_used + kikai_tmpfs_usage(buildroot));
+      }
+      if (!success) {
+        return FALSE;
+      }
+    }
+
+    // Stripping runs here rather than on workers, so its cache is shared by every build
+    // on this machine, and the archived tree is already stripped.
+    if (!cached && installed &&
+        ((module->strip && !kikai_strip_tree(storage, toolchain, staged, plan->jobs)) ||
+         (!module_changed && !kikai_artifact_store(id, toolchain->platform, key,
+                                                   staged)))) {
+      return FALSE;
+    }
+
+    // Only the installed files are kept, so each platform's build directory is dropped
+    // from RAM as soon as it's done.
+    if (in_ram && !kikai_rmtree(buildroot)) {
+      return FALSE;
+    }
+
+    // A fresh install, or one restored for this very key, moves into the store, and the
+    // prefix is relinked to it the first time, or once it lost some of it, even when the
+    // tree itself didn't change.
+    if (use_store && stored == NULL && (installed || cached) &&
+        !kikai_store_add(key, relocatable_key, staged, prefix, &stored, &stored_key)) {
+      return FALSE;
+    }
+    if (stored != NULL) {
+      installed = installed ||
+                  !kikai_store_is_merged(id, toolchain->platform, stored_key) ||
+                  !kikai_install_is_merged(storage, id, toolchain->platform, prefix);
+    }
+
+    g_mutex_lock(&state->lock);
+    gboolean merged = !installed ||
+                      (kikai_install_merge(storage, id, toolchain->platform,
+                                           stored != NULL ? stored : staged, prefix) &&
+                       (stored == NULL ||
+                        kikai_store_set_merged(id, toolchain->platform, stored_key)));
+    g_hash_table_insert(state->artifact_keys,
+                        g_strjoin("::", module->name, toolchain->platform, NULL),
+                        stored_key != NULL ? g_steal_pointer(&stored_key)
+                        : g_steal_pointer(&key));
+    g_mutex_unlock(&state->lock);
+    if (!merged) {
+      return FALSE;
+    }
+
+    g_autofree gchar *span = g_strjoin(":", module->name, toolchain->platform, NULL);
+    kikai_trace_span("build", span, platform_start);
   }
 
-  for (int i = 0; i < modules_to_run->len; i++) {
-    KikaiModuleSpec *module = g_array_index(modules_to_run, KikaiModuleSpec*, i);
+  return kikai_db_set(built_key, g_checksum_get_string(inputs)) &&
+         (worker == NULL || kikai_rmtree(scratch));
+}
+
+// Builds a module on this machine, in RAM when it fits there.
+static gboolean build_local(BuildState *state, ModulePlan *plan, const gchar *id) {
+  KikaiModuleSpec *module = plan->module;
+  // Edits made in place only exist in the extracted tree on disk.
+  guint64 claimed = 0;
+  gboolean in_ram = !(plan->changed && kikai_tmpfs_keep_sources()) &&
+                    kikai_tmpfs_claim(id, &claimed);
+  guint64 used = 0;
+  gboolean success = build_module(state, plan, id, in_ram, NULL, &used);
+
+  if (in_ram) {
+    gboolean exhausted = !success && kikai_tmpfs_exhausted(used);
+    if (!kikai_tmpfs_clear(id, claimed)) {
+      return FALSE;
+    }
 
-    g_autofree gchar *id = kikai_hash_bytes(module->name, -1, NULL);
-    g_autofree gchar *short_id = g_strdup(id);
-    short_id[8] = '\0';
+    if (exhausted) {
+      kikai_printstatus("build", "Out of RAM, retrying %s on disk", module->name);
+      success = build_module(state, plan, id, FALSE, NULL, &used);
+    }
+  }
 
-    g_autoptr(GFile) extracted = kikai_join(storage, "extracted", id, NULL);
+  return success && (used == 0 || kikai_tmpfs_record(id, used));
+}
 
-    gboolean updated = FALSE;
+static gboolean build_scheduled(gpointer item, gpointer user_data) {
+  ModulePlan *plan = item;
+  KikaiModuleSpec *module = plan->module;
+  BuildState *state = user_data;
+  g_autofree gchar *id = get_module_id(state->run, module->name);
 
-    kikai_printstatus("build", "Building: %s", module->name);
-    for (int i = 0; i < module->sources->len; i++) {
-      KikaiModuleSourceSpec *source = &g_array_index(module->sources,
-                                                     KikaiModuleSourceSpec, i);
-      if (!kikai_processsource(storage, extracted, id, source, &updated)) {
-        return 1;
+  gboolean success;
+  if (plan->remote) {
+    guint64 used;
+    KikaiWorker *worker = kikai_remote_acquire();
+    success = build_module(state, plan, id, FALSE, worker, &used);
+    kikai_remote_release(worker);
+  } else if (plan->memory_limit != 0) {
+    if (!kikai_cgroup_enter(id, plan->memory_limit)) {
+      return FALSE;
+    }
+
+    success = build_local(state, plan, id);
+    if (kikai_cgroup_leave()) {
+      g_autofree gchar *limit = g_format_size(plan->memory_limit);
+      g_printerr("%s ran out of memory, being limited to %s. Raise its memory-limit or "
+                 "memory-per-job.", module->name, limit);
+      success = FALSE;
+    }
+  } else {
+    success = build_local(state, plan, id);
+  }
+
+  const gchar *fingerprint = g_hash_table_lookup(state->fingerprints, module->name);
+  if (success && fingerprint != NULL) {
+    g_mutex_lock(&state->lock);
+    success = kikai_fingerprint_module_save(module, id, fingerprint,
+                                            state->run->toolchains,
+                                            state->artifact_keys);
+    g_mutex_unlock(&state->lock);
+  }
+
+  return success;
+}
+
+// Builds every module that's out of date. Modules in changed had their sources modified
+// behind kikai's back, so they're rebuilt even when their fingerprint and artifact key
+// say otherwise.
+static gboolean build_modules(KikaiRun *run, GHashTable *changed) {
+  GFile *storage = run->storage;
+  GArray *toolchains = run->toolchains;
+
+  g_autoptr(GHashTable) artifact_keys = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                               g_free, g_free);
+  g_autoptr(GHashTable) fingerprints = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                              NULL, g_free);
+  BuildState state = {
+    .run = run,
+    .changed = changed,
+    .artifact_keys = artifact_keys,
+    .fingerprints = fingerprints,
+    .remote = kikai_remote_count() != 0,
+  };
+
+  // Toolchain after scripts live next to the spec, so workers can't reproduce them.
+  if (state.remote && run->builder.toolchain.after != NULL) {
+    kikai_printstatus("build", "Toolchain has an after script, not using workers");
+    state.remote = FALSE;
+  }
+
+  g_mutex_init(&state.lock);
+
+  // Each worker takes one module at a time, while modules built here share this
+  // machine's CPUs and memory.
+  guint64 available = kikai_get_memory();
+  KikaiResources budget = {
+    .cpus = kikai_get_cpus(),
+    .memory = available,
+    .workers = kikai_remote_count(),
+  };
+  if (budget.memory == 0) {
+    budget.memory = G_MAXUINT64;
+  }
+
+  KikaiScheduler *scheduler = kikai_scheduler_new(&budget, build_scheduled, &state);
+  g_autoptr(GArray) plans = g_array_sized_new(FALSE, TRUE, sizeof(ModulePlan),
+                                              run->modules_to_run->len);
+
+  // Fingerprints only depend on the spec and on what's recorded, so whatever is up to
+  // date is known before anything is built.
+  for (int i = 0; i < run->modules_to_run->len; i++) {
+    KikaiModuleSpec *module = g_array_index(run->modules_to_run, KikaiModuleSpec*, i);
+    gboolean module_changed = changed != NULL &&
+                              g_hash_table_contains(changed, module->name);
+    g_autofree gchar *id = get_module_id(run, module->name);
+
+    gchar *fingerprint = kikai_fingerprint_module(module, toolchains, run->install_root,
+                                                  fingerprints);
+    run->unfingerprinted = run->unfingerprinted || fingerprint == NULL;
+    if (fingerprint != NULL) {
+      g_hash_table_insert(fingerprints, (gpointer)module->name, fingerprint);
+      if (!module_changed &&
+          kikai_fingerprint_module_current(storage, module, id, fingerprint, toolchains,
+                                           run->install_root, artifact_keys)) {
+        kikai_printstatus("build", "Up to date: %s", module->name);
+        continue;
       }
     }
 
-    for (int i = 0; i < toolchains->len; i++) {
-      KikaiToolchain *toolchain = &g_array_index(toolchains, KikaiToolchain, i);
-      kikai_printstatus("build", "- %s", toolchain->platform);
+    // Edits made in place only exist on this machine. A module that doesn't say how many
+    // CPUs it uses takes all of them, so it's built alone.
+    ModulePlan plan = {
+      .module = module,
+      .changed = module_changed,
+      .remote = state.remote && !module_changed,
+      .jobs = kikai_get_jobs(module->memory_per_job, module->cpus, available),
+    };
+
+    KikaiResources weight = {.workers = 1};
+    if (!plan.remote) {
+      guint64 memory_per_job = module->memory_per_job != 0 ? module->memory_per_job
+                               : KIKAI_DEFAULT_MEMORY_PER_JOB;
+      weight = (KikaiResources){
+        .cpus = plan.jobs,
+        .memory = MAX(plan.jobs * memory_per_job, module->memory_limit) +
+                  kikai_tmpfs_get_recorded(id),
+      };
+      plan.memory_limit = run->builder.cgroups ? weight.memory : 0;
+    }
+
+    // plans never grows past its initial size, so what's added stays put.
+    g_array_append_val(plans, plan);
+    kikai_scheduler_add(scheduler, module->name, (gchar **)module->dependencies->data,
+                        &weight, &g_array_index(plans, ModulePlan, plans->len - 1));
+  }
+
+  gboolean success = kikai_scheduler_run(scheduler);
+  kikai_scheduler_free(scheduler);
+  g_mutex_clear(&state.lock);
+  return success;
+}
 
-      g_autofree gchar *folder = g_strconcat(module->name, "--", short_id, NULL);
-      g_autoptr(GFile) buildroot = kikai_join(storage, "build", folder, toolchain->platform,
-                                              NULL);
-      if (!kikai_mkdir_parents(buildroot)) {
-        return 1;
+static gboolean save_run_fingerprint(KikaiRun *run, const gchar *run_key) {
+  // An empty stamp never matches, which also drops whatever an earlier run saved.
+  if (run->unfingerprinted) {
+    return kikai_db_set(run_key, "");
+  }
+
+  g_autofree gchar *install_root = g_file_get_path(run->install_root);
+  for (int i = 0; i < run->toolchains->len; i++) {
+    const gchar *platform = g_array_index(run->toolchains, KikaiToolchain, i).platform;
+    g_ptr_array_add(run->builder.files, g_build_filename(install_root, platform, NULL));
+  }
+
+  return kikai_fingerprint_run_save(run_key, run->builder.files);
+}
+
+static gboolean add_watches(KikaiRun *run, KikaiWatch *watch) {
+  for (int i = 0; i < run->builder.files->len; i++) {
+    const gchar *path = run->builder.files->pdata[i];
+    gboolean success = g_file_test(path, G_FILE_TEST_IS_DIR)
+                       ? kikai_watch_add_dir(watch, path, "spec", FALSE)
+                       : kikai_watch_add_file(watch, path, "spec");
+    if (!success) {
+      return FALSE;
+    }
+  }
+
+  for (int i = 0; i < run->modules_to_run->len; i++) {
+    KikaiModuleSpec *module = g_array_index(run->modules_to_run, KikaiModuleSpec*, i);
+    g_autofree gchar *id = get_source_id(module->name);
+    g_autofree gchar *tree_tag = g_strconcat("tree:", module->name, NULL);
+    g_autofree gchar *source_tag = g_strconcat("source:", module->name, NULL);
+
+    g_autoptr(GFile) extracted = kikai_join(run->storage, "extracted", id, NULL);
+    g_autofree gchar *extracted_path = g_file_get_path(extracted);
+    if (g_file_test(extracted_path, G_FILE_TEST_IS_DIR) &&
+        !kikai_watch_add_dir(watch, extracted_path, tree_tag, TRUE)) {
+      return FALSE;
+    }
+
+    for (int j = 0; j < module->sources->len; j++) {
+      KikaiModuleSourceSpec *source = &g_array_index(module->sources,
+                                                     KikaiModuleSourceSpec, j);
+      g_autofree gchar *local = g_filename_from_uri(source->url, NULL, NULL);
+      if (local != NULL && !kikai_watch_add_file(watch, local, source_tag)) {
+        return FALSE;
       }
+    }
+  }
+
+  return TRUE;
+}
+
+// The modules whose watches fired, and everything depending on them.
+static GHashTable *get_changed_modules(KikaiRun *run, GHashTable *tags) {
+  GHashTable *changed = g_hash_table_new(g_str_hash, g_str_equal);
+
+  // Dependencies always come before their dependents, so one pass is enough.
+  for (int i = 0; i < run->modules_to_run->len; i++) {
+    KikaiModuleSpec *module = g_array_index(run->modules_to_run, KikaiModuleSpec*, i);
+    g_autofree gchar *tree_tag = g_strconcat("tree:", module->name, NULL);
+    g_autofree gchar *source_tag = g_strconcat("source:", module->name, NULL);
 
-      if (!kikai_build(toolchain, id, module->build, extracted, buildroot, install_root,
-                       updated)) {
-        return 1;
+    if (g_hash_table_contains(tags, source_tag)) {
+      g_autofree gchar *id = get_source_id(module->name);
+      for (int j = 0; j < module->sources->len; j++) {
+        kikai_source_forget(run->storage, id,
+                            &g_array_index(module->sources, KikaiModuleSourceSpec, j));
       }
     }
+
+    gboolean module_changed = g_hash_table_contains(tags, tree_tag) ||
+                              g_hash_table_contains(tags, source_tag);
+    for (gchar **dep = (gchar **)module->dependencies->data;
+         !module_changed && *dep; dep++) {
+      module_changed = g_hash_table_contains(changed, *dep);
+    }
+
+    if (module_changed) {
+      g_hash_table_add(changed, (gpointer)module->name);
+    }
+  }
+
+  return changed;
+}
+
+static int watch_main(KikaiRun *run) {
+  KikaiWatch *watch = kikai_watch_new();
+  // The spec is watched even when it fails to load, so it can be fixed in place.
+  if (watch == NULL || !kikai_watch_add_file(watch, "kikai.yml", "spec")) {
+    return 1;
+  }
+
+  gboolean loaded = load_spec(run);
+  // Fingerprints skip unchanged modules, so NULL only forces no rebuilds.
+  g_autoptr(GHashTable) changed = NULL;
+
+  for (;;) {
+    // Watches go on after building, since a first build creates the extracted trees. The
+    // build's own extraction and after scripts mustn't trigger another round.
+    if (loaded) {
+      build_modules(run, changed);
+      add_watches(run, watch);
+    }
+
+    kikai_watch_drain(watch);
+    kikai_printstatus("watch", "Waiting for changes...");
+
+    g_autoptr(GHashTable) tags = kikai_watch_wait(watch, WATCH_SETTLE_MS);
+    if (tags == NULL) {
+      return 1;
+    }
+
+    if (g_hash_table_contains(tags, "spec")) {
+      kikai_printstatus("watch", "Reloading kikai.yml");
+      loaded = load_spec(run);
+    }
+
+    g_clear_pointer(&changed, g_hash_table_unref);
+    if (loaded) {
+      changed = get_changed_modules(run, tags);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  g_set_printerr_handler(on_error);
+
+  if (argc >= 2 && strcmp(argv[1], "--cc") == 0) {
+    return kikai_ccache_main(argc - 2, argv + 2);
+  }
+
+  g_autofree gchar *trace_path = NULL;
+  g_autofree gchar *variant = NULL;
+  GOptionEntry entries[] = {
+    {"trace", 0, 0, G_OPTION_ARG_FILENAME, &trace_path,
+     "Write a Chrome trace of the build to FILE", "FILE"},
+    {"variant", 0, 0, G_OPTION_ARG_STRING, &variant,
+     "Build the variant named NAME in kikai.yml", "NAME"},
+    {NULL},
+  };
+
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GOptionContext) options = g_option_context_new(
+    "[watch] [modules...] | worker ADDRESS");
+  g_option_context_add_main_entries(options, entries, NULL);
+  if (!g_option_context_parse(options, &argc, &argv, &error)) {
+    g_printerr("%s", error->message);
+    return 1;
+  }
+
+  gboolean watch = argc >= 2 && strcmp(argv[1], "watch") == 0;
+  gboolean worker = argc >= 2 && strcmp(argv[1], "worker") == 0;
+  if (worker && argc != 3) {
+    g_printerr("Usage: kikai worker unix:PATH|[HOST]:PORT, with KIKAI_WORKER_TOKEN set");
+    return 1;
+  }
+
+  if (watch || worker) {
+    argv[1] = argv[0];
+    argv++;
+    argc--;
+  }
+
+  if (trace_path != NULL && !kikai_trace_open(trace_path)) {
+    return 1;
+  }
+
+  KikaiRun run = {
+    .storage = g_file_new_for_path(".kikai"),
+    .requested = argc == 1 ? NULL : argv + 1,
+    .variant_name = variant,
+  };
+  if (!kikai_mkdir_parents(run.storage)) {
+    return 1;
+  }
+  g_assert(g_file_query_exists(run.storage, NULL));
+
+  if (!kikai_db_load(run.storage) || !kikai_source_init() || !kikai_jobs_init()) {
+    return 1;
+  }
+
+  if (worker) {
+    return kikai_remote_serve(run.storage, argv[1]);
+  }
+
+  if (watch) {
+    return watch_main(&run);
+  }
+
+  // When nothing the last identical run depended on has changed, there's nothing to do.
+  g_autofree gchar *run_key = kikai_fingerprint_run_key(variant, run.requested);
+  if (kikai_fingerprint_run_current(run_key)) {
+    kikai_printstatus("build", "Up to date.");
+    return 0;
+  }
+
+  if (!load_spec(&run) || !build_modules(&run, NULL) ||
+      !save_run_fingerprint(&run, run_key)) {
+    return 1;
   }
 
   return 0;